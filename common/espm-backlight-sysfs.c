@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2010 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "espm-backlight-sysfs.h"
+
+#ifdef EGG_TEST
+/* the self-tests point this at a fake backlight class */
+static const gchar *backlight_sysfs_dir = BACKLIGHT_SYSFS_LOCATION;
+#define BACKLIGHT_SYSFS_DIR backlight_sysfs_dir
+
+void
+espm_backlight_sysfs_set_location (const gchar *location)
+{
+  backlight_sysfs_dir = location != NULL ? location : BACKLIGHT_SYSFS_LOCATION;
+}
+#else
+#define BACKLIGHT_SYSFS_DIR BACKLIGHT_SYSFS_LOCATION
+#endif
+
+typedef enum {
+  BACKLIGHT_TYPE_UNKNOWN,
+  BACKLIGHT_TYPE_FIRMWARE,
+  BACKLIGHT_TYPE_PLATFORM,
+  BACKLIGHT_TYPE_RAW
+} BacklightType;
+
+static BacklightType
+espm_backlight_sysfs_get_type (const gchar *sysfs_path)
+{
+  gboolean ret;
+  gchar *filename = NULL;
+  GError *error = NULL;
+  gchar *type_tmp = NULL;
+  BacklightType type = BACKLIGHT_TYPE_UNKNOWN;
+
+  filename = g_build_filename (sysfs_path,
+             "type", NULL);
+  ret = g_file_get_contents (filename,
+           &type_tmp,
+           NULL, &error);
+  if (!ret) {
+    if (error)
+    {
+      g_warning ("failed to get type: %s", error->message);
+      g_error_free (error);
+    }
+    goto out;
+  }
+  if (g_str_has_prefix (type_tmp, "platform")) {
+    type = BACKLIGHT_TYPE_PLATFORM;
+    goto out;
+  }
+  if (g_str_has_prefix (type_tmp, "firmware")) {
+    type = BACKLIGHT_TYPE_FIRMWARE;
+    goto out;
+  }
+  if (g_str_has_prefix (type_tmp, "raw")) {
+    type = BACKLIGHT_TYPE_RAW;
+    goto out;
+  }
+out:
+  g_free (filename);
+  g_free (type_tmp);
+  return type;
+}
+
+static gint
+espm_backlight_sysfs_compare_names (gconstpointer a, gconstpointer b)
+{
+  return g_strcmp0 (*(const gchar **) a, *(const gchar **) b);
+}
+
+/*
+ * Names of all the backlight devices, sorted so that the list can be
+ * compared with the one stored in the cache
+ */
+GPtrArray *
+espm_backlight_sysfs_list_devices (void)
+{
+  const gchar *device_name;
+  GPtrArray *devices;
+  GDir *dir;
+  GError *error = NULL;
+
+  dir = g_dir_open (BACKLIGHT_SYSFS_DIR, 0, &error);
+  if (dir == NULL) {
+    if (error)
+    {
+      g_warning ("failed to find any devices: %s", error->message);
+      g_error_free (error);
+    }
+    return NULL;
+  }
+
+  devices = g_ptr_array_new_with_free_func (g_free);
+  while ((device_name = g_dir_read_name (dir)) != NULL)
+    g_ptr_array_add (devices, g_strdup (device_name));
+  g_dir_close (dir);
+
+  g_ptr_array_sort (devices, espm_backlight_sysfs_compare_names);
+  return devices;
+}
+
+/*
+ * Find best backlight using the kernel-supplied backlight type
+ */
+static gchar *
+espm_backlight_sysfs_scan (GPtrArray *devices)
+{
+  gchar *best_device = NULL;
+  gchar *filename;
+  BacklightType *backlight_types = NULL;
+  BacklightType preferred[] = { BACKLIGHT_TYPE_FIRMWARE, BACKLIGHT_TYPE_PLATFORM, BACKLIGHT_TYPE_RAW };
+  guint i, j;
+
+  /* find out the type of each backlight */
+  backlight_types = g_new0 (BacklightType, devices->len);
+  for (i = 0; i < devices->len; i++) {
+    filename = g_build_filename (BACKLIGHT_SYSFS_DIR,
+               g_ptr_array_index (devices, i), NULL);
+    backlight_types[i] = espm_backlight_sysfs_get_type (filename);
+    g_free (filename);
+  }
+
+  /* any devices of type firmware -> platform -> raw? */
+  for (j = 0; j < G_N_ELEMENTS (preferred) && best_device == NULL; j++) {
+    for (i = 0; i < devices->len; i++) {
+      if (backlight_types[i] == preferred[j]) {
+        best_device = g_strdup (g_ptr_array_index (devices, i));
+        break;
+      }
+    }
+  }
+
+  g_free (backlight_types);
+  return best_device;
+}
+
+/*
+ * The cache holds the chosen device on its first line, followed by the
+ * device list it was chosen from. It is only trusted while that list
+ * still matches what is in sysfs.
+ */
+static gchar *
+espm_backlight_sysfs_cache_contents (const gchar *best_device, GPtrArray *devices)
+{
+  GString *contents;
+  guint i;
+
+  contents = g_string_new (best_device);
+  g_string_append_c (contents, '\n');
+  for (i = 0; i < devices->len; i++) {
+    g_string_append (contents, g_ptr_array_index (devices, i));
+    g_string_append_c (contents, '\n');
+  }
+
+  return g_string_free (contents, FALSE);
+}
+
+static gchar *
+espm_backlight_sysfs_read_cache (GPtrArray *devices)
+{
+  gchar *contents = NULL;
+  gchar *expected = NULL;
+  gchar *best_device = NULL;
+  gchar *newline;
+
+  if (!g_file_get_contents (BACKLIGHT_CACHE_LOCATION, &contents, NULL, NULL))
+    return NULL;
+
+  newline = strchr (contents, '\n');
+  if (newline == NULL)
+    goto out;
+  *newline = '\0';
+
+  /* the device list also rules out anything that isn't a device name */
+  expected = espm_backlight_sysfs_cache_contents (contents, devices);
+  *newline = '\n';
+  if (g_strcmp0 (contents, expected) == 0 && strchr (contents, '/') == NULL)
+    best_device = g_strndup (contents, newline - contents);
+
+out:
+  g_free (expected);
+  g_free (contents);
+  return best_device;
+}
+
+/*
+ * Find the best backlight and return its sysfs path. Reading the type
+ * of every device is slow when there are many of them, so the choice
+ * is cached under /run and reused until the device list changes or
+ * rescan is set. Only root can write the cache, everyone can read it.
+ */
+gchar *
+espm_backlight_sysfs_get_best_backlight (gboolean rescan)
+{
+  GPtrArray *devices;
+  gchar *best_device = NULL;
+  gchar *contents;
+  gchar *path = NULL;
+
+  devices = espm_backlight_sysfs_list_devices ();
+
+  /* no backlights */
+  if (devices == NULL || devices->len == 0)
+    goto out;
+
+  if (!rescan)
+    best_device = espm_backlight_sysfs_read_cache (devices);
+
+  if (best_device == NULL) {
+    best_device = espm_backlight_sysfs_scan (devices);
+    if (best_device == NULL)
+      goto out;
+
+    contents = espm_backlight_sysfs_cache_contents (best_device, devices);
+    if (!g_file_set_contents (BACKLIGHT_CACHE_LOCATION, contents, -1, NULL))
+      g_debug ("could not cache the best backlight in %s", BACKLIGHT_CACHE_LOCATION);
+    g_free (contents);
+  }
+
+  path = g_build_filename (BACKLIGHT_SYSFS_DIR, best_device, NULL);
+
+out:
+  g_free (best_device);
+  if (devices != NULL)
+    g_ptr_array_unref (devices);
+  return path;
+}
+
+/*
+ * The sysfs path of the named backlight device, or NULL if there is no
+ * such device. Only names listed in sysfs are accepted, so a name can
+ * never point anywhere else.
+ */
+gchar *
+espm_backlight_sysfs_get_device (const gchar *name)
+{
+  GPtrArray *devices;
+  gchar *path = NULL;
+  guint i;
+
+  devices = espm_backlight_sysfs_list_devices ();
+  if (devices == NULL)
+    return NULL;
+
+  for (i = 0; i < devices->len; i++) {
+    if (g_strcmp0 (g_ptr_array_index (devices, i), name) == 0) {
+      path = g_build_filename (BACKLIGHT_SYSFS_DIR, name, NULL);
+      break;
+    }
+  }
+
+  g_ptr_array_unref (devices);
+  return path;
+}
+
+const gchar *
+espm_backlight_sysfs_get_type_name (const gchar *sysfs_path)
+{
+  switch (espm_backlight_sysfs_get_type (sysfs_path)) {
+    case BACKLIGHT_TYPE_FIRMWARE:
+      return "firmware";
+    case BACKLIGHT_TYPE_PLATFORM:
+      return "platform";
+    case BACKLIGHT_TYPE_RAW:
+      return "raw";
+    default:
+      return "unknown";
+  }
+}
+
+/*
+ * Read an integer from an open sysfs attribute. Attributes are
+ * regenerated on every read from the start, so the fd can be kept
+ * open and read again with pread instead of being reopened.
+ */
+gint
+espm_backlight_sysfs_read_fd (gint fd)
+{
+  gchar buf[32];
+  gssize length;
+
+  length = pread (fd, buf, sizeof (buf) - 1, 0);
+  if (length <= 0)
+    return -1;
+  buf[length] = '\0';
+
+  /* the brightness switch module parameter is a boolean */
+  if (buf[0] == 'N')
+    return 0;
+  if (buf[0] == 'Y')
+    return 1;
+
+  return atoi (buf);
+}
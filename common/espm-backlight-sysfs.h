@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2010 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __ESPM_BACKLIGHT_SYSFS_H
+#define __ESPM_BACKLIGHT_SYSFS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define BACKLIGHT_SYSFS_LOCATION  "/sys/class/backlight"
+#define BRIGHTNESS_SWITCH_LOCATION  "/sys/module/video/parameters/brightness_switch_enabled"
+#define BACKLIGHT_CACHE_LOCATION  "/run/espm-power-backlight"
+
+/*
+ * Shared by the backlight helper and EspmBrightness, so that the
+ * unprivileged reads and the privileged writes hit the same device.
+ * These only depend on GLib, the helper links nothing else.
+ */
+GPtrArray        *espm_backlight_sysfs_list_devices       (void);
+gchar            *espm_backlight_sysfs_get_best_backlight (gboolean rescan);
+gchar            *espm_backlight_sysfs_get_device         (const gchar *name);
+const gchar      *espm_backlight_sysfs_get_type_name      (const gchar *sysfs_path);
+gint              espm_backlight_sysfs_read_fd            (gint fd);
+#ifdef EGG_TEST
+void              espm_backlight_sysfs_set_location       (const gchar *location);
+#endif
+
+G_END_DECLS
+
+#endif /* __ESPM_BACKLIGHT_SYSFS_H */
@@ -26,7 +26,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
+#include <glib-unix.h>
 #include <gtk/gtk.h>
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
@@ -38,52 +44,290 @@
 #include <libexpidus1util/libexpidus1util.h>
 
 #include "espm-brightness.h"
+#include "espm-backlight-sysfs.h"
 #include "espm-debug.h"
 
 static void espm_brightness_finalize   (GObject *object);
+static void espm_brightness_stop_transition (EspmBrightness *brightness);
+static void espm_brightness_free_data  (EspmBrightness *brightness);
+#if !defined(BACKEND_TYPE_FREEBSD)
+static gboolean espm_brightness_logind_failed (EspmBrightness *brightness, gint32 level);
+#endif
+
+enum
+{
+  LEVEL_CHANGED,
+  LAST_SIGNAL
+};
+
+static guint signals [LAST_SIGNAL] = { 0 };
+
+/* time in microseconds a cached level is trusted without asking the hardware */
+#define LEVEL_CACHE_LIFETIME (2 * G_USEC_PER_SEC)
+
+/* seconds to wait for the backlight helper to answer a request, once authorized */
+#define HELPER_TIMEOUT 10
+
+/* time in microseconds before a refused helper channel is asked for again */
+#define HELPER_RETRY_INTERVAL (60 * G_USEC_PER_SEC)
+
+/* milliseconds between two steps of a transition, about one frame at 60 Hz */
+#define TRANSITION_FRAME_INTERVAL 16
+
+/* milliseconds the sysfs notifies may trail the last frame of a transition */
+#define TRANSITION_SETTLE_TIME 100
 
 struct EspmBrightnessPrivate
 {
   XRRScreenResources *resource;
   Atom    backlight;
-  gint    output;
+  RROutput    output;
+  /* every output with a usable backlight, the one in output comes first */
+  GArray     *outputs;
+  gint        xrandr_event_base;
+  gboolean    xrandr_watching;
+  /* property notifies still to come for our own writes */
+  guint       xrandr_pending_notifies;
   gboolean    xrandr_has_hw;
   gboolean    helper_has_hw;
-  gboolean    use_exp_step;
 
   gint32    max_level;
   gint32    current_level;
   gint32    min_level;
-  gint32    step;
-  gfloat    exp_step;
+  gboolean  current_level_valid;
+  gint64    current_level_time;
+  /* every change of the level reaches us, so the cache never goes stale */
+  gboolean  level_watched;
+  gboolean  verify_writes;
+  /* levels visited by up and down, see espm_brightness_build_steps */
+  gint32   *steps;
+  guint     n_steps;
+  guint     step_count;
+  gboolean  step_exponential;
+
+  /* serializes hardware access between the main thread and async requests */
+  GRecMutex lock;
+  GQueue   *requests;
+  GTask    *running_request;
+
+  /* smooth transition between two levels, driven by a single timer */
+  guint     transition_duration;
+  guint     transition_id;
+  gboolean  transition_active;
+  gint64    transition_start;
+  gint32    transition_from;
+  gint32    transition_to;
+  gint32    transition_level;
+
+#if !defined(BACKEND_TYPE_FREEBSD)
+  /* backlight device picked by the user, NULL for the best one */
+  gchar    *device;
+
+  /* reading the backlight needs no privileges, these stay open */
+  gchar    *sysfs_device;
+  gint      sysfs_level_fd;
+  gint      sysfs_max_fd;
+  guint     sysfs_watch_id;
+  GFileMonitor *sysfs_monitor;
+
+  /* level of our last write, until someone else changes it */
+  gint32    written_level;
+
+  /* writes through logind, no helper and no polkit prompt needed */
+  gboolean  logind_has_hw;
+  GDBusConnection *logind_bus;
+  /* levels of the SetBrightness calls not answered yet, oldest first */
+  GQueue   *logind_writes;
+#endif
+
+#ifdef ENABLE_POLKIT
+  /* authorized channel to espm-power-backlight-helper --serve, the
+   * lock serializes requests on it and is never held while waiting
+   * for the authorization */
+  GMutex    helper_lock;
+  GSocket  *helper_socket;
+  gboolean  helper_authorizing;
+  gboolean  helper_channel_failed;
+  gint64    helper_channel_failed_time;
+#endif
 };
 
+typedef struct
+{
+  RROutput  id;
+  gint32    min_level;
+  gint32    max_level;
+  gint32    level;
+} EspmBrightnessOutput;
+
+typedef enum
+{
+  BRIGHTNESS_REQUEST_GET_LEVEL,
+  BRIGHTNESS_REQUEST_SET_LEVEL,
+  BRIGHTNESS_REQUEST_UP,
+  BRIGHTNESS_REQUEST_DOWN
+} EspmBrightnessRequestType;
+
+typedef struct
+{
+  EspmBrightnessRequestType type;
+  gint32                    level;
+} EspmBrightnessRequest;
+
 G_DEFINE_TYPE_WITH_PRIVATE (EspmBrightness, espm_brightness, G_TYPE_OBJECT)
 
-static gint32
-espm_brightness_inc (EspmBrightness *brightness, gint32 level)
+/*
+ * Write-through cache of the hardware level, every successful read or
+ * write refreshes it so that stepping up or down only costs the write.
+ */
+static void
+espm_brightness_cache_level (EspmBrightness *brightness, gint32 level)
+{
+  brightness->priv->current_level = level;
+  brightness->priv->current_level_valid = TRUE;
+  brightness->priv->current_level_time = g_get_monotonic_time ();
+}
+
+static void
+espm_brightness_invalidate_level (EspmBrightness *brightness)
+{
+  brightness->priv->current_level_valid = FALSE;
+}
+
+/* called before a write, so the sysfs watch knows the notify it causes */
+static void
+espm_brightness_expect_write (EspmBrightness *brightness, gint32 level)
+{
+#if !defined(BACKEND_TYPE_FREEBSD)
+  brightness->priv->written_level = level;
+#endif
+}
+
+static gboolean
+espm_brightness_cache_is_fresh (EspmBrightness *brightness)
+{
+  if ( !brightness->priv->current_level_valid )
+    return FALSE;
+
+  return brightness->priv->level_watched ||
+         g_get_monotonic_time () - brightness->priv->current_level_time < LEVEL_CACHE_LIFETIME;
+}
+
+/*
+ * Called by the watchers with the level they just read, tells everyone
+ * when it differs from what we knew.
+ */
+static void
+espm_brightness_level_observed (EspmBrightness *brightness, gboolean had_level, gint32 old_level, gint32 level)
+{
+  if ( had_level && old_level == level )
+    return;
+
+  ESPM_DEBUG ("Brightness changed behind our back to %d", level);
+  g_signal_emit (G_OBJECT (brightness), signals [LEVEL_CHANGED], 0, level);
+}
+
+static gboolean
+espm_brightness_get_cached_level (EspmBrightness *brightness, gint32 *level)
 {
-  if (brightness->priv->use_exp_step)
+  if ( espm_brightness_cache_is_fresh (brightness) )
   {
-    gint32 new_level = roundf (level * brightness->priv->exp_step);
-    if (new_level == level)  ++new_level;
-    return new_level;
+    *level = brightness->priv->current_level;
+    return TRUE;
   }
-  else
-    return level + brightness->priv->step;
+
+  return espm_brightness_get_level (brightness, level);
 }
 
-static gint32
-espm_brightness_dec (EspmBrightness *brightness, gint32 level)
+/*
+ * Build the levels the up and down keys walk through, once per change
+ * of the range or the step settings. The table is strictly increasing
+ * and always starts at min_level and ends at max_level, so repeated
+ * presses land exactly on both ends.
+ */
+static void
+espm_brightness_build_steps (EspmBrightness *brightness)
 {
-  if (brightness->priv->use_exp_step)
+  gint32 min = brightness->priv->min_level;
+  gint32 delta = brightness->priv->max_level - brightness->priv->min_level;
+  guint count = brightness->priv->step_count;
+  gint32 level;
+  gfloat factor;
+  guint i;
+
+  g_free (brightness->priv->steps);
+  brightness->priv->steps = g_new (gint32, count + 1);
+  brightness->priv->n_steps = 0;
+
+  if ( delta <= 0 )
   {
-    gint32 new_level = roundf (level / brightness->priv->exp_step);
-    if (new_level == level)  --new_level;
-    return new_level;
+    brightness->priv->steps[brightness->priv->n_steps++] = min;
+    return;
   }
-  else
-    return level - brightness->priv->step;
+
+  /* each exponential step multiplies the level by the same factor */
+  factor = powf (delta, 1.0 / count);
+
+  for ( i = 0; i <= count; i++ )
+  {
+    if ( i == 0 )
+      level = min;
+    else if ( i == count )
+      level = brightness->priv->max_level;
+    else if ( brightness->priv->step_exponential )
+      level = min + (gint32) roundf (powf (factor, i));
+    else
+      level = min + (gint32) ((gint64) delta * i / count);
+
+    /* small ranges have fewer distinct levels than steps */
+    if ( brightness->priv->n_steps > 0 &&
+         level <= brightness->priv->steps[brightness->priv->n_steps - 1] )
+      continue;
+
+    brightness->priv->steps[brightness->priv->n_steps++] = level;
+  }
+}
+
+/* index of the first step above level, n_steps if there is none */
+static guint
+espm_brightness_find_step (EspmBrightness *brightness, gint32 level)
+{
+  guint lo = 0, hi = brightness->priv->n_steps;
+
+  while ( lo < hi )
+  {
+    guint mid = (lo + hi) / 2;
+
+    if ( brightness->priv->steps[mid] <= level )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+static gint32
+espm_brightness_inc (EspmBrightness *brightness, gint32 level)
+{
+  guint i = espm_brightness_find_step (brightness, level);
+
+  if ( i == brightness->priv->n_steps )
+    return brightness->priv->max_level;
+
+  return brightness->priv->steps[i];
+}
+
+static gint32
+espm_brightness_dec (EspmBrightness *brightness, gint32 level)
+{
+  guint i = espm_brightness_find_step (brightness, level - 1);
+
+  /* levels off the table go down to the step just below them */
+  if ( i == 0 )
+    return brightness->priv->min_level;
+
+  return brightness->priv->steps[i - 1];
 }
 
 static gboolean
@@ -121,7 +365,7 @@ out:
 }
 
 static gboolean
-espm_brightness_xrandr_get_level (EspmBrightness *brightness, RROutput output, gint32 *current)
+espm_brightness_xrandr_get_level (EspmBrightness *brightness, gint32 *current)
 {
   unsigned long nitems;
   unsigned long bytes_after;
@@ -134,7 +378,7 @@ espm_brightness_xrandr_get_level (EspmBrightness *brightness, RROutput output, g
   gdisplay = gdk_display_get_default ();
 
   gdk_x11_display_error_trap_push (gdisplay);
-  if (XRRGetOutputProperty (gdk_x11_get_default_xdisplay (), output, brightness->priv->backlight,
+  if (XRRGetOutputProperty (gdk_x11_get_default_xdisplay (), brightness->priv->output, brightness->priv->backlight,
                             0, 4, False, False, None,
                             &actual_type, &actual_format,
                             &nitems, &bytes_after, ((unsigned char **)&prop)) != Success
@@ -147,6 +391,8 @@ espm_brightness_xrandr_get_level (EspmBrightness *brightness, RROutput output, g
   if (actual_type == XA_INTEGER && nitems == 1 && actual_format == 32)
   {
     memcpy (current, prop, sizeof (*current));
+    g_array_index (brightness->priv->outputs, EspmBrightnessOutput, 0).level = *current;
+    espm_brightness_cache_level (brightness, *current);
     ret = TRUE;
   }
 
@@ -155,19 +401,52 @@ espm_brightness_xrandr_get_level (EspmBrightness *brightness, RROutput output, g
   return ret;
 }
 
+/*
+ * Map a level of the first output onto the range of another one, so
+ * that panels with different ranges dim by the same proportion.
+ */
+static gint32
+espm_brightness_xrandr_scale_level (EspmBrightness *brightness, EspmBrightnessOutput *output, gint32 level)
+{
+  EspmBrightnessOutput *first = &g_array_index (brightness->priv->outputs, EspmBrightnessOutput, 0);
+
+  if ( output == first )
+    return level;
+
+  return output->min_level +
+         (gint64) (level - first->min_level) * (output->max_level - output->min_level) /
+         (first->max_level - first->min_level);
+}
+
+/*
+ * Set the level of every output at once, the property changes are
+ * queued up and go out with a single flush.
+ */
 static gboolean
-espm_brightness_xrandr_set_level (EspmBrightness *brightness, RROutput output, gint32 level)
+espm_brightness_xrandr_set_level (EspmBrightness *brightness, gint32 level)
 {
+  EspmBrightnessOutput *output;
   gboolean ret = TRUE;
   Display *display;
   GdkDisplay *gdisplay;
+  gint32 value;
+  guint i;
 
   display = gdk_x11_get_default_xdisplay ();
   gdisplay = gdk_display_get_default ();
 
   gdk_x11_display_error_trap_push (gdisplay);
-  XRRChangeOutputProperty (display, output, brightness->priv->backlight, XA_INTEGER, 32,
-                           PropModeReplace, (unsigned char *) &level, 1);
+  for ( i = 0; i < brightness->priv->outputs->len; i++ )
+  {
+    output = &g_array_index (brightness->priv->outputs, EspmBrightnessOutput, i);
+    value = espm_brightness_xrandr_scale_level (brightness, output, level);
+    XRRChangeOutputProperty (display, output->id, brightness->priv->backlight, XA_INTEGER, 32,
+                             PropModeReplace, (unsigned char *) &value, 1);
+    output->level = value;
+  }
+
+  if ( brightness->priv->xrandr_watching )
+    brightness->priv->xrandr_pending_notifies++;
 
   XFlush (display);
   gdk_display_flush (gdisplay);
@@ -175,23 +454,100 @@ espm_brightness_xrandr_set_level (EspmBrightness *brightness, RROutput output, g
   if ( gdk_x11_display_error_trap_pop (gdisplay) )
   {
     g_warning ("failed to XRRChangeOutputProperty for brightness %d", level);
+    for ( i = 0; i < brightness->priv->outputs->len; i++ )
+      g_array_index (brightness->priv->outputs, EspmBrightnessOutput, i).level = -1;
+    brightness->priv->xrandr_pending_notifies = 0;
+    espm_brightness_invalidate_level (brightness);
     ret = FALSE;
   }
+  else
+    espm_brightness_cache_level (brightness, level);
 
   return ret;
 }
 
+/*
+ * Keep the cached level in sync with changes made by other clients, the
+ * level is only read back when someone else touched the backlight.
+ */
+static GdkFilterReturn
+espm_brightness_xrandr_event_filter (GdkXEvent *gdkxevent, GdkEvent *event, gpointer data)
+{
+  EspmBrightness *brightness = ESPM_BRIGHTNESS (data);
+  XEvent *xevent = (XEvent *) gdkxevent;
+  XRROutputPropertyNotifyEvent *notify;
+  gboolean had_level;
+  gint32 old_level;
+  gint32 level;
+
+  if ( xevent->type != brightness->priv->xrandr_event_base + RRNotify )
+    return GDK_FILTER_CONTINUE;
+
+  notify = (XRROutputPropertyNotifyEvent *) xevent;
+  if ( notify->subtype != RRNotify_OutputProperty ||
+       notify->property != brightness->priv->backlight ||
+       notify->output != brightness->priv->output ||
+       !brightness->priv->xrandr_has_hw )
+    return GDK_FILTER_CONTINUE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+
+  /* our own write, the cache already holds its level */
+  if ( brightness->priv->xrandr_pending_notifies > 0 )
+  {
+    brightness->priv->xrandr_pending_notifies--;
+    g_rec_mutex_unlock (&brightness->priv->lock);
+    return GDK_FILTER_CONTINUE;
+  }
+
+  had_level = brightness->priv->current_level_valid;
+  old_level = brightness->priv->current_level;
+
+  if ( !espm_brightness_xrandr_get_level (brightness, &level) )
+  {
+    espm_brightness_invalidate_level (brightness);
+    g_rec_mutex_unlock (&brightness->priv->lock);
+    return GDK_FILTER_CONTINUE;
+  }
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+
+  espm_brightness_level_observed (brightness, had_level, old_level, level);
+
+  /* others, gdk included, may be interested in randr events as well */
+  return GDK_FILTER_CONTINUE;
+}
+
+static void
+espm_brightness_xrandr_watch (EspmBrightness *brightness, Window window)
+{
+  if ( brightness->priv->xrandr_watching )
+    return;
+
+  /* the event mask is per client and gdk shares our connection, so keep
+   * everything gdk selects for its own monitor tracking */
+  XRRSelectInput (gdk_x11_get_default_xdisplay (), window,
+                  RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask |
+                  RROutputChangeNotifyMask | RROutputPropertyNotifyMask);
+  gdk_window_add_filter (NULL, espm_brightness_xrandr_event_filter, brightness);
+
+  brightness->priv->xrandr_watching = TRUE;
+  brightness->priv->xrandr_pending_notifies = 0;
+}
+
 static gboolean
 espm_brightness_setup_xrandr (EspmBrightness *brightness)
 {
   GdkScreen *screen;
   GdkDisplay *gdisplay;
+  XRRScreenResources *resource;
   XRROutputInfo *info;
+  EspmBrightnessOutput output;
   Window window;
   gint major, minor, screen_num;
   int event_base, error_base;
   gint32 min, max;
-  gboolean ret = FALSE;
+  guint n_internal = 0;
   gint i;
 
   gdisplay = gdk_display_get_default ();
@@ -212,6 +568,8 @@ espm_brightness_setup_xrandr (EspmBrightness *brightness)
     return FALSE;
   }
 
+  brightness->priv->xrandr_event_base = event_base;
+
 #ifdef RR_PROPERTY_BACKLIGHT
   brightness->priv->backlight = XInternAtom (gdk_x11_get_default_xdisplay (), RR_PROPERTY_BACKLIGHT, True);
   if (brightness->priv->backlight == None) /* fall back to deprecated name */
@@ -234,25 +592,47 @@ espm_brightness_setup_xrandr (EspmBrightness *brightness)
 
 #if (RANDR_MAJOR == 1 && RANDR_MINOR >=3 )
   if (major > 1 || minor >= 3)
-    brightness->priv->resource = XRRGetScreenResourcesCurrent (gdk_x11_get_default_xdisplay (), window);
+    resource = XRRGetScreenResourcesCurrent (gdk_x11_get_default_xdisplay (), window);
   else
 #endif
-    brightness->priv->resource = XRRGetScreenResources (gdk_x11_get_default_xdisplay (), window);
+    resource = XRRGetScreenResources (gdk_x11_get_default_xdisplay (), window);
+
+  /* the outputs did not change since the last scan, keep the table */
+  if ( brightness->priv->resource != NULL && brightness->priv->outputs->len > 0 &&
+       resource->configTimestamp == brightness->priv->resource->configTimestamp )
+  {
+    XRRFreeScreenResources (resource);
+    gdk_x11_display_error_trap_pop_ignored (gdisplay);
+    goto out;
+  }
 
-  for ( i = 0; i < brightness->priv->resource->noutput; i++)
+  espm_brightness_free_data (brightness);
+  brightness->priv->resource = resource;
+  g_array_set_size (brightness->priv->outputs, 0);
+
+  for ( i = 0; i < resource->noutput; i++)
   {
-    info = XRRGetOutputInfo (gdk_x11_get_default_xdisplay (), brightness->priv->resource, brightness->priv->resource->outputs[i]);
+    gboolean internal;
 
-    if ( g_str_has_prefix (info->name, "LVDS") || g_str_has_prefix (info->name, "eDP") )
+    info = XRRGetOutputInfo (gdk_x11_get_default_xdisplay (), resource, resource->outputs[i]);
+    internal = g_str_has_prefix (info->name, "LVDS") || g_str_has_prefix (info->name, "eDP");
+
+    /* internal panels first, then any connected external panel with a backlight */
+    if ( (internal || info->connection == RR_Connected) &&
+         espm_brightness_xrand_get_limit (brightness, resource->outputs[i], &min, &max) &&
+         min != max )
     {
-      if ( espm_brightness_xrand_get_limit (brightness, brightness->priv->resource->outputs[i], &min, &max) &&
-           min != max )
-      {
-        ret = TRUE;
-        brightness->priv->output = brightness->priv->resource->outputs[i];
-        brightness->priv->step =  max <= 20 ? 1 : max / 10;
-        brightness->priv->exp_step = 2;
-      }
+      output.id = resource->outputs[i];
+      output.min_level = min;
+      output.max_level = max;
+      output.level = -1;
+
+      ESPM_DEBUG ("Output %s has a backlight, min_level=%d max_level=%d", info->name, min, max);
+
+      if ( internal )
+        g_array_insert_val (brightness->priv->outputs, n_internal++, output);
+      else
+        g_array_append_val (brightness->priv->outputs, output);
     }
 
     XRRFreeOutputInfo (info);
@@ -261,106 +641,497 @@ espm_brightness_setup_xrandr (EspmBrightness *brightness)
   if (gdk_x11_display_error_trap_pop (gdisplay) != 0)
     g_critical ("Failed to get output/resource info");
 
-  return ret;
+  if ( brightness->priv->outputs->len == 0 )
+    return FALSE;
+
+out:
+  /* the first output defines the range of the levels we hand out */
+  output = g_array_index (brightness->priv->outputs, EspmBrightnessOutput, 0);
+  brightness->priv->output = output.id;
+  brightness->priv->min_level = output.min_level;
+  brightness->priv->max_level = output.max_level;
+
+  espm_brightness_xrandr_watch (brightness, window);
+
+  return TRUE;
 }
 
+#if !defined(BACKEND_TYPE_FREEBSD)
+static void
+espm_brightness_sysfs_close (EspmBrightness *brightness)
+{
+  if ( brightness->priv->sysfs_watch_id != 0 )
+  {
+    g_source_remove (brightness->priv->sysfs_watch_id);
+    brightness->priv->sysfs_watch_id = 0;
+  }
+  if ( brightness->priv->sysfs_monitor != NULL )
+  {
+    g_file_monitor_cancel (brightness->priv->sysfs_monitor);
+    g_object_unref (brightness->priv->sysfs_monitor);
+    brightness->priv->sysfs_monitor = NULL;
+  }
+
+  if ( brightness->priv->sysfs_level_fd >= 0 )
+    close (brightness->priv->sysfs_level_fd);
+  if ( brightness->priv->sysfs_max_fd >= 0 )
+    close (brightness->priv->sysfs_max_fd);
+
+  brightness->priv->sysfs_level_fd = -1;
+  brightness->priv->sysfs_max_fd = -1;
+
+  g_free (brightness->priv->sysfs_device);
+  brightness->priv->sysfs_device = NULL;
+}
+
+/*
+ * Drivers round a written level to one the hardware supports, so the
+ * notify of our own write may be off by a little. Nobody notices a
+ * change below a percent, take anything that close for ours. The
+ * notifies of a transition trail its frames, any level on its way is
+ * ours as well until it settled.
+ */
 static gboolean
-espm_brightness_xrand_up (EspmBrightness *brightness, gint32 *new_level)
+espm_brightness_sysfs_is_own_write (EspmBrightness *brightness, gint32 level)
 {
-  gint32 hw_level;
-  gboolean ret = FALSE;
-  gint32 set_level;
+  gint32 tolerance = MAX (1, brightness->priv->max_level / 100);
+  gint64 settled;
+  GList *l;
+
+  settled = brightness->priv->transition_start +
+            (gint64) (brightness->priv->transition_duration + TRANSITION_SETTLE_TIME) * 1000;
+  if ( g_get_monotonic_time () < settled &&
+       level >= MIN (brightness->priv->transition_from, brightness->priv->transition_to) - tolerance &&
+       level <= MAX (brightness->priv->transition_from, brightness->priv->transition_to) + tolerance )
+    return TRUE;
 
-  ret = espm_brightness_xrandr_get_level (brightness, brightness->priv->output, &hw_level);
+  if ( brightness->priv->written_level >= 0 &&
+       ABS (level - brightness->priv->written_level) <= tolerance )
+    return TRUE;
 
-  if ( !ret )
-    return FALSE;
+  for ( l = brightness->priv->logind_writes->head; l != NULL; l = l->next )
+    if ( ABS (level - GPOINTER_TO_INT (l->data)) <= tolerance )
+      return TRUE;
+
+  return FALSE;
+}
+
+static void
+espm_brightness_sysfs_changed (EspmBrightness *brightness)
+{
+  gboolean had_level;
+  gint32 old_level;
+  gint32 level;
 
-  if ( hw_level == brightness->priv->max_level )
+  g_rec_mutex_lock (&brightness->priv->lock);
+
+  had_level = brightness->priv->current_level_valid;
+  old_level = brightness->priv->current_level;
+
+  /* reading the attribute also re-arms the notification */
+  level = espm_backlight_sysfs_read_fd (brightness->priv->sysfs_level_fd);
+
+  if ( level < 0 )
   {
-    *new_level = brightness->priv->max_level;
-    return TRUE;
+    espm_brightness_invalidate_level (brightness);
+    g_rec_mutex_unlock (&brightness->priv->lock);
+    return;
   }
 
-  set_level = MIN (espm_brightness_inc (brightness, hw_level), brightness->priv->max_level);
+  /*
+   * One of our writes landing. Keep the level the driver settled on,
+   * unless more logind writes are on their way, then the cache already
+   * holds the newest.
+   */
+  if ( espm_brightness_sysfs_is_own_write (brightness, level) )
+  {
+    if ( g_queue_is_empty (brightness->priv->logind_writes) )
+      espm_brightness_cache_level (brightness, level);
+    g_rec_mutex_unlock (&brightness->priv->lock);
+    return;
+  }
 
-  g_warn_if_fail (espm_brightness_xrandr_set_level (brightness, brightness->priv->output, set_level));
+  brightness->priv->written_level = -1;
+  espm_brightness_cache_level (brightness, level);
 
-  ret = espm_brightness_xrandr_get_level (brightness, brightness->priv->output, new_level);
+  g_rec_mutex_unlock (&brightness->priv->lock);
 
-  if ( !ret )
-  {
-    g_warning ("espm_brightness_xrand_up failed for %d", set_level);
+  espm_brightness_level_observed (brightness, had_level, old_level, level);
+}
+
+static gboolean
+espm_brightness_sysfs_notify_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+  espm_brightness_sysfs_changed (ESPM_BRIGHTNESS (user_data));
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+espm_brightness_sysfs_monitor_cb (GFileMonitor      *monitor,
+                                  GFile             *file,
+                                  GFile             *other_file,
+                                  GFileMonitorEvent  event_type,
+                                  EspmBrightness    *brightness)
+{
+  if ( event_type == G_FILE_MONITOR_EVENT_CHANGED )
+    espm_brightness_sysfs_changed (brightness);
+}
+
+/*
+ * The backlight class calls sysfs_notify on actual_brightness for every
+ * change, hotkeys handled by the firmware included, which shows up as
+ * POLLPRI on the open attribute. Without actual_brightness we fall back
+ * to an inotify based file monitor on the brightness attribute.
+ */
+static gboolean
+espm_brightness_sysfs_watch (EspmBrightness *brightness, const gchar *filename, gboolean actual)
+{
+  GFile *file;
+  GError *error = NULL;
+
+  /* the first read arms the notification */
+  if ( espm_backlight_sysfs_read_fd (brightness->priv->sysfs_level_fd) < 0 )
     return FALSE;
+
+  if ( actual )
+  {
+    brightness->priv->sysfs_watch_id = g_unix_fd_add (brightness->priv->sysfs_level_fd,
+                                                      G_IO_PRI | G_IO_ERR,
+                                                      espm_brightness_sysfs_notify_cb,
+                                                      brightness);
+    return TRUE;
   }
 
-  /* Nothing changed in the hardware*/
-  if ( *new_level == hw_level )
+  file = g_file_new_for_path (filename);
+  brightness->priv->sysfs_monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, &error);
+  g_object_unref (file);
+
+  if ( brightness->priv->sysfs_monitor == NULL )
   {
-    g_warning ("espm_brightness_xrand_up did not change the hw level to %d", set_level);
+    if (error)
+    {
+      g_warning ("failed to monitor %s: %s", filename, error->message);
+      g_error_free (error);
+    }
     return FALSE;
   }
 
+  g_signal_connect (brightness->priv->sysfs_monitor, "changed",
+                    G_CALLBACK (espm_brightness_sysfs_monitor_cb), brightness);
   return TRUE;
 }
 
+/*
+ * Open the attributes of the same backlight the helper writes to, so
+ * reads are a pread away instead of a helper spawn.
+ */
 static gboolean
-espm_brightness_xrand_down (EspmBrightness *brightness, gint32 *new_level)
+espm_brightness_sysfs_open (EspmBrightness *brightness)
 {
-  gint32 hw_level;
-  gboolean ret;
-  gint32 set_level;
+  gchar *sysfs_path;
+  gchar *filename;
+  gboolean actual = TRUE;
 
-  ret = espm_brightness_xrandr_get_level (brightness, brightness->priv->output, &hw_level);
+  espm_brightness_sysfs_close (brightness);
 
-  if ( !ret )
+  if ( brightness->priv->device )
+    sysfs_path = espm_backlight_sysfs_get_device (brightness->priv->device);
+  else
+    sysfs_path = espm_backlight_sysfs_get_best_backlight (FALSE);
+  if ( sysfs_path == NULL )
     return FALSE;
 
-  if ( hw_level == brightness->priv->min_level )
+  /* actual_brightness is what the hardware really does, not every driver has it */
+  filename = g_build_filename (sysfs_path, "actual_brightness", NULL);
+  brightness->priv->sysfs_level_fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if ( brightness->priv->sysfs_level_fd < 0 )
   {
-    *new_level = brightness->priv->min_level;
-    return TRUE;
+    g_free (filename);
+    filename = g_build_filename (sysfs_path, "brightness", NULL);
+    brightness->priv->sysfs_level_fd = open (filename, O_RDONLY | O_CLOEXEC);
+    actual = FALSE;
   }
 
-  set_level = MAX (espm_brightness_dec (brightness, hw_level), brightness->priv->min_level);
+  if ( brightness->priv->sysfs_level_fd >= 0 &&
+       !espm_brightness_sysfs_watch (brightness, filename, actual) )
+    g_warning ("brightness changes made by others in %s will go unnoticed", sysfs_path);
+  g_free (filename);
 
-  g_warn_if_fail (espm_brightness_xrandr_set_level (brightness, brightness->priv->output, set_level));
+  filename = g_build_filename (sysfs_path, "max_brightness", NULL);
+  brightness->priv->sysfs_max_fd = open (filename, O_RDONLY | O_CLOEXEC);
+  g_free (filename);
 
-  ret = espm_brightness_xrandr_get_level (brightness, brightness->priv->output, new_level);
-
-  if ( !ret )
+  if ( brightness->priv->sysfs_level_fd < 0 || brightness->priv->sysfs_max_fd < 0 )
   {
-    g_warning ("espm_brightness_xrand_down failed for %d", set_level);
+    g_warning ("failed to open the backlight attributes in %s: %s", sysfs_path, g_strerror (errno));
+    espm_brightness_sysfs_close (brightness);
+    g_free (sysfs_path);
     return FALSE;
   }
 
-  /* Nothing changed in the hardware*/
-  if ( *new_level == hw_level )
-  {
-    g_warning ("espm_brightness_xrand_down did not change the hw level to %d", set_level);
+  ESPM_DEBUG ("Reading the backlight directly from %s", sysfs_path);
+  brightness->priv->sysfs_device = g_path_get_basename (sysfs_path);
+  g_free (sysfs_path);
+  return TRUE;
+}
+
+/* the module parameter is world readable */
+static gboolean
+espm_brightness_sysfs_get_switch (gint *brightness_switch)
+{
+  gint fd;
+  gint ret;
+
+  fd = open (BRIGHTNESS_SWITCH_LOCATION, O_RDONLY | O_CLOEXEC);
+  if ( fd < 0 )
+    return FALSE;
+
+  ret = espm_backlight_sysfs_read_fd (fd);
+  close (fd);
+  if ( ret < 0 )
+    return FALSE;
+
+  *brightness_switch = ret;
+  return TRUE;
+}
+
+static gboolean
+espm_brightness_sysfs_get_level (EspmBrightness *brightness, gint32 *level)
+{
+  gint32 ret;
+
+  if ( brightness->priv->sysfs_level_fd < 0 )
+    return FALSE;
+
+  ret = (gint32) espm_backlight_sysfs_read_fd (brightness->priv->sysfs_level_fd);
+  if ( ret < 0 )
     return FALSE;
-  }
 
+  *level = ret;
+  espm_brightness_cache_level (brightness, ret);
   return TRUE;
 }
 
 /*
- * Non-XRandR fallback using espm-backlight-helper
+ * logind backend, reads straight from sysfs and writes through
+ * org.freedesktop.login1.Session.SetBrightness. logind only lets the
+ * active session change the backlight, which is all we need.
  */
 
-#ifdef ENABLE_POLKIT
+#define LOGIND_NAME          "org.freedesktop.login1"
+#define LOGIND_SESSION_PATH  "/org/freedesktop/login1/session/auto"
+#define LOGIND_SESSION_IFACE "org.freedesktop.login1.Session"
 
-static gint
-espm_brightness_helper_get_value (const gchar *argument)
+/* milliseconds to wait for logind to answer the probe during setup */
+#define LOGIND_TIMEOUT 2000
+
+/* logind gained SetBrightness in version 243, ask instead of guessing */
+static gboolean
+espm_brightness_logind_has_set_brightness (GDBusConnection *bus)
 {
-  gboolean ret;
+  GDBusNodeInfo *node;
+  GDBusInterfaceInfo *iface;
+  GVariant *reply;
+  const gchar *xml;
   GError *error = NULL;
-  gchar *stdout_data = NULL;
-  gint exit_status = 0;
-  gint value = -1;
-  gchar *command = NULL;
+  gboolean ret = FALSE;
 
-  command = g_strdup_printf (SBINDIR "/espm-power-backlight-helper --%s", argument);
+  reply = g_dbus_connection_call_sync (bus, LOGIND_NAME, LOGIND_SESSION_PATH,
+                                       "org.freedesktop.DBus.Introspectable", "Introspect",
+                                       NULL, G_VARIANT_TYPE ("(s)"),
+                                       G_DBUS_CALL_FLAGS_NONE, LOGIND_TIMEOUT,
+                                       NULL, &error);
+  if ( reply == NULL )
+  {
+    g_debug ("logind session not available: %s", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  g_variant_get (reply, "(&s)", &xml);
+  node = g_dbus_node_info_new_for_xml (xml, NULL);
+  if ( node != NULL )
+  {
+    iface = g_dbus_node_info_lookup_interface (node, LOGIND_SESSION_IFACE);
+    ret = iface != NULL && g_dbus_interface_info_lookup_method (iface, "SetBrightness") != NULL;
+    g_dbus_node_info_unref (node);
+  }
+
+  g_variant_unref (reply);
+  return ret;
+}
+
+static gboolean
+espm_brightness_setup_logind (EspmBrightness *brightness)
+{
+  GError *error = NULL;
+  gint32 max;
+
+  brightness->priv->logind_has_hw = FALSE;
+
+  if ( !espm_brightness_sysfs_open (brightness) )
+    return FALSE;
+
+  /* honours DBUS_SYSTEM_BUS_ADDRESS, so a mock logind on a private bus works too */
+  if ( brightness->priv->logind_bus == NULL )
+  {
+    brightness->priv->logind_bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
+    if ( brightness->priv->logind_bus == NULL )
+    {
+      g_debug ("no system bus for logind: %s", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+  }
+
+  if ( !espm_brightness_logind_has_set_brightness (brightness->priv->logind_bus) )
+    return FALSE;
+
+  max = (gint32) espm_backlight_sysfs_read_fd (brightness->priv->sysfs_max_fd);
+  if ( max <= 0 )
+    return FALSE;
+
+  brightness->priv->min_level = 0;
+  brightness->priv->max_level = max;
+  brightness->priv->logind_has_hw = TRUE;
+
+  return TRUE;
+}
+
+static void
+espm_brightness_logind_set_level_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  EspmBrightness *brightness = ESPM_BRIGHTNESS (user_data);
+  GVariant *reply;
+  GError *error = NULL;
+  gint32 level;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+  level = GPOINTER_TO_INT (g_queue_pop_head (brightness->priv->logind_writes));
+  if ( reply == NULL )
+  {
+    g_warning ("logind failed to set the brightness: %s", error->message);
+    g_error_free (error);
+
+    /* the later writes fail the same way, retry the newest one once */
+    if ( brightness->priv->logind_has_hw )
+    {
+      if ( !g_queue_is_empty (brightness->priv->logind_writes) )
+        level = GPOINTER_TO_INT (g_queue_peek_tail (brightness->priv->logind_writes));
+      espm_brightness_logind_failed (brightness, level);
+    }
+  }
+  else
+    g_variant_unref (reply);
+  g_rec_mutex_unlock (&brightness->priv->lock);
+
+  g_object_unref (brightness);
+}
+
+/*
+ * The call is not waited for. If it fails, logind is dropped and the
+ * level retried through the helper. Until logind replies, sysfs
+ * notifies carrying one of the levels we asked for are ours. This has
+ * to run in the main thread, where the reply gets dispatched.
+ */
+static gboolean
+espm_brightness_logind_set_level (EspmBrightness *brightness, gint32 level)
+{
+  GVariant *reply;
+  GError *error = NULL;
+
+  espm_brightness_expect_write (brightness, level);
+
+  /* paranoid mode reads the level back, so wait for the write to land */
+  if ( brightness->priv->verify_writes )
+  {
+    reply = g_dbus_connection_call_sync (brightness->priv->logind_bus, LOGIND_NAME, LOGIND_SESSION_PATH,
+                                         LOGIND_SESSION_IFACE, "SetBrightness",
+                                         g_variant_new ("(ssu)", "backlight", brightness->priv->sysfs_device, (guint32) level),
+                                         NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+    if ( reply == NULL )
+    {
+      g_warning ("logind failed to set the brightness: %s", error->message);
+      g_error_free (error);
+      return espm_brightness_logind_failed (brightness, level);
+    }
+
+    g_variant_unref (reply);
+    espm_brightness_cache_level (brightness, level);
+    return TRUE;
+  }
+
+  g_queue_push_tail (brightness->priv->logind_writes, GINT_TO_POINTER (level));
+  g_dbus_connection_call (brightness->priv->logind_bus, LOGIND_NAME, LOGIND_SESSION_PATH,
+                          LOGIND_SESSION_IFACE, "SetBrightness",
+                          g_variant_new ("(ssu)", "backlight", brightness->priv->sysfs_device, (guint32) level),
+                          NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                          espm_brightness_logind_set_level_cb, g_object_ref (brightness));
+
+  espm_brightness_cache_level (brightness, level);
+  return TRUE;
+}
+#endif
+
+/*
+ * Non-XRandR fallback using espm-backlight-helper
+ */
+
+#ifdef ENABLE_POLKIT
+
+/*
+ * The device the helper is pointed at, NULL for the best one. The
+ * helper I/O below takes it as an argument, so it can run without the
+ * main lock that guards it.
+ */
+static const gchar *
+espm_brightness_helper_device (EspmBrightness *brightness)
+{
+#if !defined(BACKEND_TYPE_FREEBSD)
+  return brightness->priv->device;
+#else
+  return NULL;
+#endif
+}
+
+/*
+ * Point the helper at the device picked by the user, argv needs two
+ * spare slots at its end for this
+ */
+static void
+espm_brightness_helper_add_device (const gchar *device, const gchar **argv)
+{
+  if ( device == NULL )
+    return;
+
+  while ( *argv != NULL )
+    argv++;
+  argv[0] = "--device";
+  argv[1] = device;
+}
+
+static gint
+espm_brightness_helper_get_value (const gchar *device, const gchar *argument)
+{
+  gboolean ret;
+  GError *error = NULL;
+  gchar *stdout_data = NULL;
+  gint exit_status = 0;
+  gint value = -1;
+  gchar *command = NULL;
+
+#if !defined(BACKEND_TYPE_FREEBSD)
+  if ( device )
+  {
+    gchar *quoted = g_shell_quote (device);
+    command = g_strdup_printf (SBINDIR "/espm-power-backlight-helper --device %s --%s", quoted, argument);
+    g_free (quoted);
+  }
+  else
+#endif
+  command = g_strdup_printf (SBINDIR "/espm-power-backlight-helper --%s", argument);
   ret = g_spawn_command_line_sync (command,
                                    &stdout_data, NULL, &exit_status, &error);
   if ( !ret )
@@ -394,418 +1165,1901 @@ out:
   return value;
 }
 
+#if !defined(BACKEND_TYPE_FREEBSD)
+/*
+ * Run several requests through a single pkexec run of the helper, one
+ * reply value per request.
+ */
 static gboolean
-espm_brightness_setup_helper (EspmBrightness *brightness)
+espm_brightness_helper_batch (const gchar *device,
+                              const gchar *requests, gint *values, guint n_values)
 {
-  gint32 ret;
+  const gchar *argv[] = { "pkexec", SBINDIR "/espm-power-backlight-helper", "--batch", NULL, NULL, NULL };
+  GSubprocess *helper;
+  GError *error = NULL;
+  gchar *stdout_data = NULL;
+  gchar **replies = NULL;
+  gboolean ret = FALSE;
+  guint i;
 
-  ret = (gint32) espm_brightness_helper_get_value ("get-max-brightness");
-  g_debug ("espm_brightness_setup_helper: get-max-brightness returned %i", ret);
-  if ( ret < 0 )
+  espm_brightness_helper_add_device (device, argv);
+  helper = g_subprocess_newv (argv,
+                              G_SUBPROCESS_FLAGS_STDIN_PIPE | G_SUBPROCESS_FLAGS_STDOUT_PIPE,
+                              &error);
+  if ( helper == NULL )
+    goto out;
+
+  if ( !g_subprocess_communicate_utf8 (helper, requests, NULL, &stdout_data, NULL, &error) )
+    goto out;
+
+  replies = g_strsplit (stdout_data, "\n", -1);
+  for ( i = 0; i < n_values; i++ )
   {
-    brightness->priv->helper_has_hw = FALSE;
+    if ( replies[i] == NULL || !g_str_has_prefix (replies[i], "OK ") )
+    {
+      g_debug ("backlight helper batch failed at request %u: %s", i, replies[i] ? replies[i] : "no reply");
+      goto out;
+    }
+    values[i] = atoi (replies[i] + 3);
   }
-  else
+  ret = TRUE;
+
+out:
+  if (error)
   {
-    brightness->priv->helper_has_hw = TRUE;
-    brightness->priv->min_level = 0;
-    brightness->priv->max_level = ret;
-    brightness->priv->step =  ret <= 20 ? 1 : ret / 10;
-    brightness->priv->exp_step = 2;
+    g_warning ("failed to run the backlight helper batch: %s", error->message);
+    g_error_free (error);
   }
-
-  return brightness->priv->helper_has_hw;
+  if ( helper )
+    g_object_unref (helper);
+  g_strfreev (replies);
+  g_free (stdout_data);
+  return ret;
 }
 
+/*
+ * Find the range and current level of our device with one helper run,
+ * for when sysfs cannot be read directly. The best device is listed
+ * first.
+ */
 static gboolean
-espm_brightness_helper_get_level (EspmBrightness *brg, gint32 *level)
+espm_brightness_helper_list (EspmBrightness *brightness, gint32 *max_level)
 {
-  gint32 ret;
-
-  if ( ! brg->priv->helper_has_hw )
-    return FALSE;
+  GError *error = NULL;
+  gchar *stdout_data = NULL;
+  gchar **lines = NULL;
+  gchar **fields;
+  gint exit_status = 0;
+  gboolean ret = FALSE;
+  guint i;
 
-  ret = (gint32) espm_brightness_helper_get_value ("get-brightness");
+  if ( !g_spawn_command_line_sync (SBINDIR "/espm-power-backlight-helper --list",
+                                   &stdout_data, NULL, &exit_status, &error) )
+  {
+    if (error)
+    {
+      g_warning ("failed to list the backlights: %s", error->message);
+      g_error_free (error);
+    }
+    goto out;
+  }
 
-  g_debug ("espm_brightness_helper_get_level: get-brightness returned %i", ret);
+  if ( exit_status != 0 )
+    goto out;
 
-  if ( ret >= 0 )
+  lines = g_strsplit (stdout_data, "\n", -1);
+  for ( i = 0; lines[i] != NULL && !ret; i++ )
   {
-    *level = ret;
-    return TRUE;
+    /* name, type, max brightness, brightness */
+    fields = g_strsplit (lines[i], "\t", 4);
+    if ( g_strv_length (fields) == 4 &&
+         ( brightness->priv->device == NULL || g_strcmp0 (fields[0], brightness->priv->device) == 0 ) )
+    {
+      g_debug ("using backlight %s of type %s", fields[0], fields[1]);
+      *max_level = atoi (fields[2]);
+      espm_brightness_cache_level (brightness, atoi (fields[3]));
+      ret = TRUE;
+    }
+    g_strfreev (fields);
   }
 
-  return FALSE;
+out:
+  g_strfreev (lines);
+  g_free (stdout_data);
+  return ret;
 }
+#endif
 
-static gboolean
-espm_brightness_helper_set_level (EspmBrightness *brg, gint32 level)
+static void
+espm_brightness_helper_child_setup (gpointer user_data)
 {
-  gboolean ret;
+  gint fd = GPOINTER_TO_INT (user_data);
+
+  /* the helper talks to us over its stdin and stdout */
+  dup2 (fd, STDIN_FILENO);
+  dup2 (fd, STDOUT_FILENO);
+}
+
+static GSocket *
+espm_brightness_helper_open_channel (const gchar *device)
+{
+  const gchar *argv[] = { "pkexec", SBINDIR "/espm-power-backlight-helper", "--serve", NULL, NULL, NULL };
+  GSocket *socket;
   GError *error = NULL;
-  gint exit_status = 0;
-  gchar *command = NULL;
+  gint fds[2];
 
-  command = g_strdup_printf ("pkexec " SBINDIR "/espm-power-backlight-helper --set-brightness %i", level);
-  ret = g_spawn_command_line_sync (command, NULL, NULL, &exit_status, &error);
-  if ( !ret )
+  if ( socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0 )
+  {
+    g_warning ("failed to create the backlight helper socket: %s", g_strerror (errno));
+    return NULL;
+  }
+
+  if ( device != NULL )
+  {
+    argv[3] = "--device";
+    argv[4] = device;
+  }
+
+  if ( !g_spawn_async (NULL, (gchar **) argv, NULL, G_SPAWN_SEARCH_PATH,
+                       espm_brightness_helper_child_setup, GINT_TO_POINTER (fds[1]),
+                       NULL, &error) )
   {
     if (error)
     {
-      g_warning ("espm_brightness_helper_set_level: failed to set value: %s", error->message);
+      g_warning ("failed to start the backlight helper: %s", error->message);
       g_error_free (error);
     }
-    goto out;
+    close (fds[0]);
+    close (fds[1]);
+    return NULL;
   }
-  g_debug ("executed %s; retval: %i", command, exit_status);
-  ret = (exit_status == 0);
+  close (fds[1]);
 
-out:
-  g_free (command);
-  return ret;
+  socket = g_socket_new_from_fd (fds[0], &error);
+  if ( socket == NULL )
+  {
+    if (error)
+    {
+      g_warning ("failed to set up the backlight helper socket: %s", error->message);
+      g_error_free (error);
+    }
+    close (fds[0]);
+    return NULL;
+  }
+
+  g_debug ("started the backlight helper channel");
+  return socket;
 }
 
+static void
+espm_brightness_helper_close_channel (EspmBrightness *brightness)
+{
+  /* the helper exits as soon as its stdin is closed */
+  if ( brightness->priv->helper_socket )
+  {
+    g_socket_close (brightness->priv->helper_socket, NULL);
+    g_object_unref (brightness->priv->helper_socket);
+    brightness->priv->helper_socket = NULL;
+  }
+}
+
+static void
+espm_brightness_helper_channel_failed (EspmBrightness *brightness)
+{
+  brightness->priv->helper_channel_failed = TRUE;
+  brightness->priv->helper_channel_failed_time = g_get_monotonic_time ();
+}
+
+/*
+ * Send one request and wait for its reply. broken is set when the
+ * channel itself failed rather than the request.
+ */
 static gboolean
-espm_brightness_helper_get_switch (EspmBrightness *brg, gint *brightness_switch)
+espm_brightness_helper_exchange (GSocket *socket, const gchar *request, gint *value, gboolean *broken)
 {
-  gint ret;
+  GError *error = NULL;
+  gchar reply[128];
+  gchar *line;
+  gsize length = 0;
+  gssize n;
+  gboolean ret = FALSE;
 
-  ret = espm_brightness_helper_get_value ("get-brightness-switch");
+  *broken = TRUE;
 
-  if ( ret >= 0 )
+  line = g_strdup_printf ("%s\n", request);
+  n = g_socket_send (socket, line, strlen (line), NULL, &error);
+  g_free (line);
+  if ( n < 0 )
+    goto out;
+
+  /* replies are a single short line */
+  while ( length < sizeof (reply) - 1 && memchr (reply, '\n', length) == NULL )
   {
-    *brightness_switch = ret;
-    return TRUE;
+    n = g_socket_receive (socket, reply + length, sizeof (reply) - 1 - length, NULL, &error);
+    if ( n <= 0 )
+      goto out;
+    length += n;
   }
+  reply[length] = '\0';
+  *broken = FALSE;
 
-  return FALSE;
+  if ( g_str_has_prefix (reply, "OK ") )
+  {
+    if ( value )
+      *value = atoi (reply + 3);
+    ret = TRUE;
+  }
+  else
+  {
+    g_warning ("backlight helper failed to handle '%s': %s", request, g_strstrip (reply));
+  }
+
+  g_debug ("backlight helper request '%s'; ret: %i", request, ret);
+
+out:
+  if (error)
+  {
+    g_warning ("backlight helper channel failed: %s", error->message);
+    g_error_free (error);
+  }
+  return ret;
 }
 
-static gboolean
-espm_brightness_helper_set_switch (EspmBrightness *brg, gint brightness_switch)
+/*
+ * Start the helper through pkexec and wait for its first reply, which
+ * only comes once the user answered the authorization dialog. That can
+ * take any time, so this runs in a worker thread holding no lock, and
+ * the channel is only published once it is authorized.
+ */
+static void
+espm_brightness_helper_authorize_thread (GTask        *task,
+                                         gpointer      source_object,
+                                         gpointer      task_data,
+                                         GCancellable *cancellable)
 {
-  gboolean ret;
-  GError *error = NULL;
-  gint exit_status = 0;
-  gchar *command = NULL;
+  EspmBrightness *brightness = ESPM_BRIGHTNESS (source_object);
+  GSocket *socket;
+  gboolean broken = TRUE;
 
-  command = g_strdup_printf ("pkexec " SBINDIR "/espm-power-backlight-helper --set-brightness-switch %i", brightness_switch);
-  ret = g_spawn_command_line_sync (command, NULL, NULL, &exit_status, &error);
-  if ( !ret )
+  socket = espm_brightness_helper_open_channel (task_data);
+  if ( socket != NULL )
+    espm_brightness_helper_exchange (socket, "get-brightness", NULL, &broken);
+
+  g_mutex_lock (&brightness->priv->helper_lock);
+  brightness->priv->helper_authorizing = FALSE;
+  if ( !broken )
   {
-    if (error)
+    /* pkexec let the helper run, from now on it answers quickly */
+    g_socket_set_timeout (socket, HELPER_TIMEOUT);
+    brightness->priv->helper_socket = socket;
+  }
+  else
+  {
+    /* never got a single reply, most likely pkexec refused to run it */
+    if ( socket != NULL )
     {
-      g_warning ("espm_brightness_helper_set_switch: failed to set value: %s", error->message);
-      g_error_free (error);
+      g_socket_close (socket, NULL);
+      g_object_unref (socket);
     }
-    goto out;
+    espm_brightness_helper_channel_failed (brightness);
   }
-  g_debug ("executed %s; retval: %i", command, exit_status);
-  ret = (exit_status == 0);
+  g_mutex_unlock (&brightness->priv->helper_lock);
+
+  g_task_return_boolean (task, !broken);
+}
+
+/*
+ * Ask for the channel in the background, unless that is already under
+ * way or was refused less than HELPER_RETRY_INTERVAL ago. Called with
+ * the helper lock held.
+ */
+static void
+espm_brightness_helper_authorize (EspmBrightness *brightness, const gchar *device)
+{
+  GTask *task;
+
+  if ( brightness->priv->helper_authorizing )
+    return;
+
+  if ( brightness->priv->helper_channel_failed )
+  {
+    if ( g_get_monotonic_time () - brightness->priv->helper_channel_failed_time < HELPER_RETRY_INTERVAL )
+      return;
+    brightness->priv->helper_channel_failed = FALSE;
+  }
+
+  brightness->priv->helper_authorizing = TRUE;
+
+  task = g_task_new (brightness, NULL, NULL, NULL);
+  g_task_set_task_data (task, g_strdup (device), g_free);
+  g_task_run_in_thread (task, espm_brightness_helper_authorize_thread);
+  g_object_unref (task);
+}
+
+/*
+ * Whether the channel is being authorized right now. Callers fail
+ * instead of waiting for the user, or spawning a second prompt.
+ */
+static gboolean
+espm_brightness_helper_authorizing (EspmBrightness *brightness)
+{
+  gboolean ret;
+
+  g_mutex_lock (&brightness->priv->helper_lock);
+  ret = brightness->priv->helper_authorizing;
+  g_mutex_unlock (&brightness->priv->helper_lock);
+
+  return ret;
+}
+
+static gboolean
+espm_brightness_helper_has_channel (EspmBrightness *brightness)
+{
+  gboolean ret;
+
+  g_mutex_lock (&brightness->priv->helper_lock);
+  ret = brightness->priv->helper_socket != NULL;
+  g_mutex_unlock (&brightness->priv->helper_lock);
+
+  return ret;
+}
+
+/*
+ * Send one request over the helper channel and wait for its reply.
+ * The channel is kept for the whole session. Without one, this starts
+ * its authorization in the background and fails right away; if it
+ * cannot be authorized we fall back to spawning the helper for every
+ * request, and try the channel again after HELPER_RETRY_INTERVAL.
+ */
+static gboolean
+espm_brightness_helper_request (EspmBrightness *brightness, const gchar *device,
+                                const gchar *request, gint *value)
+{
+  gboolean broken = FALSE;
+  gboolean ret = FALSE;
+
+  g_mutex_lock (&brightness->priv->helper_lock);
+
+  if ( brightness->priv->helper_socket == NULL )
+  {
+    espm_brightness_helper_authorize (brightness, device);
+    g_mutex_unlock (&brightness->priv->helper_lock);
+    return FALSE;
+  }
+
+  ret = espm_brightness_helper_exchange (brightness->priv->helper_socket, request, value, &broken);
+
+  /* the helper went away, the next request asks for a new one */
+  if ( broken )
+    espm_brightness_helper_close_channel (brightness);
+
+  g_mutex_unlock (&brightness->priv->helper_lock);
+  return ret;
+}
+
+static gboolean
+espm_brightness_setup_helper (EspmBrightness *brightness)
+{
+  gint32 ret;
+
+#if !defined(BACKEND_TYPE_FREEBSD)
+  if ( espm_brightness_sysfs_open (brightness) )
+    ret = (gint32) espm_backlight_sysfs_read_fd (brightness->priv->sysfs_max_fd);
+  /* one helper run for both the range and the current level */
+  else if ( !espm_brightness_helper_list (brightness, &ret) )
+    ret = -1;
+#else
+  ret = (gint32) espm_brightness_helper_get_value (NULL, "get-max-brightness");
+#endif
+  g_debug ("espm_brightness_setup_helper: get-max-brightness returned %i", ret);
+  if ( ret < 0 )
+  {
+    brightness->priv->helper_has_hw = FALSE;
+  }
+  else
+  {
+    brightness->priv->helper_has_hw = TRUE;
+    brightness->priv->min_level = 0;
+    brightness->priv->max_level = ret;
+  }
+
+  return brightness->priv->helper_has_hw;
+}
+
+/*
+ * Read the level through the helper, for when sysfs can't be read
+ * directly. Touches nothing guarded by the main lock.
+ */
+static gboolean
+espm_brightness_helper_read (EspmBrightness *brg, const gchar *device, gint32 *level)
+{
+  gint32 ret;
+
+  /* reuse the channel if we already have one, reading needs no authorization */
+  if ( espm_brightness_helper_has_channel (brg)
+       && espm_brightness_helper_request (brg, device, "get-brightness", &ret) )
+  {
+    *level = ret;
+    return TRUE;
+  }
+
+  ret = (gint32) espm_brightness_helper_get_value (device, "get-brightness");
+
+  g_debug ("espm_brightness_helper_read: get-brightness returned %i", ret);
+
+  if ( ret < 0 )
+    return FALSE;
+
+  *level = ret;
+  return TRUE;
+}
+
+/*
+ * Write the level through the helper, *written is the level it ended
+ * up at. Touches nothing guarded by the main lock.
+ */
+static gboolean
+espm_brightness_helper_write (EspmBrightness *brg, const gchar *device, gint32 level, gint32 *written)
+{
+  gboolean ret;
+  gchar *command = NULL;
+#if !defined(BACKEND_TYPE_FREEBSD)
+  gint values[2];
+#else
+  GError *error = NULL;
+  gint exit_status = 0;
+#endif
+
+  *written = level;
+
+  command = g_strdup_printf ("set-brightness %i", level);
+  ret = espm_brightness_helper_request (brg, device, command, NULL);
+  g_free (command);
+  if ( ret )
+    return TRUE;
+
+  /* the dialog is up already, don't block on a second one */
+  if ( espm_brightness_helper_authorizing (brg) )
+    return FALSE;
+
+#if !defined(BACKEND_TYPE_FREEBSD)
+  /* no channel, read the level back in the same run so the next step needs no spawn */
+  command = g_strdup_printf ("set-brightness %i\nget-brightness\n", level);
+  ret = espm_brightness_helper_batch (device, command, values, 2);
+  if ( ret )
+    *written = values[1];
+#else
+  command = g_strdup_printf ("pkexec " SBINDIR "/espm-power-backlight-helper --set-brightness %i", level);
+  ret = g_spawn_command_line_sync (command, NULL, NULL, &exit_status, &error);
+  if ( !ret )
+  {
+    if (error)
+    {
+      g_warning ("espm_brightness_helper_set_level: failed to set value: %s", error->message);
+      g_error_free (error);
+    }
+  }
+  else
+  {
+    g_debug ("executed %s; retval: %i", command, exit_status);
+    ret = (exit_status == 0);
+  }
+#endif
+
+  g_free (command);
+  return ret;
+}
+
+static gboolean
+espm_brightness_helper_get_level (EspmBrightness *brg, gint32 *level)
+{
+  if ( ! brg->priv->helper_has_hw )
+    return FALSE;
+
+#if !defined(BACKEND_TYPE_FREEBSD)
+  if ( espm_brightness_sysfs_get_level (brg, level) )
+    return TRUE;
+#endif
+
+  if ( !espm_brightness_helper_read (brg, espm_brightness_helper_device (brg), level) )
+    return FALSE;
+
+  espm_brightness_cache_level (brg, *level);
+  return TRUE;
+}
+
+static gboolean
+espm_brightness_helper_set_level (EspmBrightness *brg, gint32 level)
+{
+  espm_brightness_expect_write (brg, level);
+
+  if ( !espm_brightness_helper_write (brg, espm_brightness_helper_device (brg), level, &level) )
+  {
+    espm_brightness_invalidate_level (brg);
+    return FALSE;
+  }
+
+  espm_brightness_cache_level (brg, level);
+  return TRUE;
+}
+
+static gboolean
+espm_brightness_helper_get_switch (EspmBrightness *brg, gint *brightness_switch)
+{
+  gint ret;
+
+  ret = espm_brightness_helper_get_value (espm_brightness_helper_device (brg), "get-brightness-switch");
+
+  if ( ret >= 0 )
+  {
+    *brightness_switch = ret;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static gboolean
+espm_brightness_helper_set_switch (EspmBrightness *brg, gint brightness_switch)
+{
+  gboolean ret;
+  GError *error = NULL;
+  gint exit_status = 0;
+  gchar *command = NULL;
+
+  /* only worth keeping a channel open when it also writes the level */
+  if ( brg->priv->helper_has_hw )
+  {
+    command = g_strdup_printf ("set-brightness-switch %i", brightness_switch);
+    ret = espm_brightness_helper_request (brg, espm_brightness_helper_device (brg), command, NULL);
+    g_free (command);
+    if ( ret )
+      return TRUE;
+    if ( espm_brightness_helper_authorizing (brg) )
+      return FALSE;
+  }
+
+  command = g_strdup_printf ("pkexec " SBINDIR "/espm-power-backlight-helper --set-brightness-switch %i", brightness_switch);
+  ret = g_spawn_command_line_sync (command, NULL, NULL, &exit_status, &error);
+  if ( !ret )
+  {
+    if (error)
+    {
+      g_warning ("espm_brightness_helper_set_switch: failed to set value: %s", error->message);
+      g_error_free (error);
+    }
+    goto out;
+  }
+  g_debug ("executed %s; retval: %i", command, exit_status);
+  ret = (exit_status == 0);
+
+out:
+  g_free (command);
+  return ret;
+}
+
+#endif
+
+static gboolean
+espm_brightness_backend_get_level (EspmBrightness *brightness, gint32 *level)
+{
+  if ( brightness->priv->xrandr_has_hw )
+    return espm_brightness_xrandr_get_level (brightness, level);
+#if !defined(BACKEND_TYPE_FREEBSD)
+  if ( brightness->priv->logind_has_hw )
+    return espm_brightness_sysfs_get_level (brightness, level);
+#endif
+#ifdef ENABLE_POLKIT
+  if ( brightness->priv->helper_has_hw )
+    return espm_brightness_helper_get_level (brightness, level);
+#endif
+
+  return FALSE;
+}
+
+static gboolean
+espm_brightness_backend_set_level (EspmBrightness *brightness, gint32 level)
+{
+  if ( brightness->priv->xrandr_has_hw )
+    return espm_brightness_xrandr_set_level (brightness, level);
+#if !defined(BACKEND_TYPE_FREEBSD)
+  if ( brightness->priv->logind_has_hw )
+    return espm_brightness_logind_set_level (brightness, level);
+#endif
+#ifdef ENABLE_POLKIT
+  if ( brightness->priv->helper_has_hw )
+    return espm_brightness_helper_set_level (brightness, level);
+#endif
+
+  return FALSE;
+}
+
+#if !defined(BACKEND_TYPE_FREEBSD)
+/*
+ * logind refused a write, most likely because the session isn't the
+ * active one or logind lost SetBrightness. Stop using it and hand the
+ * level to the helper, if there is one.
+ */
+static gboolean
+espm_brightness_logind_failed (EspmBrightness *brightness, gint32 level)
+{
+  brightness->priv->logind_has_hw = FALSE;
+  espm_brightness_invalidate_level (brightness);
+
+#ifdef ENABLE_POLKIT
+  if ( espm_brightness_setup_helper (brightness) )
+  {
+    g_debug ("logind can't set the brightness, falling back to the helper");
+    espm_brightness_build_steps (brightness);
+    return espm_brightness_helper_set_level (brightness, level);
+  }
+#endif
+
+  g_warning ("logind can't set the brightness and there is no helper to fall back to");
+  return FALSE;
+}
+#endif
+
+/* the level one step up or down from hw_level, within the range */
+static gint32
+espm_brightness_step_target (EspmBrightness *brightness, gboolean up, gint32 hw_level)
+{
+  if ( up )
+    return MIN (espm_brightness_inc (brightness, hw_level), brightness->priv->max_level);
+
+  return MAX (espm_brightness_dec (brightness, hw_level), brightness->priv->min_level);
+}
+
+/*
+ * One step up or down from the cached level, the same for every
+ * backend since the step table hides the curve.
+ */
+static gboolean
+espm_brightness_step (EspmBrightness *brightness, gboolean up, gint32 *new_level)
+{
+  const gchar *direction = up ? "up" : "down";
+  gint32 hw_level;
+  gint32 set_level;
+
+  if ( !espm_brightness_get_cached_level (brightness, &hw_level) )
+    return FALSE;
+
+  if ( up && hw_level >= brightness->priv->max_level )
+  {
+    *new_level = brightness->priv->max_level;
+    return TRUE;
+  }
+  if ( !up && hw_level <= brightness->priv->min_level )
+  {
+    *new_level = brightness->priv->min_level;
+    return TRUE;
+  }
+
+  set_level = espm_brightness_step_target (brightness, up, hw_level);
+
+  if ( !espm_brightness_backend_set_level (brightness, set_level) )
+  {
+    g_warning ("brightness %s failed to set the hw level to %d", direction, set_level);
+    return FALSE;
+  }
+
+  if ( !brightness->priv->verify_writes )
+  {
+    *new_level = set_level;
+    return TRUE;
+  }
+
+  /* paranoid mode, read the level back from the hardware */
+  if ( !espm_brightness_backend_get_level (brightness, new_level) )
+  {
+    g_warning ("brightness %s failed for %d", direction, set_level);
+    return FALSE;
+  }
+
+  /* Nothing changed in the hardware*/
+  if ( *new_level == hw_level )
+  {
+    g_warning ("brightness %s did not change the hw level to %d", direction, set_level);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+espm_brightness_class_init (EspmBrightnessClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = espm_brightness_finalize;
+
+  signals [LEVEL_CHANGED] =
+        g_signal_new ("level-changed",
+                      ESPM_TYPE_BRIGHTNESS,
+                      G_SIGNAL_RUN_LAST,
+                      G_STRUCT_OFFSET(EspmBrightnessClass, level_changed),
+                      NULL, NULL,
+                      g_cclosure_marshal_VOID__INT,
+                      G_TYPE_NONE, 1, G_TYPE_INT);
+}
+
+static void
+espm_brightness_init (EspmBrightness *brightness)
+{
+  brightness->priv = espm_brightness_get_instance_private (brightness);
+
+  brightness->priv->resource = NULL;
+  brightness->priv->xrandr_has_hw = FALSE;
+  brightness->priv->helper_has_hw = FALSE;
+  brightness->priv->max_level = 0;
+  brightness->priv->min_level = 0;
+  brightness->priv->current_level = 0;
+  brightness->priv->current_level_valid = FALSE;
+  brightness->priv->current_level_time = 0;
+  brightness->priv->verify_writes = FALSE;
+  brightness->priv->requests = g_queue_new ();
+  brightness->priv->running_request = NULL;
+  g_rec_mutex_init (&brightness->priv->lock);
+  brightness->priv->transition_duration = 0;
+  brightness->priv->transition_id = 0;
+  brightness->priv->transition_active = FALSE;
+  brightness->priv->output = None;
+  brightness->priv->outputs = g_array_new (FALSE, FALSE, sizeof (EspmBrightnessOutput));
+  brightness->priv->xrandr_event_base = 0;
+  brightness->priv->xrandr_watching = FALSE;
+  brightness->priv->xrandr_pending_notifies = 0;
+  brightness->priv->level_watched = FALSE;
+  brightness->priv->steps = NULL;
+  brightness->priv->n_steps = 0;
+  brightness->priv->step_count = 10;
+  brightness->priv->step_exponential = FALSE;
+#if !defined(BACKEND_TYPE_FREEBSD)
+  brightness->priv->device = NULL;
+  brightness->priv->sysfs_device = NULL;
+  brightness->priv->sysfs_level_fd = -1;
+  brightness->priv->sysfs_max_fd = -1;
+  brightness->priv->sysfs_watch_id = 0;
+  brightness->priv->sysfs_monitor = NULL;
+  brightness->priv->written_level = -1;
+  brightness->priv->logind_has_hw = FALSE;
+  brightness->priv->logind_bus = NULL;
+  brightness->priv->logind_writes = g_queue_new ();
+#endif
+#ifdef ENABLE_POLKIT
+  g_mutex_init (&brightness->priv->helper_lock);
+  brightness->priv->helper_socket = NULL;
+  brightness->priv->helper_authorizing = FALSE;
+  brightness->priv->helper_channel_failed = FALSE;
+  brightness->priv->helper_channel_failed_time = 0;
+#endif
+}
+
+static void
+espm_brightness_free_data (EspmBrightness *brightness)
+{
+  if ( brightness->priv->resource )
+  {
+    XRRFreeScreenResources (brightness->priv->resource);
+    brightness->priv->resource = NULL;
+  }
+}
+
+static void
+espm_brightness_finalize (GObject *object)
+{
+  EspmBrightness *brightness;
+
+  brightness = ESPM_BRIGHTNESS (object);
+
+  if ( brightness->priv->xrandr_watching )
+    gdk_window_remove_filter (NULL, espm_brightness_xrandr_event_filter, brightness);
+
+  espm_brightness_free_data (brightness);
+  g_array_free (brightness->priv->outputs, TRUE);
+  g_free (brightness->priv->steps);
+#if !defined(BACKEND_TYPE_FREEBSD)
+  espm_brightness_sysfs_close (brightness);
+  g_free (brightness->priv->device);
+  if ( brightness->priv->logind_bus )
+    g_object_unref (brightness->priv->logind_bus);
+  /* pending SetBrightness calls hold a reference on us */
+  g_queue_free (brightness->priv->logind_writes);
+#endif
+#ifdef ENABLE_POLKIT
+  espm_brightness_helper_close_channel (brightness);
+  g_mutex_clear (&brightness->priv->helper_lock);
+#endif
+
+  /* queued requests hold a reference on us, so the queue is empty here */
+  g_queue_free (brightness->priv->requests);
+  g_rec_mutex_clear (&brightness->priv->lock);
+
+  G_OBJECT_CLASS (espm_brightness_parent_class)->finalize (object);
+}
+
+EspmBrightness *
+espm_brightness_new (void)
+{
+  EspmBrightness *brightness = NULL;
+  brightness = g_object_new (ESPM_TYPE_BRIGHTNESS, NULL);
+  return brightness;
+}
+
+static gboolean
+espm_brightness_setup_backend (EspmBrightness *brightness)
+{
+  espm_brightness_invalidate_level (brightness);
+  brightness->priv->xrandr_has_hw = espm_brightness_setup_xrandr (brightness);
+  brightness->priv->level_watched = brightness->priv->xrandr_has_hw && brightness->priv->xrandr_watching;
+
+  if ( brightness->priv->xrandr_has_hw )
+  {
+    espm_brightness_build_steps (brightness);
+    g_debug ("Brightness controlled by xrandr on %u output(s), min_level=%d max_level=%d",
+             brightness->priv->outputs->len,
+             brightness->priv->min_level,
+             brightness->priv->max_level);
+
+    return TRUE;
+  }
+#if !defined(BACKEND_TYPE_FREEBSD)
+  if ( espm_brightness_setup_logind (brightness) )
+  {
+    espm_brightness_build_steps (brightness);
+    brightness->priv->level_watched = brightness->priv->sysfs_watch_id != 0;
+    g_debug ("xrandr not available, brightness controlled by logind on %s; min_level=%d max_level=%d",
+             brightness->priv->sysfs_device,
+             brightness->priv->min_level,
+             brightness->priv->max_level);
+    return TRUE;
+  }
+#endif
+#ifdef ENABLE_POLKIT
+  if ( espm_brightness_setup_helper (brightness) ) {
+    espm_brightness_build_steps (brightness);
+#if !defined(BACKEND_TYPE_FREEBSD)
+    /* the file monitor fallback misses changes made inside the kernel */
+    brightness->priv->level_watched = brightness->priv->sysfs_watch_id != 0;
+#endif
+#if defined(BACKEND_TYPE_FREEBSD)
+    g_debug ("xrandr not available, brightness controlled by sysctl helper; min_level=%d max_level=%d",
+#else
+    g_debug ("xrandr not available, brightness controlled by sysfs helper; min_level=%d max_level=%d",
+#endif
+             brightness->priv->min_level,
+             brightness->priv->max_level);
+    return TRUE;
+  }
+#endif
+  g_debug ("no brightness controls available");
+  return FALSE;
+}
+
+gboolean
+espm_brightness_setup (EspmBrightness *brightness)
+{
+  gboolean ret;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+  ret = espm_brightness_setup_backend (brightness);
+  g_rec_mutex_unlock (&brightness->priv->lock);
+
+  return ret;
+}
+
+/*
+ * Drive the named sysfs backlight instead of the best one, for setups
+ * with more than one of them. Takes effect on the next setup, NULL goes
+ * back to the best device.
+ */
+void espm_brightness_set_device (EspmBrightness *brightness, const gchar *device)
+{
+#if !defined(BACKEND_TYPE_FREEBSD)
+  g_rec_mutex_lock (&brightness->priv->lock);
+  g_free (brightness->priv->device);
+  brightness->priv->device = g_strdup (device);
+  g_rec_mutex_unlock (&brightness->priv->lock);
+#endif
+}
+
+gboolean espm_brightness_up (EspmBrightness *brightness, gint32 *new_level)
+{
+  gboolean ret = FALSE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+  espm_brightness_stop_transition (brightness);
+
+  ret = espm_brightness_step (brightness, TRUE, new_level);
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return ret;
+}
+
+gboolean espm_brightness_down (EspmBrightness *brightness, gint32 *new_level)
+{
+  gboolean ret = FALSE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+  espm_brightness_stop_transition (brightness);
+
+  ret = espm_brightness_step (brightness, FALSE, new_level);
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return ret;
+}
+
+gboolean espm_brightness_has_hw (EspmBrightness *brightness)
+{
+#if !defined(BACKEND_TYPE_FREEBSD)
+  if ( brightness->priv->logind_has_hw )
+    return TRUE;
+#endif
+  return brightness->priv->xrandr_has_hw || brightness->priv->helper_has_hw;
+}
+
+gint32 espm_brightness_get_max_level (EspmBrightness *brightness)
+{
+  return brightness->priv->max_level;
+}
+
+gboolean espm_brightness_get_level  (EspmBrightness *brightness, gint32 *level)
+{
+  gboolean ret = FALSE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+
+  /* while the level is watched the cache is as good as the hardware */
+  if ( brightness->priv->level_watched && brightness->priv->current_level_valid )
+  {
+    *level = brightness->priv->current_level;
+    ret = TRUE;
+  }
+  else
+    ret = espm_brightness_backend_get_level (brightness, level);
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return ret;
+}
+
+gboolean espm_brightness_set_level (EspmBrightness *brightness, gint32 level)
+{
+  gboolean ret = FALSE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+  espm_brightness_stop_transition (brightness);
+
+  ret = espm_brightness_backend_set_level (brightness, level);
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return ret;
+}
+
+gboolean espm_brightness_set_step_count (EspmBrightness *brightness, guint32 count, gboolean exponential)
+{
+  gboolean ret = FALSE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+
+  if ( espm_brightness_has_hw (brightness) ) {
+    if ( count < 2 )
+      count = 2;
+    exponential = exponential ? TRUE : FALSE;
+
+    /* cheap enough to call on every key press, the table is kept until the settings change */
+    if ( count != brightness->priv->step_count || exponential != brightness->priv->step_exponential )
+    {
+      brightness->priv->step_count = count;
+      brightness->priv->step_exponential = exponential;
+      espm_brightness_build_steps (brightness);
+    }
+    ret = TRUE;
+  }
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return ret;
+}
+
+gboolean espm_brightness_dim_down (EspmBrightness *brightness)
+{
+  gboolean ret = FALSE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+  espm_brightness_stop_transition (brightness);
+
+  ret = espm_brightness_backend_set_level (brightness, brightness->priv->min_level);
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return ret;
+}
+
+/*
+ * The video module's brightness switch goes with the sysfs backlight,
+ * whether logind or the helper writes the level. XRandR drivers are
+ * left alone.
+ */
+static gboolean
+espm_brightness_has_switch (EspmBrightness *brightness)
+{
+#if !defined(BACKEND_TYPE_FREEBSD)
+  if ( brightness->priv->logind_has_hw )
+    return TRUE;
+#endif
+  return brightness->priv->helper_has_hw;
+}
+
+gboolean espm_brightness_get_switch (EspmBrightness *brightness, gint *brightness_switch)
+{
+  gboolean ret = FALSE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+
+  if ( espm_brightness_has_switch (brightness) )
+  {
+#if !defined(BACKEND_TYPE_FREEBSD)
+    ret = espm_brightness_sysfs_get_switch (brightness_switch);
+#endif
+#ifdef ENABLE_POLKIT
+    if ( !ret )
+      ret = espm_brightness_helper_get_switch (brightness, brightness_switch);
+#endif
+  }
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return ret;
+}
+
+gboolean espm_brightness_set_switch (EspmBrightness *brightness, gint brightness_switch)
+{
+  gboolean ret = FALSE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+
+#ifdef ENABLE_POLKIT
+  if ( espm_brightness_has_switch (brightness) )
+    ret = espm_brightness_helper_set_switch (brightness, brightness_switch);
+#endif
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return ret;
+}
+
+/*
+ * Get the level without touching the hardware, this only succeeds when
+ * the cached level is known to be current.
+ */
+gboolean espm_brightness_peek_level (EspmBrightness *brightness, gint32 *level)
+{
+  gboolean ret = FALSE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+
+  if ( brightness->priv->level_watched && brightness->priv->current_level_valid )
+  {
+    *level = brightness->priv->current_level;
+    ret = TRUE;
+  }
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return ret;
+}
+
+/*
+ * The level one step up or down from level, without touching the
+ * hardware. Lets callers walk the step table from a level they have
+ * not written yet.
+ */
+gint32 espm_brightness_next_level (EspmBrightness *brightness, gint32 level, gboolean up)
+{
+  gint32 ret;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+
+  if ( up )
+    ret = MIN (espm_brightness_inc (brightness, level), brightness->priv->max_level);
+  else
+    ret = MAX (espm_brightness_dec (brightness, level), brightness->priv->min_level);
+
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return ret;
+}
+
+/*
+ * In verify mode every up/down step reads the level back from the
+ * hardware to make sure the write took, instead of trusting the cache.
+ */
+void espm_brightness_set_verify_writes (EspmBrightness *brightness, gboolean verify)
+{
+  brightness->priv->verify_writes = verify;
+}
+
+/*
+ * Smooth transitions
+ *
+ * A transition ramps the level linearly over transition_duration
+ * milliseconds, recomputing the level from the monotonic clock on each
+ * frame so that slow hardware writes stretch the steps instead of the
+ * whole fade. Any explicit level change stops a running transition.
+ */
+
+static gboolean
+espm_brightness_can_animate (EspmBrightness *brightness)
+{
+  if ( brightness->priv->transition_duration == 0 )
+    return FALSE;
+
+#ifdef ENABLE_POLKIT
+  /* without the helper channel every frame would spawn pkexec */
+  if ( brightness->priv->helper_has_hw && !espm_brightness_helper_has_channel (brightness) )
+    return FALSE;
+#endif
+
+  return TRUE;
+}
+
+static void
+espm_brightness_stop_transition (EspmBrightness *brightness)
+{
+  /* the timer notices this on its next frame and goes away */
+  brightness->priv->transition_active = FALSE;
+}
+
+static gboolean
+espm_brightness_transition_frame (gpointer data)
+{
+  EspmBrightness *brightness = ESPM_BRIGHTNESS (data);
+  gint64 elapsed;
+  gint32 level;
+
+  /* an async request is using the hardware, try again on the next frame */
+  if ( !g_rec_mutex_trylock (&brightness->priv->lock) )
+    return G_SOURCE_CONTINUE;
+
+  if ( !brightness->priv->transition_active )
+    goto done;
+
+  elapsed = (g_get_monotonic_time () - brightness->priv->transition_start) / 1000;
+
+  if ( elapsed >= brightness->priv->transition_duration || !espm_brightness_can_animate (brightness) )
+  {
+    level = brightness->priv->transition_to;
+    brightness->priv->transition_active = FALSE;
+  }
+  else
+  {
+    level = brightness->priv->transition_from +
+            (brightness->priv->transition_to - brightness->priv->transition_from) *
+            elapsed / (gint64) brightness->priv->transition_duration;
+  }
+
+  if ( level != brightness->priv->transition_level )
+  {
+    espm_brightness_backend_set_level (brightness, level);
+    brightness->priv->transition_level = level;
+  }
+
+  if ( brightness->priv->transition_active )
+  {
+    g_rec_mutex_unlock (&brightness->priv->lock);
+    return G_SOURCE_CONTINUE;
+  }
+
+done:
+  brightness->priv->transition_id = 0;
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Duration in milliseconds of the transitions started with
+ * espm_brightness_transition_to, 0 makes them jump straight to the target.
+ */
+void espm_brightness_set_transition_duration (EspmBrightness *brightness, guint duration)
+{
+  brightness->priv->transition_duration = duration;
+}
+
+gboolean espm_brightness_transition_to (EspmBrightness *brightness, gint32 level)
+{
+  gint32 current;
+  gboolean ret = TRUE;
+
+  if ( !espm_brightness_has_hw (brightness) )
+    return FALSE;
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+
+  if ( !espm_brightness_can_animate (brightness) )
+  {
+    ret = espm_brightness_set_level (brightness, level);
+    goto out;
+  }
+
+  /* retarget a running transition from wherever it got to */
+  if ( brightness->priv->transition_active )
+    current = brightness->priv->transition_level;
+  else if ( !espm_brightness_get_cached_level (brightness, &current) )
+  {
+    ret = FALSE;
+    goto out;
+  }
+
+  if ( current == level )
+  {
+    espm_brightness_stop_transition (brightness);
+    goto out;
+  }
+
+  ESPM_DEBUG ("Brightness transition from %d to %d in %u ms",
+              current, level, brightness->priv->transition_duration);
+
+  brightness->priv->transition_from = current;
+  brightness->priv->transition_to = level;
+  brightness->priv->transition_level = current;
+  brightness->priv->transition_start = g_get_monotonic_time ();
+  brightness->priv->transition_active = TRUE;
+
+  /* the timer keeps us alive, so a fade started right before the last unref still finishes */
+  if ( brightness->priv->transition_id == 0 )
+    brightness->priv->transition_id = g_timeout_add_full (G_PRIORITY_DEFAULT,
+                                                          TRANSITION_FRAME_INTERVAL,
+                                                          espm_brightness_transition_frame,
+                                                          g_object_ref (brightness),
+                                                          g_object_unref);
 
 out:
-  g_free (command);
+  g_rec_mutex_unlock (&brightness->priv->lock);
   return ret;
 }
 
+/*
+ * Asynchronous API
+ *
+ * Requests are run one at a time in the order they were made. The
+ * helper backend blocks on the backlight helper, so its requests run
+ * in a worker thread that only holds the main lock to read and update
+ * the cached level, never across a helper round trip. XRandR and
+ * logind requests don't block: Xlib calls are short round trips to the
+ * local server that have to stay on the GDK connection, and logind
+ * writes aren't waited for. Those run right away in the main thread
+ * through the synchronous calls, and are completed once these dropped
+ * the lock.
+ */
+
+static void espm_brightness_dispatch_request (EspmBrightness *brightness);
+
+/* whether requests have to go to the worker thread, see above */
 static gboolean
-espm_brightness_helper_up (EspmBrightness *brightness, gint32 *new_level)
+espm_brightness_request_blocks (EspmBrightness *brightness)
 {
-  gint32 hw_level;
-  gboolean ret = FALSE;
-  gint32 set_level;
-
-  ret = espm_brightness_helper_get_level (brightness, &hw_level);
+  return !brightness->priv->xrandr_has_hw
+#if !defined(BACKEND_TYPE_FREEBSD)
+         && !brightness->priv->logind_has_hw
+#endif
+         ;
+}
 
-  if ( !ret )
-    return FALSE;
+#ifdef ENABLE_POLKIT
+/*
+ * The current level for a helper request, from the cache or sysfs
+ * under the main lock, or from the helper without it.
+ */
+static gboolean
+espm_brightness_request_read_level (EspmBrightness *brightness, const gchar *device,
+                                    gboolean use_cache, gint32 *level)
+{
+  gboolean ret = FALSE;
 
-  if ( hw_level >= brightness->priv->max_level )
+  g_rec_mutex_lock (&brightness->priv->lock);
+  if ( use_cache && espm_brightness_cache_is_fresh (brightness) )
   {
-    *new_level = brightness->priv->max_level;
-    return TRUE;
+    *level = brightness->priv->current_level;
+    ret = TRUE;
   }
+#if !defined(BACKEND_TYPE_FREEBSD)
+  else
+    ret = espm_brightness_sysfs_get_level (brightness, level);
+#endif
+  g_rec_mutex_unlock (&brightness->priv->lock);
 
-  set_level = MIN (espm_brightness_inc (brightness, hw_level), brightness->priv->max_level);
-
-  g_warn_if_fail (espm_brightness_helper_set_level (brightness, set_level));
-
-  ret = espm_brightness_helper_get_level (brightness, new_level);
-
-  if ( !ret )
-  {
-    g_warning ("espm_brightness_helper_up failed for %d", set_level);
-    return FALSE;
-  }
+  if ( ret )
+    return TRUE;
 
-  /* Nothing changed in the hardware*/
-  if ( *new_level == hw_level )
-  {
-    g_warning ("espm_brightness_helper_up did not change the hw level to %d", set_level);
+  if ( !espm_brightness_helper_read (brightness, device, level) )
     return FALSE;
-  }
 
+  g_rec_mutex_lock (&brightness->priv->lock);
+  espm_brightness_cache_level (brightness, *level);
+  g_rec_mutex_unlock (&brightness->priv->lock);
   return TRUE;
 }
 
-static gboolean
-espm_brightness_helper_down (EspmBrightness *brightness, gint32 *new_level)
+static void
+espm_brightness_request_helper_thread (GTask        *task,
+                                       gpointer      source_object,
+                                       gpointer      task_data,
+                                       GCancellable *cancellable)
 {
-  gint32 hw_level;
-  gboolean ret;
-  gint32 set_level;
+  EspmBrightness *brightness = ESPM_BRIGHTNESS (source_object);
+  EspmBrightnessRequest *request = task_data;
+  gboolean up = request->type == BRIGHTNESS_REQUEST_UP;
+  gint32 level = request->level;
+  gint32 current = -1;
+  gboolean verify;
+  gchar *device;
+  gboolean ret = TRUE;
 
-  ret = espm_brightness_helper_get_level (brightness, &hw_level);
+  if ( g_task_return_error_if_cancelled (task) )
+    return;
 
-  if ( !ret )
-    return FALSE;
+  g_rec_mutex_lock (&brightness->priv->lock);
+  device = g_strdup (espm_brightness_helper_device (brightness));
+  verify = brightness->priv->verify_writes;
+  ret = brightness->priv->helper_has_hw;
+  g_rec_mutex_unlock (&brightness->priv->lock);
+
+  if ( ret && request->type != BRIGHTNESS_REQUEST_SET_LEVEL )
+    ret = espm_brightness_request_read_level (brightness, device, TRUE, &current);
 
-  if ( hw_level <= brightness->priv->min_level )
+  if ( !ret || request->type == BRIGHTNESS_REQUEST_GET_LEVEL )
   {
-    *new_level = brightness->priv->min_level;
-    return TRUE;
+    level = current;
+    goto out;
   }
 
-  set_level = MAX (espm_brightness_dec (brightness, hw_level), brightness->priv->min_level);
-
-  g_warn_if_fail (espm_brightness_helper_set_level (brightness, set_level));
+  if ( request->type != BRIGHTNESS_REQUEST_SET_LEVEL )
+  {
+    g_rec_mutex_lock (&brightness->priv->lock);
+    level = espm_brightness_step_target (brightness, up, current);
+    g_rec_mutex_unlock (&brightness->priv->lock);
 
-  ret = espm_brightness_helper_get_level (brightness, new_level);
+    /* already at the end of the range */
+    if ( level == current )
+      goto out;
+  }
 
-  if ( !ret )
+  if ( g_task_return_error_if_cancelled (task) )
   {
-    g_warning ("espm_brightness_helper_down failed for %d", set_level);
-    return FALSE;
+    g_free (device);
+    return;
   }
 
-  /* Nothing changed in the hardware*/
-  if ( *new_level == hw_level )
+  g_rec_mutex_lock (&brightness->priv->lock);
+  espm_brightness_expect_write (brightness, level);
+  g_rec_mutex_unlock (&brightness->priv->lock);
+
+  ret = espm_brightness_helper_write (brightness, device, level, &level);
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+  if ( ret )
+    espm_brightness_cache_level (brightness, level);
+  else
+    espm_brightness_invalidate_level (brightness);
+  g_rec_mutex_unlock (&brightness->priv->lock);
+
+  /* paranoid mode, read the level back from the hardware */
+  if ( ret && verify )
   {
-    g_warning ("espm_brightness_helper_down did not change the hw level to %d", set_level);
-    return FALSE;
+    ret = espm_brightness_request_read_level (brightness, device, FALSE, &level);
+    if ( ret && request->type != BRIGHTNESS_REQUEST_SET_LEVEL && level == current )
+    {
+      g_warning ("brightness %s did not change the hw level", up ? "up" : "down");
+      ret = FALSE;
+    }
   }
 
-  return TRUE;
-}
+out:
+  g_free (device);
 
+  if ( ret )
+    g_task_return_int (task, level);
+  else
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to access the display brightness");
+}
 #endif
 
+/* non-blocking backends, in the main thread */
 static void
-espm_brightness_class_init (EspmBrightnessClass *klass)
+espm_brightness_request_run (GTask        *task,
+                             gpointer      source_object,
+                             gpointer      task_data,
+                             GCancellable *cancellable)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  EspmBrightness *brightness = ESPM_BRIGHTNESS (source_object);
+  EspmBrightnessRequest *request = task_data;
+  gint32 level = request->level;
+  gboolean ret = FALSE;
 
-  object_class->finalize = espm_brightness_finalize;
-}
+  if ( g_task_return_error_if_cancelled (task) )
+    return;
 
-static void
-espm_brightness_init (EspmBrightness *brightness)
-{
-  brightness->priv = espm_brightness_get_instance_private (brightness);
+  switch (request->type)
+  {
+    case BRIGHTNESS_REQUEST_GET_LEVEL:
+      ret = espm_brightness_get_level (brightness, &level);
+      break;
+    case BRIGHTNESS_REQUEST_SET_LEVEL:
+      ret = espm_brightness_set_level (brightness, level);
+      break;
+    case BRIGHTNESS_REQUEST_UP:
+      ret = espm_brightness_up (brightness, &level);
+      break;
+    case BRIGHTNESS_REQUEST_DOWN:
+      ret = espm_brightness_down (brightness, &level);
+      break;
+  }
 
-  brightness->priv->resource = NULL;
-  brightness->priv->xrandr_has_hw = FALSE;
-  brightness->priv->helper_has_hw = FALSE;
-  brightness->priv->use_exp_step = FALSE;
-  brightness->priv->max_level = 0;
-  brightness->priv->min_level = 0;
-  brightness->priv->current_level = 0;
-  brightness->priv->output = 0;
-  brightness->priv->step = 0;
-  brightness->priv->exp_step = 1;
+  if ( ret )
+    g_task_return_int (task, level);
+  else
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to access the display brightness");
 }
 
 static void
-espm_brightness_free_data (EspmBrightness *brightness)
+espm_brightness_request_completed_cb (GTask *task, GParamSpec *pspec, EspmBrightness *brightness)
 {
-  if ( brightness->priv->resource )
-    XRRFreeScreenResources (brightness->priv->resource);
+  if ( brightness->priv->running_request == task )
+    brightness->priv->running_request = NULL;
+
+  espm_brightness_dispatch_request (brightness);
 }
 
 static void
-espm_brightness_finalize (GObject *object)
+espm_brightness_dispatch_request (EspmBrightness *brightness)
 {
-  EspmBrightness *brightness;
+  GTask *task;
 
-  brightness = ESPM_BRIGHTNESS (object);
+  if ( brightness->priv->running_request != NULL )
+    return;
 
-  espm_brightness_free_data (brightness);
+  task = g_queue_pop_head (brightness->priv->requests);
+  if ( task == NULL )
+    return;
 
-  G_OBJECT_CLASS (espm_brightness_parent_class)->finalize (object);
-}
+  brightness->priv->running_request = task;
+  g_signal_connect (task, "notify::completed",
+                    G_CALLBACK (espm_brightness_request_completed_cb), brightness);
 
-EspmBrightness *
-espm_brightness_new (void)
-{
-  EspmBrightness *brightness = NULL;
-  brightness = g_object_new (ESPM_TYPE_BRIGHTNESS, NULL);
-  return brightness;
+#ifdef ENABLE_POLKIT
+  if ( espm_brightness_request_blocks (brightness) )
+    g_task_run_in_thread (task, espm_brightness_request_helper_thread);
+  else
+#endif
+    espm_brightness_request_run (task, brightness,
+                                 g_task_get_task_data (task),
+                                 g_task_get_cancellable (task));
+
+  g_object_unref (task);
 }
 
-gboolean
-espm_brightness_setup (EspmBrightness *brightness)
+static void
+espm_brightness_queue_request (EspmBrightness            *brightness,
+                               EspmBrightnessRequestType  type,
+                               gint32                     level,
+                               GCancellable              *cancellable,
+                               GAsyncReadyCallback        callback,
+                               gpointer                   user_data,
+                               gpointer                   source_tag)
 {
-  espm_brightness_free_data (brightness);
-  brightness->priv->xrandr_has_hw = espm_brightness_setup_xrandr (brightness);
+  EspmBrightnessRequest *request;
+  GTask *task;
+  GList *item, *next;
 
-  if ( brightness->priv->xrandr_has_hw )
-  {
-    espm_brightness_xrand_get_limit (brightness,
-                                     brightness->priv->output,
-                                     &brightness->priv->min_level,
-                                     &brightness->priv->max_level);
-    g_debug ("Brightness controlled by xrandr, min_level=%d max_level=%d",
-             brightness->priv->min_level,
-             brightness->priv->max_level);
+  request = g_new0 (EspmBrightnessRequest, 1);
+  request->type = type;
+  request->level = level;
 
-    return TRUE;
-  }
-#ifdef ENABLE_POLKIT
-  else
+  task = g_task_new (brightness, cancellable, callback, user_data);
+  g_task_set_source_tag (task, source_tag);
+  g_task_set_task_data (task, request, g_free);
+
+  if ( type != BRIGHTNESS_REQUEST_GET_LEVEL )
+    espm_brightness_stop_transition (brightness);
+
+  /* a new absolute level makes every change still waiting in the queue stale */
+  if ( type == BRIGHTNESS_REQUEST_SET_LEVEL )
   {
-    if ( espm_brightness_setup_helper (brightness) ) {
-#if defined(BACKEND_TYPE_FREEBSD)
-      g_debug ("xrandr not available, brightness controlled by sysctl helper; min_level=%d max_level=%d",
-#else
-      g_debug ("xrandr not available, brightness controlled by sysfs helper; min_level=%d max_level=%d",
-#endif
-               brightness->priv->min_level,
-               brightness->priv->max_level);
-      return TRUE;
+    for ( item = brightness->priv->requests->head; item != NULL; item = next )
+    {
+      GTask *queued = item->data;
+      EspmBrightnessRequest *queued_request = g_task_get_task_data (queued);
+
+      next = item->next;
+
+      if ( queued_request->type == BRIGHTNESS_REQUEST_GET_LEVEL )
+        continue;
+
+      g_queue_delete_link (brightness->priv->requests, item);
+      g_task_return_new_error (queued, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                               "Superseded by a newer brightness request");
+      g_object_unref (queued);
     }
   }
-#endif
-  g_debug ("no brightness controls available");
-  return FALSE;
+
+  g_queue_push_tail (brightness->priv->requests, task);
+  espm_brightness_dispatch_request (brightness);
 }
 
-gboolean espm_brightness_up (EspmBrightness *brightness, gint32 *new_level)
+static gboolean
+espm_brightness_request_finish (EspmBrightness *brightness,
+                                GAsyncResult   *result,
+                                gint32         *level,
+                                GError        **error)
 {
-  gboolean ret = FALSE;
+  gssize ret;
 
-  if ( brightness->priv->xrandr_has_hw )
-  {
-    ret = espm_brightness_xrand_up (brightness, new_level);
-  }
-#ifdef ENABLE_POLKIT
-  else if ( brightness->priv->helper_has_hw )
-  {
-    ret = espm_brightness_helper_up (brightness, new_level);
-  }
-#endif
-  return ret;
+  g_return_val_if_fail (g_task_is_valid (result, brightness), FALSE);
+
+  ret = g_task_propagate_int (G_TASK (result), error);
+  if ( ret < 0 )
+    return FALSE;
+
+  if ( level )
+    *level = ret;
+
+  return TRUE;
 }
 
-gboolean espm_brightness_down (EspmBrightness *brightness, gint32 *new_level)
+void espm_brightness_get_level_async (EspmBrightness      *brightness,
+                                      GCancellable        *cancellable,
+                                      GAsyncReadyCallback  callback,
+                                      gpointer             user_data)
 {
-  gboolean ret = FALSE;
+  espm_brightness_queue_request (brightness, BRIGHTNESS_REQUEST_GET_LEVEL, 0,
+                                 cancellable, callback, user_data,
+                                 espm_brightness_get_level_async);
+}
 
-  if ( brightness->priv->xrandr_has_hw )
-  {
-    ret = espm_brightness_xrand_down (brightness, new_level);
-    if ( ret )
-      ret = espm_brightness_xrandr_get_level (brightness, brightness->priv->output, new_level);
-  }
-#ifdef ENABLE_POLKIT
-  else if ( brightness->priv->helper_has_hw )
-  {
-    ret = espm_brightness_helper_down (brightness, new_level);
-  }
-#endif
-  return ret;
+gboolean espm_brightness_get_level_finish (EspmBrightness *brightness,
+                                           GAsyncResult   *result,
+                                           gint32         *level,
+                                           GError        **error)
+{
+  return espm_brightness_request_finish (brightness, result, level, error);
 }
 
-gboolean espm_brightness_has_hw (EspmBrightness *brightness)
+void espm_brightness_set_level_async (EspmBrightness      *brightness,
+                                      gint32               level,
+                                      GCancellable        *cancellable,
+                                      GAsyncReadyCallback  callback,
+                                      gpointer             user_data)
 {
-  return brightness->priv->xrandr_has_hw || brightness->priv->helper_has_hw;
+  espm_brightness_queue_request (brightness, BRIGHTNESS_REQUEST_SET_LEVEL, level,
+                                 cancellable, callback, user_data,
+                                 espm_brightness_set_level_async);
 }
 
-gint32 espm_brightness_get_max_level (EspmBrightness *brightness)
+gboolean espm_brightness_set_level_finish (EspmBrightness *brightness,
+                                           GAsyncResult   *result,
+                                           GError        **error)
 {
-  return brightness->priv->max_level;
+  return espm_brightness_request_finish (brightness, result, NULL, error);
 }
 
-gboolean espm_brightness_get_level  (EspmBrightness *brightness, gint32 *level)
+void espm_brightness_up_async (EspmBrightness      *brightness,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
 {
-  gboolean ret = FALSE;
+  espm_brightness_queue_request (brightness, BRIGHTNESS_REQUEST_UP, 0,
+                                 cancellable, callback, user_data,
+                                 espm_brightness_up_async);
+}
 
-  if ( brightness->priv->xrandr_has_hw )
-    ret = espm_brightness_xrandr_get_level (brightness, brightness->priv->output, level);
-#ifdef ENABLE_POLKIT
-  else if ( brightness->priv->helper_has_hw )
-    ret = espm_brightness_helper_get_level (brightness, level);
-#endif
+gboolean espm_brightness_up_finish (EspmBrightness *brightness,
+                                    GAsyncResult   *result,
+                                    gint32         *new_level,
+                                    GError        **error)
+{
+  return espm_brightness_request_finish (brightness, result, new_level, error);
+}
 
-  return ret;
+void espm_brightness_down_async (EspmBrightness      *brightness,
+                                 GCancellable        *cancellable,
+                                 GAsyncReadyCallback  callback,
+                                 gpointer             user_data)
+{
+  espm_brightness_queue_request (brightness, BRIGHTNESS_REQUEST_DOWN, 0,
+                                 cancellable, callback, user_data,
+                                 espm_brightness_down_async);
 }
 
-gboolean espm_brightness_set_level (EspmBrightness *brightness, gint32 level)
+gboolean espm_brightness_down_finish (EspmBrightness *brightness,
+                                      GAsyncResult   *result,
+                                      gint32         *new_level,
+                                      GError        **error)
 {
-  gboolean ret = FALSE;
+  return espm_brightness_request_finish (brightness, result, new_level, error);
+}
 
-  if (brightness->priv->xrandr_has_hw )
-    ret = espm_brightness_xrandr_set_level (brightness, brightness->priv->output, level);
-#ifdef ENABLE_POLKIT
-  else if ( brightness->priv->helper_has_hw )
-    ret = espm_brightness_helper_set_level (brightness, level);
-#endif
+/***************************************************************************
+ ***                          MAKE CHECK TESTS                           ***
+ ***************************************************************************/
+#if defined(EGG_TEST) && !defined(BACKEND_TYPE_FREEBSD)
+#include <glib/gstdio.h>
 
-  return ret;
-}
+#include "egg-test.h"
 
-gboolean espm_brightness_set_step_count (EspmBrightness *brightness, guint32 count, gboolean exponential)
+/* answers SetBrightness from its own thread, so sync calls can't deadlock */
+typedef struct
 {
-  gboolean ret = FALSE;
+  GMainContext *context;
+  GMainLoop    *loop;
+  gint          fail;
+  gint          calls;
+  gint          level;
+} EspmBrightnessMockLogind;
+
+static const gchar espm_brightness_mock_logind_xml[] =
+  "<node>"
+  "  <interface name='" LOGIND_SESSION_IFACE "'>"
+  "    <method name='SetBrightness'>"
+  "      <arg type='s' direction='in'/>"
+  "      <arg type='s' direction='in'/>"
+  "      <arg type='u' direction='in'/>"
+  "    </method>"
+  "  </interface>"
+  "</node>";
 
-  if ( espm_brightness_has_hw (brightness) ) {
-    gint32 delta;
+static void
+espm_brightness_mock_logind_method (GDBusConnection       *connection,
+                                    const gchar           *sender,
+                                    const gchar           *object_path,
+                                    const gchar           *interface_name,
+                                    const gchar           *method_name,
+                                    GVariant              *parameters,
+                                    GDBusMethodInvocation *invocation,
+                                    gpointer               user_data)
+{
+  EspmBrightnessMockLogind *mock = user_data;
+  guint32 level;
 
-    if ( count < 2 )
-      count = 2;
-    delta = brightness->priv->max_level - brightness->priv->min_level;
-    brightness->priv->use_exp_step = exponential;
-    brightness->priv->step = (delta < (count * 2)) ? 1 : (delta / count);
-    brightness->priv->exp_step = powf (delta, 1.0 / count);
-    ret = TRUE;
+  g_variant_get (parameters, "(&s&su)", NULL, NULL, &level);
+  g_atomic_int_inc (&mock->calls);
+
+  if ( g_atomic_int_get (&mock->fail) )
+  {
+    g_dbus_method_invocation_return_dbus_error (invocation,
+                                                "org.freedesktop.DBus.Error.AccessDenied",
+                                                "Not in control");
+    return;
   }
 
-  return ret;
+  g_atomic_int_set (&mock->level, (gint) level);
+  g_dbus_method_invocation_return_value (invocation, NULL);
 }
 
-gboolean espm_brightness_dim_down (EspmBrightness *brightness)
+static const GDBusInterfaceVTable espm_brightness_mock_logind_vtable =
 {
-  gboolean ret = FALSE;
+  espm_brightness_mock_logind_method, NULL, NULL
+};
 
-  if (brightness->priv->xrandr_has_hw )
-    ret = espm_brightness_xrandr_set_level (brightness, brightness->priv->output, brightness->priv->min_level);
-#ifdef ENABLE_POLKIT
-  else if ( brightness->priv->helper_has_hw )
-    ret = espm_brightness_helper_set_level (brightness, brightness->priv->min_level);
-#endif
+static gpointer
+espm_brightness_mock_logind_thread (gpointer data)
+{
+  EspmBrightnessMockLogind *mock = data;
 
-  return ret;
+  g_main_context_push_thread_default (mock->context);
+  g_main_loop_run (mock->loop);
+  g_main_context_pop_thread_default (mock->context);
+
+  return NULL;
 }
 
-gboolean espm_brightness_get_switch (EspmBrightness *brightness, gint *brightness_switch)
+/* what the kernel would show in the fake backlight class */
+static void
+espm_brightness_test_write (const gchar *device, const gchar *attribute, gint value)
 {
-  gboolean ret = FALSE;
+  gchar *filename;
+  gchar *contents;
+
+  filename = g_build_filename (device, attribute, NULL);
+  contents = g_strdup_printf ("%i\n", value);
+  g_file_set_contents (filename, contents, -1, NULL);
+  g_free (contents);
+  g_free (filename);
+}
 
-#ifdef ENABLE_POLKIT
-  if ( brightness->priv->helper_has_hw )
-    ret = espm_brightness_helper_get_switch (brightness, brightness_switch);
-#endif
+static void
+espm_brightness_test_remove (const gchar *device, const gchar *attribute)
+{
+  gchar *filename;
 
-  return ret;
+  filename = g_build_filename (device, attribute, NULL);
+  g_unlink (filename);
+  g_free (filename);
 }
 
-gboolean espm_brightness_set_switch (EspmBrightness *brightness, gint brightness_switch)
+static void
+espm_brightness_test_level_changed_cb (EspmBrightness *brightness, gint32 level, gint *changed)
 {
-  gboolean ret = FALSE;
+  *changed = level;
+}
 
+/* the level the kernel settled on, and what the backlight class reports */
+static void
+espm_brightness_test_kernel_set (EspmBrightness *brightness, const gchar *device, gint value)
+{
+  espm_brightness_test_write (device, "actual_brightness", value);
+  espm_brightness_sysfs_changed (brightness);
+}
+
+static void
+espm_brightness_test_wait_writes (EspmBrightness *brightness)
+{
+  while ( !g_queue_is_empty (brightness->priv->logind_writes) )
+    g_main_context_iteration (NULL, TRUE);
+}
+
+void
+espm_brightness_test (gpointer data)
+{
+  EspmBrightnessMockLogind mock = { 0 };
+  EspmBrightness *brightness;
+  GTestDBus *bus;
+  GDBusConnection *service;
+  GDBusNodeInfo *node;
+  GVariant *reply;
+  GThread *thread;
+  gchar *dir, *device;
+  guint object_id;
+  gint changed = -1;
+  gint calls;
+  gboolean ret;
+  EggTest *test = (EggTest *) data;
+
+  if (egg_test_start (test, "EspmBrightness (logind)") == FALSE)
+    return;
+
+  /* a fake backlight class with a single device */
+  dir = g_dir_make_tmp ("espm-brightness-XXXXXX", NULL);
+  device = g_build_filename (dir, "test", NULL);
+  g_mkdir (device, 0700);
+  espm_brightness_test_write (device, "max_brightness", 100);
+  espm_brightness_test_write (device, "brightness", 50);
+  espm_brightness_test_write (device, "actual_brightness", 50);
+  espm_backlight_sysfs_set_location (dir);
+
+  /* and logind on a private bus */
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (bus);
+
+  service = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (bus),
+                                                    G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                    G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                    NULL, NULL, NULL);
+  node = g_dbus_node_info_new_for_xml (espm_brightness_mock_logind_xml, NULL);
+  mock.context = g_main_context_new ();
+  mock.loop = g_main_loop_new (mock.context, FALSE);
+
+  g_main_context_push_thread_default (mock.context);
+  object_id = g_dbus_connection_register_object (service, LOGIND_SESSION_PATH, node->interfaces[0],
+                                                 &espm_brightness_mock_logind_vtable, &mock, NULL, NULL);
+  g_main_context_pop_thread_default (mock.context);
+
+  reply = g_dbus_connection_call_sync (service, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "RequestName",
+                                       g_variant_new ("(su)", LOGIND_NAME, 0),
+                                       NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+  if (reply != NULL)
+    g_variant_unref (reply);
+
+  thread = g_thread_new ("mock-logind", espm_brightness_mock_logind_thread, &mock);
+
+  brightness = espm_brightness_new ();
+  espm_brightness_set_device (brightness, "test");
+  brightness->priv->logind_bus = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (bus),
+                                                                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                                         G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                                         NULL, NULL, NULL);
+  g_signal_connect (brightness, "level-changed",
+                    G_CALLBACK (espm_brightness_test_level_changed_cb), &changed);
+
+  g_rec_mutex_lock (&brightness->priv->lock);
+
+  /************************************************************/
+  egg_test_title (test, "check logind is used when it has SetBrightness");
+  ret = espm_brightness_setup_logind (brightness);
+  if (ret && brightness->priv->max_level == 100) {
+    espm_brightness_build_steps (brightness);
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "setup %i, max level %i", ret, brightness->priv->max_level);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check our own write is not taken for a change");
+  espm_brightness_backend_set_level (brightness, 60);
+  espm_brightness_test_kernel_set (brightness, device, 60);
+  if (changed == -1) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "reported %i", changed);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check a change by someone else is seen while writing");
+  espm_brightness_test_kernel_set (brightness, device, 10);
+  espm_brightness_test_wait_writes (brightness);
+  if (changed == 10 && g_atomic_int_get (&mock.level) == 60) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "reported %i, logind got %i", changed, g_atomic_int_get (&mock.level));
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check a write the driver rounds is not taken for a change");
+  changed = -1;
+  espm_brightness_backend_set_level (brightness, 40);
+  espm_brightness_test_wait_writes (brightness);
+  espm_brightness_test_kernel_set (brightness, device, 41);
+  if (changed == -1 && brightness->priv->current_level == 41) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "reported %i, cached %i", changed, brightness->priv->current_level);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check a refused write drops logind");
+  g_atomic_int_set (&mock.fail, TRUE);
 #ifdef ENABLE_POLKIT
-  if ( brightness->priv->helper_has_hw )
-    ret = espm_brightness_helper_set_switch (brightness, brightness_switch);
+  /* pretend the dialog is up, so the retry doesn't start pkexec */
+  brightness->priv->helper_authorizing = TRUE;
+#endif
+  espm_brightness_backend_set_level (brightness, 30);
+  espm_brightness_test_wait_writes (brightness);
+#ifdef ENABLE_POLKIT
+  ret = !brightness->priv->logind_has_hw && brightness->priv->helper_has_hw;
+#else
+  ret = !brightness->priv->logind_has_hw;
 #endif
+  if (ret && !brightness->priv->current_level_valid) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "logind %i, helper %i, cached %i",
+                     brightness->priv->logind_has_hw,
+                     brightness->priv->helper_has_hw,
+                     brightness->priv->current_level_valid);
+  }
 
-  return ret;
+  /************************************************************/
+  egg_test_title (test, "check later writes don't go to logind");
+  calls = g_atomic_int_get (&mock.calls);
+  espm_brightness_backend_set_level (brightness, 35);
+  if (g_atomic_int_get (&mock.calls) == calls) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "logind got %i more calls", g_atomic_int_get (&mock.calls) - calls);
+  }
+
+#ifdef ENABLE_POLKIT
+  brightness->priv->helper_authorizing = FALSE;
+#endif
+  g_rec_mutex_unlock (&brightness->priv->lock);
+  g_object_unref (brightness);
+
+  g_main_loop_quit (mock.loop);
+  g_thread_join (thread);
+  g_dbus_connection_unregister_object (service, object_id);
+  g_object_unref (service);
+  g_dbus_node_info_unref (node);
+  g_main_loop_unref (mock.loop);
+  g_main_context_unref (mock.context);
+
+  g_test_dbus_down (bus);
+  g_object_unref (bus);
+
+  espm_backlight_sysfs_set_location (NULL);
+  espm_brightness_test_remove (device, "max_brightness");
+  espm_brightness_test_remove (device, "brightness");
+  espm_brightness_test_remove (device, "actual_brightness");
+  g_rmdir (device);
+  g_rmdir (dir);
+  g_free (device);
+  g_free (dir);
+
+  egg_test_end (test);
 }
+
+#endif
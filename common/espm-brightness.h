@@ -22,6 +22,7 @@
 #define __ESPM_BRIGHTNESS_H
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -42,11 +43,16 @@ typedef struct
 {
   GObjectClass 		parent_class;
 
+  void                  (*level_changed)        (EspmBrightness *brightness,
+                                                 gint            level);
+
 } EspmBrightnessClass;
 
 GType             espm_brightness_get_type        (void) G_GNUC_CONST;
 EspmBrightness   *espm_brightness_new             (void);
 gboolean          espm_brightness_setup           (EspmBrightness *brightness);
+void              espm_brightness_set_device      (EspmBrightness *brightness,
+                                                   const gchar    *device);
 gboolean          espm_brightness_up              (EspmBrightness *brightness,
                                                    gint32         *new_level);
 gboolean          espm_brightness_down            (EspmBrightness *brightness,
@@ -57,6 +63,11 @@ gboolean          espm_brightness_get_level       (EspmBrightness *brightness,
                                                    gint32         *level);
 gboolean          espm_brightness_set_level       (EspmBrightness *brightness,
                                                    gint32          level);
+gboolean          espm_brightness_peek_level      (EspmBrightness *brightness,
+                                                   gint32         *level);
+gint32            espm_brightness_next_level      (EspmBrightness *brightness,
+                                                   gint32          level,
+                                                   gboolean        up);
 gboolean          espm_brightness_set_step_count  (EspmBrightness *brightness,
                                                    guint32         count,
                                                    gboolean        exponential);
@@ -65,6 +76,48 @@ gboolean          espm_brightness_get_switch      (EspmBrightness *brightness,
                                                    gint           *brightness_switch);
 gboolean          espm_brightness_set_switch      (EspmBrightness *brightness,
                                                    gint            brightness_switch);
+void              espm_brightness_set_verify_writes (EspmBrightness *brightness,
+                                                     gboolean        verify);
+void              espm_brightness_set_transition_duration (EspmBrightness *brightness,
+                                                           guint           duration);
+gboolean          espm_brightness_transition_to   (EspmBrightness *brightness,
+                                                   gint32          level);
+
+void              espm_brightness_get_level_async  (EspmBrightness      *brightness,
+                                                    GCancellable        *cancellable,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data);
+gboolean          espm_brightness_get_level_finish (EspmBrightness      *brightness,
+                                                    GAsyncResult        *result,
+                                                    gint32              *level,
+                                                    GError             **error);
+void              espm_brightness_set_level_async  (EspmBrightness      *brightness,
+                                                    gint32               level,
+                                                    GCancellable        *cancellable,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data);
+gboolean          espm_brightness_set_level_finish (EspmBrightness      *brightness,
+                                                    GAsyncResult        *result,
+                                                    GError             **error);
+void              espm_brightness_up_async         (EspmBrightness      *brightness,
+                                                    GCancellable        *cancellable,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data);
+gboolean          espm_brightness_up_finish        (EspmBrightness      *brightness,
+                                                    GAsyncResult        *result,
+                                                    gint32              *new_level,
+                                                    GError             **error);
+void              espm_brightness_down_async       (EspmBrightness      *brightness,
+                                                    GCancellable        *cancellable,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data);
+gboolean          espm_brightness_down_finish      (EspmBrightness      *brightness,
+                                                    GAsyncResult        *result,
+                                                    gint32              *new_level,
+                                                    GError             **error);
+#if defined(EGG_TEST) && !defined(BACKEND_TYPE_FREEBSD)
+void              espm_brightness_test             (gpointer             data);
+#endif
 
 G_END_DECLS
 
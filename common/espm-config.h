@@ -65,6 +65,7 @@ G_BEGIN_DECLS
 #define BATTERY_SWITCH_CFG                   "battery-button-action"
 #define LID_SWITCH_ON_AC_CFG                 "lid-action-on-ac"
 #define LID_SWITCH_ON_BATTERY_CFG            "lid-action-on-battery"
+#define LID_CLOSE_PANEL_ONLY                 "lid-close-panel-only"
 
 #define LOGIND_HANDLE_POWER_KEY              "logind-handle-power-key"
 #define LOGIND_HANDLE_SUSPEND_KEY            "logind-handle-suspend-key"
@@ -78,6 +79,9 @@ G_BEGIN_DECLS
 #define BRIGHTNESS_SLIDER_MIN_LEVEL          "brightness-slider-min-level"
 #define BRIGHTNESS_STEP_COUNT                "brightness-step-count"
 #define BRIGHTNESS_EXPONENTIAL               "brightness-exponential"
+#define BRIGHTNESS_VERIFY_WRITES             "brightness-verify-writes"
+#define BRIGHTNESS_TRANSITION_DURATION       "brightness-transition-duration"
+#define BRIGHTNESS_DEVICE                    "brightness-device"
 #define BRIGHTNESS_SWITCH                    "brightness-switch"
 #define BRIGHTNESS_SWITCH_SAVE               "brightness-switch-restore-on-exit"
 #define HANDLE_BRIGHTNESS_KEYS               "handle-brightness-keys"
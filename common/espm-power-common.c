@@ -273,6 +273,46 @@ get_device_icon_name (UpClient *upower, UpDevice *device, gboolean is_panel)
   return icon_name;
 }
 
+/*
+ * Replace UPower's time-to-empty and time-to-full of device with the
+ * smoothed estimate of the power manager, if it is running and watches
+ * the device.
+ */
+void
+get_device_time_estimate (UpDevice *device, guint64 *time_to_empty, guint64 *time_to_full)
+{
+  GDBusConnection *bus;
+  GVariant *reply;
+  GError *error = NULL;
+
+  bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+  if ( bus == NULL )
+    return;
+
+  reply = g_dbus_connection_call_sync (bus,
+                                       "com.expidus.PowerManager",
+                                       "/org/expidus/PowerManager",
+                                       "com.expidus.Power.Manager",
+                                       "GetTimeEstimate",
+                                       g_variant_new ("(s)", up_device_get_object_path (device)),
+                                       G_VARIANT_TYPE ("(tt)"),
+                                       G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                       500,
+                                       NULL,
+                                       &error);
+  g_object_unref (bus);
+
+  if ( reply == NULL )
+  {
+    ESPM_DEBUG ("No time estimate for %s: %s", up_device_get_object_path (device), error->message);
+    g_error_free (error);
+    return;
+  }
+
+  g_variant_get (reply, "(tt)", time_to_empty, time_to_full);
+  g_variant_unref (reply);
+}
+
 gchar*
 get_device_description (UpClient *upower, UpDevice *device)
 {
@@ -297,6 +337,8 @@ get_device_description (UpClient *upower, UpDevice *device)
                 "online", &online,
                  NULL);
 
+  get_device_time_estimate (device, &time_to_empty, &time_to_full);
+
   if (is_display_device (upower, device))
   {
     g_free (vendor);
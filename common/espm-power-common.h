@@ -53,5 +53,8 @@ gchar       *get_device_icon_name                     (UpClient     *upower,
                                                        gboolean      is_panel);
 gchar       *get_device_description                   (UpClient     *upower,
                                                        UpDevice     *device);
+void         get_device_time_estimate                 (UpDevice     *device,
+                                                       guint64      *time_to_empty,
+                                                       guint64      *time_to_full);
 
 #endif /* ESPM_UPOWER_COMMON */
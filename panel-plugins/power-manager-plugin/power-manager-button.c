@@ -105,6 +105,8 @@ struct PowerManagerButtonPrivate
 
   /* filter range value changed events for snappier UI feedback */
   guint            set_level_timeout;
+  /* cancels brightness requests still running when we go away */
+  GCancellable    *cancellable;
 };
 
 typedef struct
@@ -162,6 +164,9 @@ static gboolean   power_manager_button_menu_add_device                  (PowerMa
                                                                          gboolean append);
 static void       increase_brightness                                   (PowerManagerButton *button);
 static void       decrease_brightness                                   (PowerManagerButton *button);
+static void       brightness_level_changed_cb                           (EspmBrightness *brightness,
+                                                                         gint level,
+                                                                         PowerManagerButton *button);
 static void       battery_device_remove_pix                             (BatteryDevice *battery_device);
 
 
@@ -742,33 +747,6 @@ power_manager_button_remove_all_devices (PowerManagerButton *button)
   }
 }
 
-static void
-brightness_up (PowerManagerButton *button)
-{
-  gint32 level;
-  gint32 max_level;
-
-  espm_brightness_get_level (button->priv->brightness, &level);
-  max_level = espm_brightness_get_max_level (button->priv->brightness);
-
-  if ( level < max_level )
-  {
-    increase_brightness (button);
-  }
-}
-
-static void
-brightness_down (PowerManagerButton *button)
-{
-  gint32 level;
-  espm_brightness_get_level (button->priv->brightness, &level);
-
-  if ( level > button->priv->brightness_min_level )
-  {
-    decrease_brightness (button);
-  }
-}
-
 static gboolean
 power_manager_button_scroll_event (GtkWidget *widget, GdkEventScroll *ev)
 {
@@ -784,12 +762,12 @@ power_manager_button_scroll_event (GtkWidget *widget, GdkEventScroll *ev)
 
   if (ev->direction == GDK_SCROLL_UP)
   {
-    brightness_up (button);
+    increase_brightness (button);
     return TRUE;
   }
   else if (ev->direction == GDK_SCROLL_DOWN)
   {
-    brightness_down (button);
+    decrease_brightness (button);
     return TRUE;
   }
   return FALSE;
@@ -996,7 +974,10 @@ power_manager_button_init (PowerManagerButton *button)
 
   button->priv->brightness = espm_brightness_new ();
   espm_brightness_setup (button->priv->brightness);
+  g_signal_connect (button->priv->brightness, "level-changed",
+                    G_CALLBACK (brightness_level_changed_cb), button);
   button->priv->set_level_timeout = 0;
+  button->priv->cancellable = g_cancellable_new ();
 
   button->priv->upower  = up_client_new ();
   if ( !esconf_init (&error) )
@@ -1070,6 +1051,11 @@ power_manager_button_finalize (GObject *object)
     button->priv->set_level_timeout = 0;
   }
 
+  g_cancellable_cancel (button->priv->cancellable);
+  g_object_unref (button->priv->cancellable);
+
+  g_signal_handlers_disconnect_by_data (button->priv->brightness, button);
+
   g_signal_handlers_disconnect_by_data (button->priv->upower, button);
 
   power_manager_button_remove_all_devices (button);
@@ -1305,6 +1291,8 @@ power_manager_button_update_label (PowerManagerButton *button, UpDevice *device)
                 "time-to-full", &time_to_full,
                 NULL);
 
+  get_device_time_estimate (device, &time_to_empty, &time_to_full);
+
   /* Hide the label if the battery is fully charged,
    * if the state is unknown (no battery available)
      or if it's a desktop system */
@@ -1543,6 +1531,80 @@ display_inhibitors (PowerManagerButton *button, GtkWidget *menu)
 }
 #endif
 
+static gboolean
+brightness_level_ready (gboolean ret, GError *error)
+{
+  if (ret)
+    return TRUE;
+
+  /* when cancelled the button may already be gone, don't touch it */
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    DBG("brightness request failed: %s", error->message);
+  g_error_free (error);
+
+  return FALSE;
+}
+
+static void
+decrease_brightness_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  PowerManagerButton *button;
+  GError *error = NULL;
+  gint32 level = 0;
+
+  if (!brightness_level_ready (espm_brightness_down_finish (ESPM_BRIGHTNESS (source), result, &level, &error), error))
+    return;
+
+  button = POWER_MANAGER_BUTTON (user_data);
+
+  if (button->priv->range)
+    gtk_range_set_value (GTK_RANGE (button->priv->range), level);
+}
+
+static void
+decrease_brightness_to_min_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  PowerManagerButton *button;
+  GError *error = NULL;
+
+  if (!brightness_level_ready (espm_brightness_set_level_finish (ESPM_BRIGHTNESS (source), result, &error), error))
+    return;
+
+  button = POWER_MANAGER_BUTTON (user_data);
+
+  if (button->priv->range)
+    gtk_range_set_value (GTK_RANGE (button->priv->range), button->priv->brightness_min_level);
+}
+
+/* step down from level, but never below the safe slider minimum */
+static void
+decrease_brightness_from (PowerManagerButton *button, gint32 level)
+{
+  gint32 min_level = button->priv->brightness_min_level;
+
+  if (level <= min_level)
+    return;
+
+  if (espm_brightness_next_level (button->priv->brightness, level, FALSE) < min_level)
+    espm_brightness_set_level_async (button->priv->brightness, min_level, button->priv->cancellable,
+                                     decrease_brightness_to_min_cb, button);
+  else
+    espm_brightness_down_async (button->priv->brightness, button->priv->cancellable,
+                                decrease_brightness_cb, button);
+}
+
+static void
+decrease_brightness_level_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  GError *error = NULL;
+  gint32 level = 0;
+
+  if (!brightness_level_ready (espm_brightness_get_level_finish (ESPM_BRIGHTNESS (source), result, &level, &error), error))
+    return;
+
+  decrease_brightness_from (POWER_MANAGER_BUTTON (user_data), level);
+}
+
 static void
 decrease_brightness (PowerManagerButton *button)
 {
@@ -1553,35 +1615,49 @@ decrease_brightness (PowerManagerButton *button)
   if ( !espm_brightness_has_hw (button->priv->brightness) )
     return;
 
-  espm_brightness_get_level (button->priv->brightness, &level);
+  if (espm_brightness_peek_level (button->priv->brightness, &level))
+    decrease_brightness_from (button, level);
+  else
+    espm_brightness_get_level_async (button->priv->brightness, button->priv->cancellable,
+                                     decrease_brightness_level_cb, button);
+}
 
-  if ( level > button->priv->brightness_min_level )
-  {
-    espm_brightness_down (button->priv->brightness, &level);
-    if (button->priv->range)
-      gtk_range_set_value (GTK_RANGE (button->priv->range), level);
-  }
+static void
+increase_brightness_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  PowerManagerButton *button;
+  GError *error = NULL;
+  gint32 level = 0;
+
+  if (!brightness_level_ready (espm_brightness_up_finish (ESPM_BRIGHTNESS (source), result, &level, &error), error))
+    return;
+
+  button = POWER_MANAGER_BUTTON (user_data);
+
+  if (button->priv->range)
+    gtk_range_set_value (GTK_RANGE (button->priv->range), level);
 }
 
 static void
 increase_brightness (PowerManagerButton *button)
 {
-  gint32 level, max_level;
-
   TRACE("entering");
 
   if (!espm_brightness_has_hw (button->priv->brightness))
     return;
 
-  max_level = espm_brightness_get_max_level (button->priv->brightness);
-  espm_brightness_get_level (button->priv->brightness, &level);
+  espm_brightness_up_async (button->priv->brightness, button->priv->cancellable,
+                            increase_brightness_cb, button);
+}
+
+static void
+brightness_level_changed_cb (EspmBrightness *brightness, gint level, PowerManagerButton *button)
+{
+  TRACE("entering");
 
-  if (level < max_level)
-  {
-    espm_brightness_up (button->priv->brightness, &level);
-    if (button->priv->range)
-      gtk_range_set_value (GTK_RANGE (button->priv->range), level);
-  }
+  /* somebody else changed the brightness, follow it unless the user is dragging */
+  if (button->priv->range && !button->priv->set_level_timeout)
+    gtk_range_set_value (GTK_RANGE (button->priv->range), level);
 }
 
 static gboolean
@@ -1593,12 +1669,10 @@ brightness_set_level_with_timeout (PowerManagerButton *button)
 
   range_level = (gint32) gtk_range_get_value (GTK_RANGE (button->priv->range));
 
-  espm_brightness_get_level (button->priv->brightness, &hw_level);
-
-  if (hw_level != range_level)
-  {
-    espm_brightness_set_level (button->priv->brightness, range_level);
-  }
+  /* replaces any level still waiting to be applied */
+  if (!espm_brightness_peek_level (button->priv->brightness, &hw_level) || hw_level != range_level)
+    espm_brightness_set_level_async (button->priv->brightness, range_level,
+                                     button->priv->cancellable, NULL, NULL);
 
   if (button->priv->set_level_timeout)
   {
@@ -1612,11 +1686,18 @@ brightness_set_level_with_timeout (PowerManagerButton *button)
 static void
 range_value_changed_cb (PowerManagerButton *button, GtkWidget *widget)
 {
+  gint32 hw_level;
+
   TRACE("entering");
 
   if (button->priv->set_level_timeout)
     return;
 
+  /* the slider just followed a change of the hardware level */
+  if (espm_brightness_peek_level (button->priv->brightness, &hw_level)
+      && hw_level == (gint32) gtk_range_get_value (GTK_RANGE (button->priv->range)))
+    return;
+
   button->priv->set_level_timeout =
     g_timeout_add (SET_LEVEL_TIMEOUT,
                    (GSourceFunc) brightness_set_level_with_timeout, button);
@@ -24,6 +24,7 @@
 #endif
 
 #include <glib.h>
+#include <gio/gio.h>
 #include <X11/Xlib.h>
 #include <X11/extensions/sync.h>
 #include <gdk/gdkx.h>
@@ -36,6 +37,9 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "egg-idletime.h"
 
@@ -49,40 +53,347 @@ static void     egg_idletime_finalize   (GObject       *object);
 #undef XSyncValueAdd
 #endif
 
-struct EggIdletimePrivate
-{
-  gint       sync_event;
-  gboolean     reset_set;
-  XSyncCounter     idle_counter;
-  GPtrArray   *array;
-  Display     *dpy;
-};
+typedef enum {
+  EGG_IDLETIME_ALARM_TYPE_POSITIVE,
+  EGG_IDLETIME_ALARM_TYPE_NEGATIVE,
+  EGG_IDLETIME_ALARM_TYPE_DISABLED
+} EggIdletimeAlarmType;
 
 typedef struct
 {
   guint      id;
-  XSyncValue     timeout;
+  gint64     timeout;
   XSyncAlarm     xalarm;
+  EggIdletimeAlarmType   type;
+  gboolean     fired;
   EggIdletime   *idletime;
 } EggIdletimeAlarm;
 
+/*
+ * Where the idle time comes from and how alarms on it are armed: the
+ * XSync IDLETIME counter, or a virtual clock driven by hand.
+ */
+typedef struct
+{
+  gboolean   (* init)       (EggIdletime       *idletime);
+  void       (* finalize)   (EggIdletime       *idletime);
+  gint64     (* get_time)   (EggIdletime       *idletime);
+  gint64     (* get_clock)  (EggIdletime       *idletime);
+  void       (* alarm_set)  (EggIdletime       *idletime,
+                             EggIdletimeAlarm  *eggalarm);
+  void       (* alarm_free) (EggIdletime       *idletime,
+                             EggIdletimeAlarm  *eggalarm);
+} EggIdletimeBackend;
+
+struct EggIdletimePrivate
+{
+  const EggIdletimeBackend *backend;
+  gboolean     reset_set;
+  gboolean     reset_wanted;   /* a user's alarm went off since the last reset */
+  GHashTable  *alarms;    /* id -> EggIdletimeAlarm, owns them */
+
+  /* statistics */
+  gint64       idle_start;    /* on the backend clock, -1 when active */
+  gint64       last_period;
+  guint        histogram[EGG_IDLETIME_HISTOGRAM_BUCKETS];
+
+  /* xsync backend */
+  gint       sync_event;
+  XSyncCounter     idle_counter;
+  GHashTable  *xalarms;   /* XSyncAlarm -> EggIdletimeAlarm */
+  Display     *dpy;
+
+  /* logind backend */
+  GDBusConnection *logind_bus;
+  GDBusProxy  *logind_proxy;
+  gboolean     logind_idle;
+  guint64      logind_since;
+  guint64      logind_since_monotonic;
+  gint64       logind_checked;   /* idle time alarms were fired up to */
+  guint        logind_timeout_id;
+
+  /* virtual backend */
+  gint64       virtual_time;
+  gint64       virtual_clock;   /* idle time of the finished periods */
+};
+
 enum {
   SIGNAL_ALARM_EXPIRED,
   SIGNAL_RESET,
   LAST_SIGNAL
 };
 
-typedef enum {
-  EGG_IDLETIME_ALARM_TYPE_POSITIVE,
-  EGG_IDLETIME_ALARM_TYPE_NEGATIVE,
-  EGG_IDLETIME_ALARM_TYPE_DISABLED
-} EggIdletimeAlarmType;
+/* an internal alarm at the shortest period the histogram records, so
+ * that every period at least that long is seen when it ends */
+#define EGG_IDLETIME_STATS_ALARM  G_MAXUINT
+#define EGG_IDLETIME_STATS_MIN    1000
 
 static guint signals [LAST_SIGNAL] = { 0 };
 static gpointer egg_idletime_object = NULL;
 
+static const EggIdletimeBackend egg_idletime_xsync_backend;
+static const EggIdletimeBackend egg_idletime_logind_backend;
+static const EggIdletimeBackend egg_idletime_virtual_backend;
+static const EggIdletimeBackend *egg_idletime_default_backend = &egg_idletime_xsync_backend;
+static GDBusConnection *egg_idletime_default_connection = NULL;
+
 G_DEFINE_TYPE_WITH_PRIVATE (EggIdletime, egg_idletime, G_TYPE_OBJECT)
 
+/**
+ * egg_idletime_get_time:
+ */
+gint64
+egg_idletime_get_time (EggIdletime *idletime)
+{
+  return idletime->priv->backend->get_time (idletime);
+}
+
+/**
+ * egg_idletime_alarm_arm:
+ */
+static void
+egg_idletime_alarm_arm (EggIdletime *idletime, EggIdletimeAlarm *eggalarm, EggIdletimeAlarmType alarm_type)
+{
+  eggalarm->type = alarm_type;
+  if (alarm_type == EGG_IDLETIME_ALARM_TYPE_POSITIVE)
+    eggalarm->fired = FALSE;
+  idletime->priv->backend->alarm_set (idletime, eggalarm);
+}
+
+/**
+ * egg_idletime_record_period:
+ *
+ * Add a finished idle period to the histogram, bucket i holding the
+ * periods from 2^i up to 2^(i+1) seconds, the last one everything longer.
+ */
+static void
+egg_idletime_record_period (EggIdletime *idletime, gint64 period)
+{
+  guint bucket = 0;
+  gint64 seconds;
+
+  idletime->priv->last_period = period;
+
+  if (period < EGG_IDLETIME_STATS_MIN)
+    return;
+
+  for (seconds = period / 1000; seconds > 1 && bucket < EGG_IDLETIME_HISTOGRAM_BUCKETS - 1; seconds >>= 1)
+    bucket++;
+
+  idletime->priv->histogram[bucket]++;
+}
+
+/**
+ * egg_idletime_alarm_reset_all:
+ */
+void
+egg_idletime_alarm_reset_all (EggIdletime *idletime)
+{
+  GHashTableIter iter;
+  EggIdletimeAlarm *eggalarm;
+
+  g_return_if_fail (EGG_IS_IDLETIME (idletime));
+
+  if (idletime->priv->idle_start >= 0) {
+    egg_idletime_record_period (idletime,
+                                idletime->priv->backend->get_clock (idletime) - idletime->priv->idle_start);
+    idletime->priv->idle_start = -1;
+  }
+
+  /* re-arm the alarms that went off (except the reset alarm), the
+   * others are still waiting for their timeout. That is only the
+   * statistics alarm after a pause none of the users' alarms saw */
+  g_hash_table_iter_init (&iter, idletime->priv->alarms);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &eggalarm)) {
+    if (eggalarm->id != 0 && eggalarm->fired)
+      egg_idletime_alarm_arm (idletime, eggalarm, EGG_IDLETIME_ALARM_TYPE_POSITIVE);
+  }
+
+  /* set the reset alarm to be disabled */
+  eggalarm = g_hash_table_lookup (idletime->priv->alarms, GUINT_TO_POINTER (0));
+  if (eggalarm != NULL)
+    egg_idletime_alarm_arm (idletime, eggalarm, EGG_IDLETIME_ALARM_TYPE_DISABLED);
+
+  /* emit signal so say we've reset all timers, unless the pause was
+   * too short for anyone to care */
+  if (idletime->priv->reset_wanted)
+    g_signal_emit (idletime, signals [SIGNAL_RESET], 0);
+  idletime->priv->reset_wanted = FALSE;
+
+  /* we need to be reset again on the next event */
+  idletime->priv->reset_set = FALSE;
+}
+
+/**
+ * egg_idletime_alarm_find_id:
+ */
+static EggIdletimeAlarm *
+egg_idletime_alarm_find_id (EggIdletime *idletime, guint id)
+{
+  return g_hash_table_lookup (idletime->priv->alarms, GUINT_TO_POINTER (id));
+}
+
+/**
+ * egg_idletime_set_reset_alarm:
+ */
+static void
+egg_idletime_set_reset_alarm (EggIdletime *idletime, gint64 counter_value)
+{
+  EggIdletimeAlarm *eggalarm;
+
+  eggalarm = egg_idletime_alarm_find_id (idletime, 0);
+
+  if (eggalarm != NULL && !idletime->priv->reset_set) {
+    /* don't match on the current value because
+     * XSyncNegativeComparison means less or equal. */
+    eggalarm->timeout = counter_value - 1;
+
+    /* set the reset alarm to fire the next time
+     * the idle counter < the current counter value */
+    egg_idletime_alarm_arm (idletime, eggalarm, EGG_IDLETIME_ALARM_TYPE_NEGATIVE);
+
+    /* don't try to set this again if multiple timers are going off in sequence */
+    idletime->priv->reset_set = TRUE;
+  }
+}
+
+/**
+ * egg_idletime_alarm_triggered:
+ *
+ * Called by the backends when an armed alarm goes off at counter_value.
+ */
+static void
+egg_idletime_alarm_triggered (EggIdletime *idletime, EggIdletimeAlarm *eggalarm, gint64 counter_value)
+{
+  /* are we the reset alarm? */
+  if (eggalarm->id == 0) {
+    egg_idletime_alarm_reset_all (idletime);
+    return;
+  }
+
+  /* re-arm it on the next reset */
+  eggalarm->fired = TRUE;
+
+  /* the first alarm of an idle period tells when it started */
+  if (idletime->priv->idle_start < 0)
+    idletime->priv->idle_start = idletime->priv->backend->get_clock (idletime) - counter_value;
+
+  /* emit */
+  if (eggalarm->id != EGG_IDLETIME_STATS_ALARM) {
+    idletime->priv->reset_wanted = TRUE;
+    g_signal_emit (eggalarm->idletime, signals [SIGNAL_ALARM_EXPIRED], 0, eggalarm->id);
+  }
+
+  /* we need the first alarm to go off to set the reset alarm */
+  egg_idletime_set_reset_alarm (idletime, counter_value);
+}
+
+/**
+ * egg_idletime_find_due:
+ *
+ * The ids of the positive alarms with the earliest timeout in
+ * (from, until], or NULL if there is none.
+ */
+static GArray *
+egg_idletime_find_due (EggIdletime *idletime, gint64 from, gint64 until)
+{
+  GHashTableIter iter;
+  EggIdletimeAlarm *eggalarm;
+  GArray *ids = NULL;
+  gint64 next = until;
+
+  g_hash_table_iter_init (&iter, idletime->priv->alarms);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &eggalarm)) {
+    if (eggalarm->type != EGG_IDLETIME_ALARM_TYPE_POSITIVE ||
+        eggalarm->timeout <= from ||
+        eggalarm->timeout > next)
+      continue;
+
+    if (ids == NULL)
+      ids = g_array_new (FALSE, FALSE, sizeof (guint));
+    if (eggalarm->timeout < next)
+      g_array_set_size (ids, 0);
+
+    next = eggalarm->timeout;
+    g_array_append_val (ids, eggalarm->id);
+  }
+
+  return ids;
+}
+
+/**
+ * egg_idletime_fire_due:
+ *
+ * For backends without alarms of their own: move the idle time in
+ * cursor up to until, firing the positive alarms crossed on the way in
+ * timeout order with cursor set to their timeout.
+ */
+static void
+egg_idletime_fire_due (EggIdletime *idletime, gint64 *cursor, gint64 until)
+{
+  EggIdletimeAlarm *eggalarm;
+  GArray *ids;
+  guint i;
+
+  while ((ids = egg_idletime_find_due (idletime, *cursor, until)) != NULL) {
+    eggalarm = egg_idletime_alarm_find_id (idletime, g_array_index (ids, guint, 0));
+    *cursor = eggalarm->timeout;
+
+    for (i = 0; i < ids->len; i++) {
+      /* an earlier handler may have removed or moved it */
+      eggalarm = egg_idletime_alarm_find_id (idletime, g_array_index (ids, guint, i));
+      if (eggalarm == NULL ||
+          eggalarm->type != EGG_IDLETIME_ALARM_TYPE_POSITIVE ||
+          eggalarm->timeout != *cursor)
+        continue;
+
+      /* a delta of 0 makes the alarm inactive once it fired */
+      eggalarm->type = EGG_IDLETIME_ALARM_TYPE_DISABLED;
+      egg_idletime_alarm_triggered (idletime, eggalarm, *cursor);
+    }
+
+    g_array_free (ids, TRUE);
+  }
+
+  *cursor = until;
+}
+
+/**
+ * egg_idletime_fire_reset:
+ *
+ * For backends without alarms of their own: the idle time dropped from
+ * before to 0, fire the reset alarm if it was waiting for that.
+ */
+static void
+egg_idletime_fire_reset (EggIdletime *idletime, gint64 before)
+{
+  EggIdletimeAlarm *eggalarm;
+
+  /* only the reset alarm is ever negative */
+  eggalarm = egg_idletime_alarm_find_id (idletime, 0);
+  if (eggalarm != NULL &&
+      eggalarm->type == EGG_IDLETIME_ALARM_TYPE_NEGATIVE &&
+      eggalarm->timeout >= 0 && eggalarm->timeout < before) {
+    eggalarm->type = EGG_IDLETIME_ALARM_TYPE_DISABLED;
+    egg_idletime_alarm_triggered (idletime, eggalarm, 0);
+  }
+}
+
+/**
+ * egg_idletime_monotonic_clock:
+ *
+ * The clock of the backends that follow real time, in ms.
+ */
+static gint64
+egg_idletime_monotonic_clock (EggIdletime *idletime)
+{
+  return g_get_monotonic_time () / 1000;
+}
+
+/***************************************************************************
+ ***                            XSYNC BACKEND                            ***
+ ***************************************************************************/
+
 /**
  * egg_idletime_xsyncvalue_to_int64:
  */
@@ -93,10 +404,19 @@ egg_idletime_xsyncvalue_to_int64 (XSyncValue value)
 }
 
 /**
- * egg_idletime_get_time:
+ * egg_idletime_int64_to_xsyncvalue:
  */
-gint64
-egg_idletime_get_time (EggIdletime *idletime)
+static void
+egg_idletime_int64_to_xsyncvalue (gint64 value, XSyncValue *xvalue)
+{
+  XSyncIntsToValue (xvalue, (guint) (value & 0xffffffff), (gint) (value >> 32));
+}
+
+/**
+ * egg_idletime_xsync_get_time:
+ */
+static gint64
+egg_idletime_xsync_get_time (EggIdletime *idletime)
 {
   XSyncValue value;
   XSyncQueryCounter (idletime->priv->dpy, idletime->priv->idle_counter, &value);
@@ -107,7 +427,7 @@ egg_idletime_get_time (EggIdletime *idletime)
  * egg_idletime_xsync_alarm_set:
  */
 static void
-egg_idletime_xsync_alarm_set (EggIdletime *idletime, EggIdletimeAlarm *eggalarm, EggIdletimeAlarmType alarm_type)
+egg_idletime_xsync_alarm_set (EggIdletime *idletime, EggIdletimeAlarm *eggalarm)
 {
   XSyncAlarmAttributes attr;
   XSyncValue delta;
@@ -115,8 +435,9 @@ egg_idletime_xsync_alarm_set (EggIdletime *idletime, EggIdletimeAlarm *eggalarm,
   XSyncTestType test;
 
   /* just remove it */
-  if (alarm_type == EGG_IDLETIME_ALARM_TYPE_DISABLED) {
+  if (eggalarm->type == EGG_IDLETIME_ALARM_TYPE_DISABLED) {
     if (eggalarm->xalarm) {
+      g_hash_table_remove (idletime->priv->xalarms, GSIZE_TO_POINTER (eggalarm->xalarm));
       XSyncDestroyAlarm (idletime->priv->dpy, eggalarm->xalarm);
       eggalarm->xalarm = None;
     }
@@ -124,7 +445,7 @@ egg_idletime_xsync_alarm_set (EggIdletime *idletime, EggIdletimeAlarm *eggalarm,
   }
 
   /* which way do we do the test? */
-  if (alarm_type == EGG_IDLETIME_ALARM_TYPE_POSITIVE)
+  if (eggalarm->type == EGG_IDLETIME_ALARM_TYPE_POSITIVE)
     test = XSyncPositiveTransition;
   else
     test = XSyncNegativeTransition;
@@ -134,142 +455,516 @@ egg_idletime_xsync_alarm_set (EggIdletime *idletime, EggIdletimeAlarm *eggalarm,
   attr.trigger.counter = idletime->priv->idle_counter;
   attr.trigger.value_type = XSyncAbsolute;
   attr.trigger.test_type = test;
-  attr.trigger.wait_value = eggalarm->timeout;
+  egg_idletime_int64_to_xsyncvalue (eggalarm->timeout, &attr.trigger.wait_value);
   attr.delta = delta;
 
   flags = XSyncCACounter | XSyncCAValueType | XSyncCATestType | XSyncCAValue | XSyncCADelta;
 
-  if (eggalarm->xalarm)
+  if (eggalarm->xalarm) {
     XSyncChangeAlarm (idletime->priv->dpy, eggalarm->xalarm, flags, &attr);
-  else
+  } else {
     eggalarm->xalarm = XSyncCreateAlarm (idletime->priv->dpy, flags, &attr);
+    g_hash_table_insert (idletime->priv->xalarms, GSIZE_TO_POINTER (eggalarm->xalarm), eggalarm);
+  }
 }
 
 /**
- * egg_idletime_alarm_reset_all:
+ * egg_idletime_xsync_alarm_free:
  */
-void
-egg_idletime_alarm_reset_all (EggIdletime *idletime)
+static void
+egg_idletime_xsync_alarm_free (EggIdletime *idletime, EggIdletimeAlarm *eggalarm)
+{
+  if (eggalarm->xalarm) {
+    g_hash_table_remove (idletime->priv->xalarms, GSIZE_TO_POINTER (eggalarm->xalarm));
+    XSyncDestroyAlarm (idletime->priv->dpy, eggalarm->xalarm);
+  }
+}
+
+/**
+ * egg_idletime_xsync_event_filter_cb:
+ */
+static GdkFilterReturn
+egg_idletime_xsync_event_filter_cb (GdkXEvent *gdkxevent, GdkEvent *event, gpointer data)
 {
-  guint i;
   EggIdletimeAlarm *eggalarm;
+  XEvent *xevent = (XEvent *) gdkxevent;
+  EggIdletime *idletime = (EggIdletime *) data;
+  XSyncAlarmNotifyEvent *alarm_event;
 
-  g_return_if_fail (EGG_IS_IDLETIME (idletime));
+  /* no point continuing */
+  if (xevent->type != idletime->priv->sync_event + XSyncAlarmNotify)
+    return GDK_FILTER_CONTINUE;
 
-  /* reset all the alarms (except the reset alarm) to their timeouts */
-  for (i=1; i<idletime->priv->array->len; i++) {
-    eggalarm = g_ptr_array_index (idletime->priv->array, i);
-    egg_idletime_xsync_alarm_set (idletime, eggalarm, EGG_IDLETIME_ALARM_TYPE_POSITIVE);
-  }
+  alarm_event = (XSyncAlarmNotifyEvent *) xevent;
 
-  /* set the reset alarm to be disabled */
-  eggalarm = g_ptr_array_index (idletime->priv->array, 0);
-  egg_idletime_xsync_alarm_set (idletime, eggalarm, EGG_IDLETIME_ALARM_TYPE_DISABLED);
+  /* did we match one of our alarms? */
+  eggalarm = g_hash_table_lookup (idletime->priv->xalarms, GSIZE_TO_POINTER (alarm_event->alarm));
+  if (eggalarm == NULL)
+    return GDK_FILTER_CONTINUE;
 
-  /* emit signal so say we've reset all timers */
-  g_signal_emit (idletime, signals [SIGNAL_RESET], 0);
+  egg_idletime_alarm_triggered (idletime, eggalarm,
+                                egg_idletime_xsyncvalue_to_int64 (alarm_event->counter_value));
 
-  /* we need to be reset again on the next event */
-  idletime->priv->reset_set = FALSE;
+  /* don't propagate */
+  return GDK_FILTER_REMOVE;
 }
 
 /**
- * egg_idletime_alarm_find_id:
+ * egg_idletime_xsync_init:
  */
-static EggIdletimeAlarm *
-egg_idletime_alarm_find_id (EggIdletime *idletime, guint id)
+static gboolean
+egg_idletime_xsync_init (EggIdletime *idletime)
 {
+  GdkDisplay *display;
+  int sync_error;
+  int ncounters;
+  XSyncSystemCounter *counters;
   guint i;
-  EggIdletimeAlarm *eggalarm;
-  for (i=0; i<idletime->priv->array->len; i++) {
-    eggalarm = g_ptr_array_index (idletime->priv->array, i);
-    if (eggalarm->id == id)
-      return eggalarm;
+
+  idletime->priv->xalarms = g_hash_table_new (g_direct_hash, g_direct_equal);
+  idletime->priv->idle_counter = None;
+  idletime->priv->sync_event = 0;
+  idletime->priv->dpy = NULL;
+
+  /* no display opened yet, or not an X11 one */
+  display = gdk_display_get_default ();
+  if (display == NULL || !GDK_IS_X11_DISPLAY (display)) {
+    g_warning ("No X display.");
+    return FALSE;
   }
-  return NULL;
+  idletime->priv->dpy = GDK_DISPLAY_XDISPLAY (display);
+
+  /* get the sync event */
+  if (!XSyncQueryExtension (idletime->priv->dpy, &idletime->priv->sync_event, &sync_error)) {
+    g_warning ("No Sync extension.");
+    return FALSE;
+  }
+
+  /* gtk_init should do XSyncInitialize for us */
+  counters = XSyncListSystemCounters (idletime->priv->dpy, &ncounters);
+  for (i=0; i < (guint)ncounters && !idletime->priv->idle_counter; i++) {
+    if (strcmp(counters[i].name, "IDLETIME") == 0)
+      idletime->priv->idle_counter = counters[i].counter;
+  }
+  XSyncFreeSystemCounterList (counters);
+
+  /* arh. we don't have IDLETIME support */
+  if (!idletime->priv->idle_counter) {
+    g_warning ("No idle counter.");
+    return FALSE;
+  }
+
+  /* catch the timer alarm */
+  gdk_window_add_filter (NULL, egg_idletime_xsync_event_filter_cb, idletime);
+  return TRUE;
 }
 
 /**
- * egg_idletime_set_reset_alarm:
+ * egg_idletime_xsync_finalize:
+ */
+static void
+egg_idletime_xsync_finalize (EggIdletime *idletime)
+{
+  if (idletime->priv->idle_counter)
+    gdk_window_remove_filter (NULL, egg_idletime_xsync_event_filter_cb, idletime);
+  g_hash_table_destroy (idletime->priv->xalarms);
+}
+
+static const EggIdletimeBackend egg_idletime_xsync_backend = {
+  egg_idletime_xsync_init,
+  egg_idletime_xsync_finalize,
+  egg_idletime_xsync_get_time,
+  egg_idletime_monotonic_clock,
+  egg_idletime_xsync_alarm_set,
+  egg_idletime_xsync_alarm_free
+};
+
+/***************************************************************************
+ ***                           LOGIND BACKEND                            ***
+ ***************************************************************************/
+
+/*
+ * Follows the IdleHint and IdleSinceHintMonotonic properties of our
+ * logind session. The idle time is 0 while the session isn't idle, and
+ * counts from IdleSinceHint once it is. Positive alarms are run from a
+ * timeout for the next one due, the reset alarm from IdleHint going
+ * back to FALSE.
+ */
+
+#define LOGIND_NAME          "org.freedesktop.login1"
+#define LOGIND_PATH          "/org/freedesktop/login1"
+#define LOGIND_MANAGER_IFACE "org.freedesktop.login1.Manager"
+#define LOGIND_SESSION_IFACE "org.freedesktop.login1.Session"
+
+static void egg_idletime_logind_schedule (EggIdletime *idletime);
+
+/**
+ * egg_idletime_logind_get_time:
+ */
+static gint64
+egg_idletime_logind_get_time (EggIdletime *idletime)
+{
+  gint64 now;
+
+  if (!idletime->priv->logind_idle)
+    return 0;
+
+  /* older logind only has the realtime variant */
+  if (idletime->priv->logind_since_monotonic != 0)
+    now = g_get_monotonic_time () - idletime->priv->logind_since_monotonic;
+  else
+    now = g_get_real_time () - idletime->priv->logind_since;
+
+  return MAX (now, 0) / 1000;
+}
+
+/**
+ * egg_idletime_logind_check:
+ *
+ * Fire everything that became due since the last check.
  */
 static void
-egg_idletime_set_reset_alarm (EggIdletime *idletime, XSyncAlarmNotifyEvent *alarm_event)
+egg_idletime_logind_check (EggIdletime *idletime)
 {
+  if (idletime->priv->logind_idle)
+    egg_idletime_fire_due (idletime, &idletime->priv->logind_checked,
+                           egg_idletime_logind_get_time (idletime));
+  egg_idletime_logind_schedule (idletime);
+}
+
+/**
+ * egg_idletime_logind_timeout_cb:
+ */
+static gboolean
+egg_idletime_logind_timeout_cb (gpointer data)
+{
+  EggIdletime *idletime = data;
+
+  idletime->priv->logind_timeout_id = 0;
+  egg_idletime_logind_check (idletime);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * egg_idletime_logind_schedule:
+ *
+ * Wake up when the next positive alarm is due, if the session is idle.
+ */
+static void
+egg_idletime_logind_schedule (EggIdletime *idletime)
+{
+  GHashTableIter iter;
   EggIdletimeAlarm *eggalarm;
-  int overflow;
-  XSyncValue add;
+  gint64 next = -1;
 
-  eggalarm = egg_idletime_alarm_find_id (idletime, 0);
+  if (idletime->priv->logind_timeout_id != 0) {
+    g_source_remove (idletime->priv->logind_timeout_id);
+    idletime->priv->logind_timeout_id = 0;
+  }
 
-  if (!idletime->priv->reset_set) {
-    /* don't match on the current value because
-     * XSyncNegativeComparison means less or equal. */
-    XSyncIntToValue (&add, -1);
-    XSyncValueAdd (&eggalarm->timeout, alarm_event->counter_value, add, &overflow);
+  if (!idletime->priv->logind_idle)
+    return;
 
-    /* set the reset alarm to fire the next time
-     * idletime->priv->idle_counter < the current counter value */
-    egg_idletime_xsync_alarm_set (idletime, eggalarm, EGG_IDLETIME_ALARM_TYPE_NEGATIVE);
+  g_hash_table_iter_init (&iter, idletime->priv->alarms);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &eggalarm)) {
+    if (eggalarm->type == EGG_IDLETIME_ALARM_TYPE_POSITIVE &&
+        eggalarm->timeout > idletime->priv->logind_checked &&
+        (next == -1 || eggalarm->timeout < next))
+      next = eggalarm->timeout;
+  }
 
-    /* don't try to set this again if multiple timers are going off in sequence */
-    idletime->priv->reset_set = TRUE;
+  if (next == -1)
+    return;
+
+  next -= egg_idletime_logind_get_time (idletime);
+  idletime->priv->logind_timeout_id =
+    g_timeout_add ((guint) CLAMP (next, 0, G_MAXUINT), egg_idletime_logind_timeout_cb, idletime);
+}
+
+/**
+ * egg_idletime_logind_update:
+ *
+ * Read the idle hints from the proxy cache.
+ */
+static void
+egg_idletime_logind_update (EggIdletime *idletime)
+{
+  GVariant *variant;
+  gboolean idle = FALSE;
+  gint64 before;
+
+  variant = g_dbus_proxy_get_cached_property (idletime->priv->logind_proxy, "IdleHint");
+  if (variant) {
+    idle = g_variant_get_boolean (variant);
+    g_variant_unref (variant);
+  }
+
+  variant = g_dbus_proxy_get_cached_property (idletime->priv->logind_proxy, "IdleSinceHint");
+  if (variant) {
+    idletime->priv->logind_since = g_variant_get_uint64 (variant);
+    g_variant_unref (variant);
+  }
+
+  variant = g_dbus_proxy_get_cached_property (idletime->priv->logind_proxy, "IdleSinceHintMonotonic");
+  if (variant) {
+    idletime->priv->logind_since_monotonic = g_variant_get_uint64 (variant);
+    g_variant_unref (variant);
+  }
+
+  if (idle == idletime->priv->logind_idle) {
+    egg_idletime_logind_check (idletime);
+    return;
+  }
+
+  if (idle) {
+    /* the hint may come late, the alarms it already passed are due */
+    idletime->priv->logind_idle = TRUE;
+    idletime->priv->logind_checked = 0;
+    egg_idletime_logind_check (idletime);
+  } else {
+    before = idletime->priv->logind_checked;
+    idletime->priv->logind_idle = FALSE;
+    idletime->priv->logind_checked = 0;
+    egg_idletime_logind_schedule (idletime);
+    egg_idletime_fire_reset (idletime, before);
   }
 }
 
 /**
- * egg_idletime_alarm_find_event:
+ * egg_idletime_logind_properties_changed_cb:
  */
-static EggIdletimeAlarm *
-egg_idletime_alarm_find_event (EggIdletime *idletime, XSyncAlarmNotifyEvent *alarm_event)
+static void
+egg_idletime_logind_properties_changed_cb (GDBusProxy *proxy,
+                                           GVariant   *changed,
+                                           const gchar * const *invalidated,
+                                           EggIdletime *idletime)
 {
-  guint i;
-  EggIdletimeAlarm *eggalarm;
-  for (i=0; i<idletime->priv->array->len; i++) {
-    eggalarm = g_ptr_array_index (idletime->priv->array, i);
-    if (alarm_event->alarm == eggalarm->xalarm)
-      return eggalarm;
+  egg_idletime_logind_update (idletime);
+}
+
+/**
+ * egg_idletime_logind_get_session:
+ */
+static gchar *
+egg_idletime_logind_get_session (GDBusConnection *bus)
+{
+  GVariant *ret;
+  GError *error = NULL;
+  gchar *path = NULL;
+
+  ret = g_dbus_connection_call_sync (bus, LOGIND_NAME, LOGIND_PATH, LOGIND_MANAGER_IFACE,
+                                     "GetSessionByPID",
+                                     g_variant_new ("(u)", (guint32) getpid ()),
+                                     G_VARIANT_TYPE ("(o)"),
+                                     G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+  if (ret == NULL) {
+    g_warning ("Unable to get the logind session: %s", error->message);
+    g_error_free (error);
+    return NULL;
   }
-  return NULL;
+
+  g_variant_get (ret, "(o)", &path);
+  g_variant_unref (ret);
+
+  return path;
 }
 
 /**
- * egg_idletime_event_filter_cb:
+ * egg_idletime_logind_init:
  */
-static GdkFilterReturn
-egg_idletime_event_filter_cb (GdkXEvent *gdkxevent, GdkEvent *event, gpointer data)
+static gboolean
+egg_idletime_logind_init (EggIdletime *idletime)
 {
-  EggIdletimeAlarm *eggalarm;
-  XEvent *xevent = (XEvent *) gdkxevent;
-  EggIdletime *idletime = (EggIdletime *) data;
-  XSyncAlarmNotifyEvent *alarm_event;
+  GError *error = NULL;
+  gchar *path;
+
+  idletime->priv->logind_proxy = NULL;
+  idletime->priv->logind_timeout_id = 0;
+  idletime->priv->logind_idle = FALSE;
+  idletime->priv->logind_checked = 0;
+  idletime->priv->logind_since = 0;
+  idletime->priv->logind_since_monotonic = 0;
+
+  if (egg_idletime_default_connection != NULL)
+    idletime->priv->logind_bus = g_object_ref (egg_idletime_default_connection);
+  else
+    idletime->priv->logind_bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
 
-  /* no point continuing */
-  if (xevent->type != idletime->priv->sync_event + XSyncAlarmNotify)
-    return GDK_FILTER_CONTINUE;
+  if (idletime->priv->logind_bus == NULL) {
+    g_warning ("Unable to connect to the system bus: %s", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
 
-  alarm_event = (XSyncAlarmNotifyEvent *) xevent;
+  path = egg_idletime_logind_get_session (idletime->priv->logind_bus);
+  if (path == NULL)
+    return FALSE;
 
-  /* did we match one of our alarms? */
-  eggalarm = egg_idletime_alarm_find_event (idletime, alarm_event);
-  if (eggalarm == NULL)
-    return GDK_FILTER_CONTINUE;
+  idletime->priv->logind_proxy = g_dbus_proxy_new_sync (idletime->priv->logind_bus,
+                                                        G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+                                                        NULL,
+                                                        LOGIND_NAME,
+                                                        path,
+                                                        LOGIND_SESSION_IFACE,
+                                                        NULL,
+                                                        &error);
+  g_free (path);
+
+  if (idletime->priv->logind_proxy == NULL) {
+    g_warning ("Unable to get the logind session proxy: %s", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  g_signal_connect (idletime->priv->logind_proxy, "g-properties-changed",
+                    G_CALLBACK (egg_idletime_logind_properties_changed_cb), idletime);
+  egg_idletime_logind_update (idletime);
+
+  return TRUE;
+}
+
+/**
+ * egg_idletime_logind_finalize:
+ */
+static void
+egg_idletime_logind_finalize (EggIdletime *idletime)
+{
+  if (idletime->priv->logind_timeout_id != 0)
+    g_source_remove (idletime->priv->logind_timeout_id);
+  if (idletime->priv->logind_proxy != NULL) {
+    g_signal_handlers_disconnect_by_data (idletime->priv->logind_proxy, idletime);
+    g_object_unref (idletime->priv->logind_proxy);
+  }
+  if (idletime->priv->logind_bus != NULL)
+    g_object_unref (idletime->priv->logind_bus);
+}
+
+/**
+ * egg_idletime_logind_alarm_set:
+ */
+static void
+egg_idletime_logind_alarm_set (EggIdletime *idletime, EggIdletimeAlarm *eggalarm)
+{
+  if (eggalarm->type == EGG_IDLETIME_ALARM_TYPE_POSITIVE)
+    egg_idletime_logind_schedule (idletime);
+}
+
+/**
+ * egg_idletime_logind_alarm_free:
+ */
+static void
+egg_idletime_logind_alarm_free (EggIdletime *idletime, EggIdletimeAlarm *eggalarm)
+{
+}
+
+static const EggIdletimeBackend egg_idletime_logind_backend = {
+  egg_idletime_logind_init,
+  egg_idletime_logind_finalize,
+  egg_idletime_logind_get_time,
+  egg_idletime_monotonic_clock,
+  egg_idletime_logind_alarm_set,
+  egg_idletime_logind_alarm_free
+};
+
+/***************************************************************************
+ ***                           VIRTUAL BACKEND                           ***
+ ***************************************************************************/
+
+/*
+ * The idle time only moves when egg_idletime_virtual_advance() or
+ * egg_idletime_virtual_activity() are called, and alarms go off from
+ * within those calls, in timeout order, with the idle time set to
+ * their timeout. Alarms follow the XSync semantics used above: a
+ * positive alarm fires once when the idle time crosses its timeout,
+ * a negative one when the idle time drops below it.
+ */
+
+static gboolean
+egg_idletime_virtual_init (EggIdletime *idletime)
+{
+  idletime->priv->virtual_time = 0;
+  idletime->priv->virtual_clock = 0;
+  return TRUE;
+}
+
+static void
+egg_idletime_virtual_finalize (EggIdletime *idletime)
+{
+}
+
+static gint64
+egg_idletime_virtual_get_time (EggIdletime *idletime)
+{
+  return idletime->priv->virtual_time;
+}
+
+static gint64
+egg_idletime_virtual_get_clock (EggIdletime *idletime)
+{
+  return idletime->priv->virtual_clock + idletime->priv->virtual_time;
+}
+
+static void
+egg_idletime_virtual_alarm_set (EggIdletime *idletime, EggIdletimeAlarm *eggalarm)
+{
+  /* nothing to do, the alarm type and timeout are all we need */
+}
+
+static void
+egg_idletime_virtual_alarm_free (EggIdletime *idletime, EggIdletimeAlarm *eggalarm)
+{
+}
+
+static const EggIdletimeBackend egg_idletime_virtual_backend = {
+  egg_idletime_virtual_init,
+  egg_idletime_virtual_finalize,
+  egg_idletime_virtual_get_time,
+  egg_idletime_virtual_get_clock,
+  egg_idletime_virtual_alarm_set,
+  egg_idletime_virtual_alarm_free
+};
+
+/**
+ * egg_idletime_virtual_advance:
+ *
+ * Let time_ms of idle time pass on a virtual clock, firing the alarms
+ * that are due on the way.
+ */
+void
+egg_idletime_virtual_advance (EggIdletime *idletime, guint time_ms)
+{
+  g_return_if_fail (EGG_IS_IDLETIME (idletime));
+  g_return_if_fail (idletime->priv->backend == &egg_idletime_virtual_backend);
+
+  egg_idletime_fire_due (idletime, &idletime->priv->virtual_time,
+                         idletime->priv->virtual_time + time_ms);
+}
+
+/**
+ * egg_idletime_virtual_activity:
+ *
+ * Simulate user input on a virtual clock: the idle time drops back to 0.
+ */
+void
+egg_idletime_virtual_activity (EggIdletime *idletime)
+{
+  gint64 before;
 
-  /* are we the reset alarm? */
-  if (eggalarm->id == 0) {
-    egg_idletime_alarm_reset_all (idletime);
-    goto out;
-  }
+  g_return_if_fail (EGG_IS_IDLETIME (idletime));
+  g_return_if_fail (idletime->priv->backend == &egg_idletime_virtual_backend);
 
-  /* emit */
-  g_signal_emit (eggalarm->idletime, signals [SIGNAL_ALARM_EXPIRED], 0, eggalarm->id);
+  before = idletime->priv->virtual_time;
+  idletime->priv->virtual_clock += before;
+  idletime->priv->virtual_time = 0;
 
-  /* we need the first alarm to go off to set the reset alarm */
-  egg_idletime_set_reset_alarm (idletime, alarm_event);
-out:
-  /* don't propagate */
-  return GDK_FILTER_REMOVE;
+  egg_idletime_fire_reset (idletime, before);
 }
 
+/***************************************************************************
+ ***                               ALARMS                                ***
+ ***************************************************************************/
+
 /**
  * egg_idletime_alarm_new:
  */
@@ -284,7 +979,10 @@ egg_idletime_alarm_new (EggIdletime *idletime, guint id)
   /* set the default values */
   eggalarm->id = id;
   eggalarm->xalarm = None;
-  eggalarm->idletime = g_object_ref (idletime);
+  eggalarm->type = EGG_IDLETIME_ALARM_TYPE_DISABLED;
+  eggalarm->fired = FALSE;
+  /* not a reference, the alarms go away with the object */
+  eggalarm->idletime = idletime;
 
   return eggalarm;
 }
@@ -307,33 +1005,53 @@ egg_idletime_alarm_set (EggIdletime *idletime, guint id, guint timeout)
     /* create a new alarm */
     eggalarm = egg_idletime_alarm_new (idletime, id);
 
-    /* add to array */
-    g_ptr_array_add (idletime->priv->array, eggalarm);
+    /* add to the table */
+    g_hash_table_insert (idletime->priv->alarms, GUINT_TO_POINTER (id), eggalarm);
   }
 
   /* set the timeout */
-  XSyncIntToValue (&eggalarm->timeout, (gint)timeout);
+  eggalarm->timeout = (gint) timeout;
 
   /* set, and start the timer */
-  egg_idletime_xsync_alarm_set (idletime, eggalarm, EGG_IDLETIME_ALARM_TYPE_POSITIVE);
+  egg_idletime_alarm_arm (idletime, eggalarm, EGG_IDLETIME_ALARM_TYPE_POSITIVE);
   return TRUE;
 }
 
 /**
  * egg_idletime_alarm_free:
  */
-static gboolean
-egg_idletime_alarm_free (EggIdletime *idletime, EggIdletimeAlarm *eggalarm)
+static void
+egg_idletime_alarm_free (gpointer data)
 {
-  g_return_val_if_fail (EGG_IS_IDLETIME (idletime), FALSE);
-  g_return_val_if_fail (eggalarm != NULL, FALSE);
+  EggIdletimeAlarm *eggalarm = data;
+  EggIdletime *idletime = eggalarm->idletime;
 
-  if (eggalarm->xalarm)
-    XSyncDestroyAlarm (idletime->priv->dpy, eggalarm->xalarm);
-  g_object_unref (eggalarm->idletime);
+  idletime->priv->backend->alarm_free (idletime, eggalarm);
   g_free (eggalarm);
-  g_ptr_array_remove (idletime->priv->array, eggalarm);
-  return TRUE;
+}
+
+/**
+ * egg_idletime_alarm_set_reset:
+ *
+ * Have the next input emit reset even though no alarm went off yet in
+ * this idle period, for users that skip their alarms.
+ */
+void
+egg_idletime_alarm_set_reset (EggIdletime *idletime)
+{
+  gint64 counter_value;
+
+  g_return_if_fail (EGG_IS_IDLETIME (idletime));
+
+  counter_value = egg_idletime_get_time (idletime);
+  if (counter_value <= 0)
+    return;
+
+  if (idletime->priv->idle_start < 0)
+    idletime->priv->idle_start = idletime->priv->backend->get_clock (idletime) - counter_value;
+
+  idletime->priv->reset_wanted = TRUE;
+  egg_idletime_set_reset_alarm (idletime, counter_value);
 }
 
 /**
@@ -349,7 +1067,7 @@ egg_idletime_alarm_remove (EggIdletime *idletime, guint id)
   eggalarm = egg_idletime_alarm_find_id (idletime, id);
   if (eggalarm == NULL)
     return FALSE;
-  egg_idletime_alarm_free (idletime, eggalarm);
+  g_hash_table_remove (idletime->priv->alarms, GUINT_TO_POINTER (id));
   return TRUE;
 }
 
@@ -384,47 +1102,37 @@ egg_idletime_class_init (EggIdletimeClass *klass)
 static void
 egg_idletime_init (EggIdletime *idletime)
 {
-  int sync_error;
-  int ncounters;
-  XSyncSystemCounter *counters;
   EggIdletimeAlarm *eggalarm;
-  guint i;
 
   idletime->priv = egg_idletime_get_instance_private (idletime);
 
-  idletime->priv->array = g_ptr_array_new ();
-
+  idletime->priv->alarms = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                  NULL, egg_idletime_alarm_free);
   idletime->priv->reset_set = FALSE;
-  idletime->priv->idle_counter = None;
-  idletime->priv->sync_event = 0;
-  idletime->priv->dpy = gdk_x11_get_default_xdisplay ();
-
-  /* get the sync event */
-  if (!XSyncQueryExtension (idletime->priv->dpy, &idletime->priv->sync_event, &sync_error)) {
-    g_warning ("No Sync extension.");
-    return;
-  }
-
-  /* gtk_init should do XSyncInitialize for us */
-  counters = XSyncListSystemCounters (idletime->priv->dpy, &ncounters);
-  for (i=0; i < (guint)ncounters && !idletime->priv->idle_counter; i++) {
-    if (strcmp(counters[i].name, "IDLETIME") == 0)
-      idletime->priv->idle_counter = counters[i].counter;
-  }
-  XSyncFreeSystemCounterList (counters);
-
-  /* arh. we don't have IDLETIME support */
-  if (!idletime->priv->idle_counter) {
-    g_warning ("No idle counter.");
-    return;
+  idletime->priv->reset_wanted = FALSE;
+  idletime->priv->idle_start = -1;
+  idletime->priv->last_period = 0;
+  memset (idletime->priv->histogram, 0, sizeof (idletime->priv->histogram));
+
+  idletime->priv->backend = egg_idletime_default_backend;
+  if (!idletime->priv->backend->init (idletime) &&
+      idletime->priv->backend == &egg_idletime_xsync_backend) {
+    /* no IDLETIME counter, try the session idle hint instead */
+    g_warning ("Falling back to the logind idle hint.");
+    idletime->priv->backend->finalize (idletime);
+    idletime->priv->backend = &egg_idletime_logind_backend;
+    idletime->priv->backend->init (idletime);
   }
 
-  /* catch the timer alarm */
-  gdk_window_add_filter (NULL, egg_idletime_event_filter_cb, idletime);
-
   /* create a reset alarm */
   eggalarm = egg_idletime_alarm_new (idletime, 0);
-  g_ptr_array_add (idletime->priv->array, eggalarm);
+  g_hash_table_insert (idletime->priv->alarms, GUINT_TO_POINTER (0), eggalarm);
+
+  /* and the one for the statistics */
+  eggalarm = egg_idletime_alarm_new (idletime, EGG_IDLETIME_STATS_ALARM);
+  eggalarm->timeout = EGG_IDLETIME_STATS_MIN;
+  g_hash_table_insert (idletime->priv->alarms, GUINT_TO_POINTER (EGG_IDLETIME_STATS_ALARM), eggalarm);
+  egg_idletime_alarm_arm (idletime, eggalarm, EGG_IDLETIME_ALARM_TYPE_POSITIVE);
 }
 
 /**
@@ -433,9 +1141,7 @@ egg_idletime_init (EggIdletime *idletime)
 static void
 egg_idletime_finalize (GObject *object)
 {
-  guint i;
   EggIdletime *idletime;
-  EggIdletimeAlarm *eggalarm;
 
   g_return_if_fail (object != NULL);
   g_return_if_fail (EGG_IS_IDLETIME (object));
@@ -444,15 +1150,41 @@ egg_idletime_finalize (GObject *object)
   idletime->priv = egg_idletime_get_instance_private (idletime);
 
   /* free all counters, including reset counter */
-  for (i=0; i<idletime->priv->array->len; i++) {
-    eggalarm = g_ptr_array_index (idletime->priv->array, i);
-    egg_idletime_alarm_free (idletime, eggalarm);
-  }
-  g_ptr_array_free (idletime->priv->array, TRUE);
+  g_hash_table_destroy (idletime->priv->alarms);
+  idletime->priv->backend->finalize (idletime);
 
   G_OBJECT_CLASS (egg_idletime_parent_class)->finalize (object);
 }
 
+/**
+ * egg_idletime_get_histogram:
+ *
+ * How many idle periods of each length ended so far, bucket i counting
+ * the ones from 2^i up to 2^(i+1) seconds, the last bucket everything
+ * longer. Shorter periods than a second aren't counted.
+ **/
+const guint *
+egg_idletime_get_histogram (EggIdletime *idletime)
+{
+  g_return_val_if_fail (EGG_IS_IDLETIME (idletime), NULL);
+
+  return idletime->priv->histogram;
+}
+
+/**
+ * egg_idletime_get_last_period:
+ *
+ * The length in ms of the idle period that ended last, for use from a
+ * reset handler.
+ **/
+gint64
+egg_idletime_get_last_period (EggIdletime *idletime)
+{
+  g_return_val_if_fail (EGG_IS_IDLETIME (idletime), 0);
+
+  return idletime->priv->last_period;
+}
+
 /**
  * egg_idletime_new:
  **/
@@ -468,6 +1200,55 @@ egg_idletime_new (void)
   return EGG_IDLETIME (egg_idletime_object);
 }
 
+/**
+ * egg_idletime_new_virtual:
+ *
+ * Create the shared EggIdletime on a virtual clock instead of XSync, so
+ * everything getting it from egg_idletime_new() afterwards runs off
+ * egg_idletime_virtual_advance() and egg_idletime_virtual_activity().
+ * Must be called before the first egg_idletime_new().
+ **/
+EggIdletime *
+egg_idletime_new_virtual (void)
+{
+  g_return_val_if_fail (egg_idletime_set_source (EGG_IDLETIME_SOURCE_VIRTUAL, NULL), NULL);
+
+  return egg_idletime_new ();
+}
+
+/**
+ * egg_idletime_set_source:
+ *
+ * Choose where the shared EggIdletime takes the idle time from. For
+ * logind, connection is the bus to find it on, or NULL for the system
+ * bus. Must be called before the first egg_idletime_new().
+ **/
+gboolean
+egg_idletime_set_source (EggIdletimeSource source, GDBusConnection *connection)
+{
+  g_return_val_if_fail (egg_idletime_object == NULL, FALSE);
+
+  switch (source) {
+  case EGG_IDLETIME_SOURCE_XSYNC:
+    egg_idletime_default_backend = &egg_idletime_xsync_backend;
+    break;
+  case EGG_IDLETIME_SOURCE_LOGIND:
+    egg_idletime_default_backend = &egg_idletime_logind_backend;
+    break;
+  case EGG_IDLETIME_SOURCE_VIRTUAL:
+    egg_idletime_default_backend = &egg_idletime_virtual_backend;
+    break;
+  default:
+    return FALSE;
+  }
+
+  g_clear_object (&egg_idletime_default_connection);
+  if (connection != NULL)
+    egg_idletime_default_connection = g_object_ref (connection);
+
+  return TRUE;
+}
+
 /***************************************************************************
  ***                          MAKE CHECK TESTS                           ***
  ***************************************************************************/
@@ -684,4 +1465,399 @@ egg_idletime_test (gpointer data)
   egg_test_end (test);
 }
 
+static guint virtual_resets = 0;
+
+static void
+gpm_virtual_alarm_cb (EggIdletime *idletime, guint alarm, gpointer data)
+{
+  last_alarm = alarm;
+}
+
+static void
+gpm_virtual_reset_cb (EggIdletime *idletime, gpointer data)
+{
+  virtual_resets++;
+}
+
+void
+egg_idletime_virtual_test (gpointer data)
+{
+  EggIdletime *idletime;
+  EggTest *test = (EggTest *) data;
+
+  if (egg_test_start (test, "EggIdletime (virtual)") == FALSE)
+    return;
+
+  idletime = egg_idletime_new_virtual ();
+  g_signal_connect (idletime, "alarm-expired",
+        G_CALLBACK (gpm_virtual_alarm_cb), NULL);
+  g_signal_connect (idletime, "reset",
+        G_CALLBACK (gpm_virtual_reset_cb), NULL);
+
+  last_alarm = 0;
+  egg_idletime_alarm_set (idletime, 101, 5000);
+  egg_idletime_alarm_set (idletime, 102, 10000);
+
+  /************************************************************/
+  egg_test_title (test, "check no alarm goes off early");
+  egg_idletime_virtual_advance (idletime, 4999);
+  if (last_alarm == 0) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "alarm %i set!", last_alarm);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check the first alarm goes off on time");
+  egg_idletime_virtual_advance (idletime, 1);
+  if (last_alarm == 101 && egg_idletime_get_time (idletime) == 5000) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "alarm %i at %" G_GINT64_FORMAT, last_alarm, egg_idletime_get_time (idletime));
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check the second alarm goes off when skipping past it");
+  egg_idletime_virtual_advance (idletime, 60000);
+  if (last_alarm == 102 && egg_idletime_get_time (idletime) == 65000) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "alarm %i set!", last_alarm);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check activity resets the alarms");
+  last_alarm = 0;
+  egg_idletime_virtual_activity (idletime);
+  egg_idletime_virtual_advance (idletime, 5000);
+  if (virtual_resets == 1 && last_alarm == 101) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "%i resets, alarm %i", virtual_resets, last_alarm);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check a removed alarm doesn't go off");
+  last_alarm = 0;
+  egg_idletime_alarm_remove (idletime, 102);
+  egg_idletime_virtual_advance (idletime, 60000);
+  if (last_alarm == 0) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "alarm %i set!", last_alarm);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check a short pause is recorded without a reset");
+  egg_idletime_virtual_activity (idletime);
+  egg_idletime_virtual_advance (idletime, 2000);
+  egg_idletime_virtual_activity (idletime);
+  if (virtual_resets == 2 && egg_idletime_get_last_period (idletime) == 2000 &&
+      egg_idletime_get_histogram (idletime)[1] == 1) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "%i resets, last period %" G_GINT64_FORMAT, virtual_resets,
+                     egg_idletime_get_last_period (idletime));
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check the alarms are still armed after the short pause");
+  last_alarm = 0;
+  egg_idletime_virtual_advance (idletime, 5000);
+  if (last_alarm == 101) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "alarm %i set!", last_alarm);
+  }
+
+  g_object_unref (idletime);
+
+  egg_test_end (test);
+}
+
+/* answers the logind calls from its own thread, so sync calls can't deadlock */
+typedef struct
+{
+  GDBusConnection *service;
+  GMainContext    *context;
+  GMainLoop       *loop;
+  GMutex           lock;
+  guint32          pid;
+  gboolean         idle;
+  guint64          since_monotonic;
+} EggIdletimeMockLogind;
+
+#define MOCK_SESSION_PATH LOGIND_PATH "/session/test"
+
+static const gchar egg_idletime_mock_logind_xml[] =
+  "<node>"
+  "  <interface name='" LOGIND_MANAGER_IFACE "'>"
+  "    <method name='GetSessionByPID'>"
+  "      <arg type='u' direction='in'/>"
+  "      <arg type='o' direction='out'/>"
+  "    </method>"
+  "  </interface>"
+  "  <interface name='" LOGIND_SESSION_IFACE "'>"
+  "    <property name='IdleHint' type='b' access='read'/>"
+  "    <property name='IdleSinceHint' type='t' access='read'/>"
+  "    <property name='IdleSinceHintMonotonic' type='t' access='read'/>"
+  "  </interface>"
+  "</node>";
+
+static void
+egg_idletime_mock_logind_method (GDBusConnection       *connection,
+                                 const gchar           *sender,
+                                 const gchar           *object_path,
+                                 const gchar           *interface_name,
+                                 const gchar           *method_name,
+                                 GVariant              *parameters,
+                                 GDBusMethodInvocation *invocation,
+                                 gpointer               user_data)
+{
+  EggIdletimeMockLogind *mock = user_data;
+
+  g_mutex_lock (&mock->lock);
+  g_variant_get (parameters, "(u)", &mock->pid);
+  g_mutex_unlock (&mock->lock);
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(o)", MOCK_SESSION_PATH));
+}
+
+static GVariant *
+egg_idletime_mock_logind_get_property (GDBusConnection  *connection,
+                                       const gchar      *sender,
+                                       const gchar      *object_path,
+                                       const gchar      *interface_name,
+                                       const gchar      *property_name,
+                                       GError          **error,
+                                       gpointer          user_data)
+{
+  EggIdletimeMockLogind *mock = user_data;
+  GVariant *ret = NULL;
+
+  g_mutex_lock (&mock->lock);
+  if (g_strcmp0 (property_name, "IdleHint") == 0)
+    ret = g_variant_new_boolean (mock->idle);
+  else if (g_strcmp0 (property_name, "IdleSinceHint") == 0)
+    ret = g_variant_new_uint64 (0);
+  else if (g_strcmp0 (property_name, "IdleSinceHintMonotonic") == 0)
+    ret = g_variant_new_uint64 (mock->since_monotonic);
+  g_mutex_unlock (&mock->lock);
+
+  return ret;
+}
+
+static const GDBusInterfaceVTable egg_idletime_mock_logind_manager_vtable =
+{
+  egg_idletime_mock_logind_method, NULL, NULL
+};
+
+static const GDBusInterfaceVTable egg_idletime_mock_logind_session_vtable =
+{
+  NULL, egg_idletime_mock_logind_get_property, NULL
+};
+
+static gpointer
+egg_idletime_mock_logind_thread (gpointer data)
+{
+  EggIdletimeMockLogind *mock = data;
+
+  g_main_context_push_thread_default (mock->context);
+  g_main_loop_run (mock->loop);
+  g_main_context_pop_thread_default (mock->context);
+
+  return NULL;
+}
+
+/* what logind does when the session goes idle or comes back */
+static void
+egg_idletime_mock_logind_set_idle (EggIdletimeMockLogind *mock, gboolean idle, guint64 since_monotonic)
+{
+  GVariantBuilder changed, invalidated;
+
+  g_mutex_lock (&mock->lock);
+  mock->idle = idle;
+  mock->since_monotonic = since_monotonic;
+  g_mutex_unlock (&mock->lock);
+
+  g_variant_builder_init (&changed, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&changed, "{sv}", "IdleHint", g_variant_new_boolean (idle));
+  g_variant_builder_add (&changed, "{sv}", "IdleSinceHintMonotonic", g_variant_new_uint64 (since_monotonic));
+  g_variant_builder_init (&invalidated, G_VARIANT_TYPE ("as"));
+
+  g_dbus_connection_emit_signal (mock->service, NULL, MOCK_SESSION_PATH,
+                                 "org.freedesktop.DBus.Properties", "PropertiesChanged",
+                                 g_variant_new ("(sa{sv}as)", LOGIND_SESSION_IFACE, &changed, &invalidated),
+                                 NULL);
+}
+
+/* run the main loop until *value is set, or give up after a second */
+static gboolean
+egg_idletime_logind_test_wait (guint *value)
+{
+  gint64 deadline = g_get_monotonic_time () + G_USEC_PER_SEC;
+
+  while (*value == 0 && g_get_monotonic_time () < deadline) {
+    if (!g_main_context_iteration (NULL, FALSE))
+      g_usleep (1000);
+  }
+
+  return *value != 0;
+}
+
+static void
+gpm_logind_alarm_cb (EggIdletime *idletime, guint alarm, guint *last)
+{
+  *last = alarm;
+}
+
+static void
+gpm_logind_reset_cb (EggIdletime *idletime, guint *resets)
+{
+  (*resets)++;
+}
+
+void
+egg_idletime_logind_test (gpointer data)
+{
+  EggIdletimeMockLogind mock = { 0 };
+  EggIdletime *idletime;
+  GTestDBus *bus;
+  GDBusConnection *connection;
+  GDBusNodeInfo *node;
+  GVariant *reply;
+  GThread *thread;
+  guint manager_id, session_id;
+  guint alarm = 0;
+  guint resets = 0;
+  gint64 idle;
+  EggTest *test = (EggTest *) data;
+
+  if (egg_test_start (test, "EggIdletime (logind)") == FALSE)
+    return;
+
+  /* logind on a private system bus */
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (bus);
+
+  mock.service = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (bus),
+                                                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                         G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                         NULL, NULL, NULL);
+  node = g_dbus_node_info_new_for_xml (egg_idletime_mock_logind_xml, NULL);
+  g_mutex_init (&mock.lock);
+  mock.context = g_main_context_new ();
+  mock.loop = g_main_loop_new (mock.context, FALSE);
+
+  g_main_context_push_thread_default (mock.context);
+  manager_id = g_dbus_connection_register_object (mock.service, LOGIND_PATH,
+                                                  g_dbus_node_info_lookup_interface (node, LOGIND_MANAGER_IFACE),
+                                                  &egg_idletime_mock_logind_manager_vtable,
+                                                  &mock, NULL, NULL);
+  session_id = g_dbus_connection_register_object (mock.service, MOCK_SESSION_PATH,
+                                                  g_dbus_node_info_lookup_interface (node, LOGIND_SESSION_IFACE),
+                                                  &egg_idletime_mock_logind_session_vtable,
+                                                  &mock, NULL, NULL);
+  g_main_context_pop_thread_default (mock.context);
+
+  reply = g_dbus_connection_call_sync (mock.service, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "RequestName",
+                                       g_variant_new ("(su)", LOGIND_NAME, 0),
+                                       NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+  if (reply != NULL)
+    g_variant_unref (reply);
+
+  thread = g_thread_new ("mock-logind", egg_idletime_mock_logind_thread, &mock);
+
+  connection = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (bus),
+                                                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                       NULL, NULL, NULL);
+
+  egg_idletime_set_source (EGG_IDLETIME_SOURCE_LOGIND, connection);
+  idletime = egg_idletime_new ();
+  g_signal_connect (idletime, "alarm-expired",
+        G_CALLBACK (gpm_logind_alarm_cb), &alarm);
+  g_signal_connect (idletime, "reset",
+        G_CALLBACK (gpm_logind_reset_cb), &resets);
+
+  /************************************************************/
+  egg_test_title (test, "check the session of this process is found");
+  if (idletime->priv->logind_proxy != NULL &&
+      mock.pid == (guint32) getpid ()) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "session proxy %p, asked for pid %u",
+                     idletime->priv->logind_proxy, mock.pid);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check the idle time is 0 while the session is active");
+  idle = egg_idletime_get_time (idletime);
+  if (idle == 0) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "idle for %" G_GINT64_FORMAT, idle);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check an alarm that is due goes off when the session goes idle");
+  egg_idletime_alarm_set (idletime, 101, 10000);
+  egg_idletime_mock_logind_set_idle (&mock, TRUE, g_get_monotonic_time () - 20 * G_USEC_PER_SEC);
+  egg_idletime_logind_test_wait (&alarm);
+  idle = egg_idletime_get_time (idletime);
+  if (alarm == 101 && idle >= 20000 && idle < 25000) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "alarm %i, idle for %" G_GINT64_FORMAT, alarm, idle);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check the session coming back resets the alarms");
+  egg_idletime_mock_logind_set_idle (&mock, FALSE, 0);
+  egg_idletime_logind_test_wait (&resets);
+  idle = egg_idletime_get_time (idletime);
+  if (resets == 1 && idle == 0) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "%i resets, idle for %" G_GINT64_FORMAT, resets, idle);
+  }
+
+  g_object_unref (idletime);
+
+  /* the self-test opens no display, so XSync can't work */
+  egg_idletime_set_source (EGG_IDLETIME_SOURCE_XSYNC, connection);
+  idletime = egg_idletime_new ();
+
+  /************************************************************/
+  egg_test_title (test, "check logind takes over when XSync is not available");
+  if (idletime->priv->backend == &egg_idletime_logind_backend &&
+      idletime->priv->logind_proxy != NULL) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "logind backend %i, session proxy %p",
+                     idletime->priv->backend == &egg_idletime_logind_backend,
+                     idletime->priv->logind_proxy);
+  }
+
+  g_object_unref (idletime);
+  egg_idletime_set_source (EGG_IDLETIME_SOURCE_XSYNC, NULL);
+  g_object_unref (connection);
+
+  g_main_loop_quit (mock.loop);
+  g_thread_join (thread);
+  g_dbus_connection_unregister_object (mock.service, manager_id);
+  g_dbus_connection_unregister_object (mock.service, session_id);
+  g_object_unref (mock.service);
+  g_dbus_node_info_unref (node);
+  g_main_loop_unref (mock.loop);
+  g_main_context_unref (mock.context);
+  g_mutex_clear (&mock.lock);
+
+  g_test_dbus_down (bus);
+  g_object_unref (bus);
+
+  egg_test_end (test);
+}
+
 #endif
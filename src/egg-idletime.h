@@ -23,6 +23,7 @@
 #define __EGG_IDLETIME_H
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -36,12 +37,18 @@ G_BEGIN_DECLS
 enum
 {
   TIMEOUT_INPUT = 0,
-  TIMEOUT_BRIGHTNESS_ON_AC,
-  TIMEOUT_BRIGHTNESS_ON_BATTERY,
-  TIMEOUT_INACTIVITY_ON_AC,
-  TIMEOUT_INACTIVITY_ON_BATTERY
+  TIMEOUT_IDLE_TIMELINE
 };
 
+#define EGG_IDLETIME_HISTOGRAM_BUCKETS 16
+
+typedef enum
+{
+  EGG_IDLETIME_SOURCE_XSYNC,
+  EGG_IDLETIME_SOURCE_LOGIND,
+  EGG_IDLETIME_SOURCE_VIRTUAL
+} EggIdletimeSource;
+
 typedef struct EggIdletimePrivate EggIdletimePrivate;
 
 typedef struct
@@ -61,14 +68,27 @@ typedef struct
 GType         egg_idletime_get_type           (void);
 EggIdletime  *egg_idletime_new                (void);
 void          egg_idletime_alarm_reset_all    (EggIdletime  *idletime);
+void          egg_idletime_alarm_set_reset    (EggIdletime  *idletime);
 gboolean      egg_idletime_alarm_set          (EggIdletime  *idletime,
                                                guint     alarm_id,
                                                guint     timeout);
 gboolean      egg_idletime_alarm_remove       (EggIdletime  *idletime,
                                                guint     alarm_id);
 gint64        egg_idletime_get_time           (EggIdletime  *idletime);
+gboolean      egg_idletime_set_source         (EggIdletimeSource source,
+                                               GDBusConnection *connection);
+const guint  *egg_idletime_get_histogram      (EggIdletime  *idletime);
+gint64        egg_idletime_get_last_period    (EggIdletime  *idletime);
+
+/* virtual clock, for testing */
+EggIdletime  *egg_idletime_new_virtual        (void);
+void          egg_idletime_virtual_advance    (EggIdletime  *idletime,
+                                               guint     time_ms);
+void          egg_idletime_virtual_activity   (EggIdletime  *idletime);
 #ifdef EGG_TEST
 void          egg_idletime_test               (gpointer   data);
+void          egg_idletime_virtual_test       (gpointer   data);
+void          egg_idletime_logind_test        (gpointer   data);
 #endif
 
 G_END_DECLS
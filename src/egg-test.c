@@ -0,0 +1,153 @@
+/*
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * The small harness the EGG_TEST blocks at the end of some sources are
+ * written against: a test is a titled check that either succeeds or
+ * fails, grouped under the name of the module being tested.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <glib.h>
+
+#include "egg-test.h"
+
+struct EggTest
+{
+	gchar		*name;
+	gchar		*title;
+	guint		 total;
+	guint		 failed;
+};
+
+/**
+ * egg_test_init:
+ **/
+EggTest *
+egg_test_init (void)
+{
+	return g_new0 (EggTest, 1);
+}
+
+/**
+ * egg_test_start:
+ **/
+gboolean
+egg_test_start (EggTest *test, const gchar *name)
+{
+	g_return_val_if_fail (test != NULL, FALSE);
+	g_return_val_if_fail (test->name == NULL, FALSE);
+
+	test->name = g_strdup (name);
+	g_print ("%s...\n", name);
+	return TRUE;
+}
+
+/**
+ * egg_test_end:
+ **/
+void
+egg_test_end (EggTest *test)
+{
+	g_return_if_fail (test != NULL);
+
+	g_clear_pointer (&test->name, g_free);
+	g_clear_pointer (&test->title, g_free);
+}
+
+/**
+ * egg_test_title:
+ **/
+void
+egg_test_title (EggTest *test, const gchar *format, ...)
+{
+	va_list args;
+
+	g_free (test->title);
+	va_start (args, format);
+	test->title = g_strdup_vprintf (format, args);
+	va_end (args);
+	test->total++;
+}
+
+static void
+egg_test_report (EggTest *test, const gchar *result, const gchar *format, va_list args)
+{
+	gchar *message = NULL;
+
+	if (format != NULL)
+		message = g_strdup_vprintf (format, args);
+
+	g_print ("  %s: %s%s%s\n", result,
+		 test->title ? test->title : "(untitled)",
+		 message ? ": " : "",
+		 message ? message : "");
+	g_free (message);
+}
+
+/**
+ * egg_test_success:
+ **/
+void
+egg_test_success (EggTest *test, const gchar *format, ...)
+{
+	va_list args;
+
+	va_start (args, format);
+	egg_test_report (test, "PASS", format, args);
+	va_end (args);
+}
+
+/**
+ * egg_test_failed:
+ *
+ * Doesn't abort, so one run reports every failure.
+ **/
+void
+egg_test_failed (EggTest *test, const gchar *format, ...)
+{
+	va_list args;
+
+	va_start (args, format);
+	egg_test_report (test, "FAIL", format, args);
+	va_end (args);
+	test->failed++;
+}
+
+/**
+ * egg_test_finish:
+ *
+ * Frees test, returns the exit status for the test program.
+ **/
+gint
+egg_test_finish (EggTest *test)
+{
+	gint retval;
+
+	g_print ("%u of %u checks passed\n", test->total - test->failed, test->total);
+	retval = test->failed == 0 ? 0 : 1;
+
+	g_free (test->name);
+	g_free (test->title);
+	g_free (test);
+	return retval;
+}
@@ -0,0 +1,45 @@
+/*
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __EGG_TEST_H
+#define __EGG_TEST_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct EggTest EggTest;
+
+EggTest   *egg_test_init       (void);
+gboolean   egg_test_start      (EggTest       *test,
+                                const gchar   *name);
+void       egg_test_end        (EggTest       *test);
+void       egg_test_title      (EggTest       *test,
+                                const gchar   *format,
+                                ...) G_GNUC_PRINTF (2, 3);
+void       egg_test_success    (EggTest       *test,
+                                const gchar   *format,
+                                ...) G_GNUC_PRINTF (2, 3);
+void       egg_test_failed     (EggTest       *test,
+                                const gchar   *format,
+                                ...) G_GNUC_PRINTF (2, 3);
+gint       egg_test_finish     (EggTest       *test);
+
+G_END_DECLS
+
+#endif /* __EGG_TEST_H */
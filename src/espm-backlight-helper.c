@@ -41,6 +41,8 @@
 #include <stdlib.h>
 #if defined(BACKEND_TYPE_FREEBSD)
 #include <sys/sysctl.h>
+#else
+#include "espm-backlight-sysfs.h"
 #endif
 
 #define EXIT_CODE_SUCCESS   0
@@ -49,11 +51,6 @@
 #define EXIT_CODE_INVALID_USER    4
 #define EXIT_CODE_NO_BRIGHTNESS_SWITCH  5
 
-#if !defined(BACKEND_TYPE_FREEBSD)
-#define BACKLIGHT_SYSFS_LOCATION  "/sys/class/backlight"
-#define BRIGHTNESS_SWITCH_LOCATION  "/sys/module/video/parameters/brightness_switch_enabled"
-#endif
-
 
 #if defined(BACKEND_TYPE_FREEBSD)
 gboolean
@@ -368,163 +365,240 @@ out:
   return retval;
 }
 #else
-typedef enum {
-  BACKLIGHT_TYPE_UNKNOWN,
-  BACKLIGHT_TYPE_FIRMWARE,
-  BACKLIGHT_TYPE_PLATFORM,
-  BACKLIGHT_TYPE_RAW
-} BacklightType;
-
-static BacklightType
-backlight_helper_get_type (const gchar *sysfs_path)
+/*
+ * Write a value to an already opened sysfs entry. Some drivers talk to
+ * the panel over I2C on every write, so nothing is written when the
+ * entry already holds the value. Reading it back is cheap, sysfs hands
+ * out the kernel's copy without asking the driver.
+ */
+static gboolean
+backlight_helper_write_fd (gint fd, const gchar *filename, gint value, GError **error)
 {
-  gboolean ret;
-  gchar *filename = NULL;
-  GError *error = NULL;
-  gchar *type_tmp = NULL;
-  BacklightType type = BACKLIGHT_TYPE_UNKNOWN;
-
-  filename = g_build_filename (sysfs_path,
-             "type", NULL);
-  ret = g_file_get_contents (filename,
-           &type_tmp,
-           NULL, &error);
-  if (!ret) {
-    if (error)
-    {
-      g_warning ("failed to get type: %s", error->message);
-      g_error_free (error);
-    }
-    goto out;
-  }
-  if (g_str_has_prefix (type_tmp, "platform")) {
-    type = BACKLIGHT_TYPE_PLATFORM;
-    goto out;
-  }
-  if (g_str_has_prefix (type_tmp, "firmware")) {
-    type = BACKLIGHT_TYPE_FIRMWARE;
-    goto out;
-  }
-  if (g_str_has_prefix (type_tmp, "raw")) {
-    type = BACKLIGHT_TYPE_RAW;
-    goto out;
+  gchar text[16];
+  gint retval;
+  gint length;
+
+  /* fails on write-only fds, those are always written */
+  if (espm_backlight_sysfs_read_fd (fd) == value)
+    return TRUE;
+
+  /* convert to text */
+  length = g_snprintf (text, sizeof (text), "%i", value);
+
+  /* write to device file, always from the start so the fd can be reused */
+  retval = pwrite (fd, text, length, 0);
+  if (retval != length) {
+    g_set_error (error, 1, 0, "writing '%s' to %s failed", text, filename);
+    return FALSE;
   }
-out:
-  g_free (filename);
-  g_free (type_tmp);
-  return type;
+
+  return TRUE;
 }
 
 /*
- * Find best backlight using the kernel-supplied backlight type
+ * Write a value to a sysfs entry
  */
-static gchar *
-backlight_helper_get_best_backlight (void)
+static gboolean
+backlight_helper_write (const gchar *filename, gint value, GError **error)
 {
-  const gchar *device_name;
-  const gchar *filename_tmp;
-  gchar *best_device = NULL;
-  gchar *filename = NULL;
-  GDir *dir = NULL;
-  GError *error = NULL;
-  GPtrArray *sysfs_paths = NULL;
-  BacklightType *backlight_types = NULL;
-  guint i;
+  gint fd = -1;
+  gboolean ret;
 
-  /* search the backlight devices and prefer the types:
-   * firmware -> platform -> raw */
-  dir = g_dir_open (BACKLIGHT_SYSFS_LOCATION, 0, &error);
-  if (dir == NULL) {
-    if (error)
-    {
-      g_warning ("failed to find any devices: %s", error->message);
-      g_error_free (error);
-    }
-    goto out;
-  }
-  sysfs_paths = g_ptr_array_new_with_free_func (g_free);
-  device_name = g_dir_read_name (dir);
-  while (device_name != NULL) {
-    filename = g_build_filename (BACKLIGHT_SYSFS_LOCATION,
-               device_name, NULL);
-    g_ptr_array_add (sysfs_paths, filename);
-    device_name = g_dir_read_name (dir);
+  fd = open (filename, O_RDWR);
+  if (fd < 0) {
+    g_set_error (error, 1, 0, "failed to open filename: %s", filename);
+    return FALSE;
   }
 
-  /* no backlights */
-  if (sysfs_paths->len == 0)
-    goto out;
+  ret = backlight_helper_write_fd (fd, filename, value, error);
 
-  /* find out the type of each backlight */
-  backlight_types = g_new0 (BacklightType, sysfs_paths->len);
-  for (i = 0; i < sysfs_paths->len; i++) {
-    filename_tmp = g_ptr_array_index (sysfs_paths, i);
-    backlight_types[i] = backlight_helper_get_type (filename_tmp);
-  }
+  close (fd);
+  return ret;
+}
 
-  /* any devices of type firmware -> platform -> raw? */
-  for (i = 0; i < sysfs_paths->len; i++) {
-    if (backlight_types[i] == BACKLIGHT_TYPE_FIRMWARE) {
-      best_device = g_strdup (g_ptr_array_index (sysfs_paths, i));
-      goto out;
+/*
+ * Read an integer value from a sysfs entry
+ */
+static gint
+backlight_helper_read (const gchar *filename, GError **error)
+{
+  gchar *contents = NULL;
+  gint value = -1;
+
+  if (!g_file_get_contents (filename, &contents, NULL, error))
+    return -1;
+
+  /* the brightness switch module parameter is a boolean */
+  if (contents[0] == 'N')
+    value = 0;
+  else if (contents[0] == 'Y')
+    value = 1;
+  else
+    value = atoi (contents);
+
+  g_free (contents);
+  return value;
+}
+
+/*
+ * Read from an entry kept open, falling back to reading the file
+ */
+static gint
+backlight_helper_read_fd (gint fd, const gchar *filename, GError **error)
+{
+  gint value;
+
+  if (fd < 0)
+    return backlight_helper_read (filename, error);
+
+  value = espm_backlight_sysfs_read_fd (fd);
+  if (value < 0)
+    g_set_error (error, 1, 0, "reading %s failed", filename);
+
+  return value;
+}
+
+/*
+ * Answer requests read line by line from stdin until it is closed, so
+ * a whole session only has to go through pkexec once. Every request
+ * gets exactly one reply line, either "OK <value>" or "ERR <message>".
+ * Without privileges only the get requests are answered.
+ */
+static gint
+backlight_helper_serve (const gchar *sysfs_path, gboolean privileged)
+{
+  gchar line[128];
+  gchar *brightness_file;
+  gchar *max_brightness_file;
+  gint brightness_fd;
+  gint max_brightness_fd;
+  gint retval = EXIT_CODE_SUCCESS;
+
+  /* replies go to a socket, make sure each one leaves as soon as it is complete */
+  setvbuf (stdout, NULL, _IOLBF, 0);
+
+  brightness_file = g_build_filename (sysfs_path, "brightness", NULL);
+  max_brightness_file = g_build_filename (sysfs_path, "max_brightness", NULL);
+
+  /* kept open for the whole session, a fade writes it many times a second */
+  brightness_fd = open (brightness_file, privileged ? O_RDWR : O_RDONLY);
+  max_brightness_fd = open (max_brightness_file, O_RDONLY);
+
+  while (fgets (line, sizeof (line), stdin) != NULL) {
+    GError *error = NULL;
+    gchar *command;
+    gchar *argument;
+    gchar *endptr = NULL;
+    gint64 value = -1;
+
+    command = g_strstrip (line);
+    argument = strchr (command, ' ');
+    if (argument != NULL) {
+      *argument++ = '\0';
+      value = g_ascii_strtoll (argument, &endptr, 10);
+      if (endptr == argument || *endptr != '\0' || value < 0 || value > G_MAXINT) {
+        g_print ("ERR invalid argument '%s'\n", argument);
+        continue;
+      }
     }
-  }
-  for (i = 0; i < sysfs_paths->len; i++) {
-    if (backlight_types[i] == BACKLIGHT_TYPE_PLATFORM) {
-      best_device = g_strdup (g_ptr_array_index (sysfs_paths, i));
-      goto out;
+
+    if (!privileged && g_str_has_prefix (command, "set-")) {
+      g_set_error (&error, 1, 0, "'%s' must be run through pkexec", command);
+    } else if (g_strcmp0 (command, "get-brightness") == 0) {
+      value = backlight_helper_read_fd (brightness_fd, brightness_file, &error);
+    } else if (g_strcmp0 (command, "get-max-brightness") == 0) {
+      value = backlight_helper_read_fd (max_brightness_fd, max_brightness_file, &error);
+    } else if (g_strcmp0 (command, "set-brightness") == 0 && argument != NULL) {
+      if (brightness_fd >= 0)
+        backlight_helper_write_fd (brightness_fd, brightness_file, (gint) value, &error);
+      else
+        backlight_helper_write (brightness_file, (gint) value, &error);
+    } else if (g_strcmp0 (command, "get-brightness-switch") == 0) {
+      value = backlight_helper_read (BRIGHTNESS_SWITCH_LOCATION, &error);
+    } else if (g_strcmp0 (command, "set-brightness-switch") == 0 && argument != NULL) {
+      backlight_helper_write (BRIGHTNESS_SWITCH_LOCATION, (gint) value, &error);
+    } else {
+      g_set_error (&error, 1, 0, "invalid request '%s'", command);
     }
-  }
-  for (i = 0; i < sysfs_paths->len; i++) {
-    if (backlight_types[i] == BACKLIGHT_TYPE_RAW) {
-      best_device = g_strdup (g_ptr_array_index (sysfs_paths, i));
-      goto out;
+
+    if (error != NULL) {
+      g_print ("ERR %s\n", error->message);
+      g_error_free (error);
+      retval = EXIT_CODE_FAILED;
+    } else {
+      g_print ("OK %d\n", (gint) value);
     }
   }
-out:
-  g_free (backlight_types);
-  if (sysfs_paths != NULL)
-    g_ptr_array_unref (sysfs_paths);
-  if (dir != NULL)
-    g_dir_close (dir);
-  return best_device;
+
+  if (brightness_fd >= 0)
+    close (brightness_fd);
+  if (max_brightness_fd >= 0)
+    close (max_brightness_fd);
+  g_free (brightness_file);
+  g_free (max_brightness_file);
+  return retval;
 }
 
 /*
- * Write a value to a sysfs entry
+ * Print every backlight device, one per line, the best one first:
+ * name, type, max brightness and brightness separated by tabs
  */
-static gboolean
-backlight_helper_write (const gchar *filename, gint value, GError **error)
+static gint
+backlight_helper_list (void)
 {
-  gchar *text = NULL;
-  gint retval;
-  gint length;
-  gint fd = -1;
-  gboolean ret = TRUE;
+  GPtrArray *devices;
+  gchar *best;
+  gchar *best_name = NULL;
+  guint i;
 
-  fd = open (filename, O_WRONLY);
-  if (fd < 0) {
-    ret = FALSE;
-    g_set_error (error, 1, 0, "failed to open filename: %s", filename);
-    goto out;
+  devices = espm_backlight_sysfs_list_devices ();
+  if (devices == NULL || devices->len == 0) {
+    puts ("No backlights were found on your system");
+    if (devices != NULL)
+      g_ptr_array_unref (devices);
+    return EXIT_CODE_FAILED;
   }
 
-  /* convert to text */
-  text = g_strdup_printf ("%i", value);
-  length = strlen (text);
+  best = espm_backlight_sysfs_get_best_backlight (FALSE);
+  if (best != NULL)
+    best_name = g_path_get_basename (best);
+
+  for (i = 0; i <= devices->len; i++) {
+    const gchar *name;
+    gchar *path;
+    gchar *filename;
+    gint max_brightness;
+    gint brightness;
+
+    /* the best device goes first, then the others in name order */
+    if (i == 0) {
+      if (best_name == NULL)
+        continue;
+      name = best_name;
+    } else {
+      name = g_ptr_array_index (devices, i - 1);
+      if (g_strcmp0 (name, best_name) == 0)
+        continue;
+    }
 
-  /* write to device file */
-  retval = write (fd, text, length);
-  if (retval != length) {
-    ret = FALSE;
-    g_set_error (error, 1, 0, "writing '%s' to %s failed", text, filename);
-    goto out;
+    path = g_build_filename (BACKLIGHT_SYSFS_LOCATION, name, NULL);
+    filename = g_build_filename (path, "max_brightness", NULL);
+    max_brightness = backlight_helper_read (filename, NULL);
+    g_free (filename);
+    filename = g_build_filename (path, "brightness", NULL);
+    brightness = backlight_helper_read (filename, NULL);
+    g_free (filename);
+
+    g_print ("%s\t%s\t%d\t%d\n", name,
+             espm_backlight_sysfs_get_type_name (path),
+             max_brightness, brightness);
+    g_free (path);
   }
-out:
-  if (fd >= 0)
-    close (fd);
-  g_free (text);
-  return ret;
+
+  g_free (best_name);
+  g_free (best);
+  g_ptr_array_unref (devices);
+  return EXIT_CODE_SUCCESS;
 }
 
 /*
@@ -545,6 +619,11 @@ main (gint argc, gchar *argv[])
   gboolean get_max_brightness = FALSE;
   gint set_brightness_switch = -1;
   gboolean get_brightness_switch = FALSE;
+  gboolean serve = FALSE;
+  gboolean batch = FALSE;
+  gboolean rescan = FALSE;
+  gboolean list = FALSE;
+  gchar *device = NULL;
   gchar *filename = NULL;
   gchar *filename_file = NULL;
   gchar *contents = NULL;
@@ -565,6 +644,21 @@ main (gint argc, gchar *argv[])
     { "get-brightness-switch", '\0', 0, G_OPTION_ARG_NONE, &get_brightness_switch,
                   /* command line argument */
       "Get the current setting of the ACPI video brightness switch handling", NULL },
+    { "serve", '\0', 0, G_OPTION_ARG_NONE, &serve,
+                  /* command line argument */
+      "Keep running and answer requests read from stdin", NULL },
+    { "batch", '\0', 0, G_OPTION_ARG_NONE, &batch,
+                  /* command line argument */
+      "Run the requests read from stdin, one per line, and exit", NULL },
+    { "rescan", '\0', 0, G_OPTION_ARG_NONE, &rescan,
+                  /* command line argument */
+      "Ignore the cached backlight device and look for the best one again", NULL },
+    { "list", '\0', 0, G_OPTION_ARG_NONE, &list,
+                  /* command line argument */
+      "List all backlight devices with their type, maximum and current brightness", NULL },
+    { "device", '\0', 0, G_OPTION_ARG_STRING, &device,
+                  /* command line argument */
+      "Use the named backlight device instead of the best one", "NAME" },
     { NULL }
   };
 
@@ -576,12 +670,19 @@ main (gint argc, gchar *argv[])
 
   /* no input */
   if (set_brightness == -1 && !get_brightness && !get_max_brightness &&
-      set_brightness_switch == -1 && !get_brightness_switch) {
+      set_brightness_switch == -1 && !get_brightness_switch && !serve && !batch && !rescan &&
+      !list) {
     puts ("No valid option was specified");
     retval = EXIT_CODE_ARGUMENTS_INVALID;
     goto out;
   }
 
+  /* reading sysfs needs no privileges */
+  if (list) {
+    retval = backlight_helper_list ();
+    goto out;
+  }
+
   /* for brightness switch modifications, check for existence of the sysfs entry */
   if (set_brightness_switch != -1 || get_brightness_switch) {
     ret = g_file_test (BRIGHTNESS_SWITCH_LOCATION, G_FILE_TEST_EXISTS);
@@ -591,14 +692,31 @@ main (gint argc, gchar *argv[])
       goto out;
     }
   } else {  /* find backlight device */
-    filename = backlight_helper_get_best_backlight ();
-    if (filename == NULL) {
-      puts ("No backlights were found on your system");
-      retval = EXIT_CODE_INVALID_USER;
-      goto out;
+    if (device != NULL) {
+      filename = espm_backlight_sysfs_get_device (device);
+      if (filename == NULL) {
+        g_print ("No backlight device named '%s'\n", device);
+        retval = EXIT_CODE_ARGUMENTS_INVALID;
+        goto out;
+      }
+    } else {
+      filename = espm_backlight_sysfs_get_best_backlight (rescan);
+      if (filename == NULL) {
+        puts ("No backlights were found on your system");
+        retval = EXIT_CODE_INVALID_USER;
+        goto out;
+      }
     }
   }
 
+  /* only refresh the cache, print what was found */
+  if (rescan && filename != NULL && set_brightness == -1 && !get_brightness &&
+      !get_max_brightness && !serve && !batch) {
+    g_print ("%s\n", filename);
+    retval = EXIT_CODE_SUCCESS;
+    goto out;
+  }
+
   /* get the current setting of the ACPI video brightness switch handling */
   if (get_brightness_switch) {
     ret = g_file_get_contents (BRIGHTNESS_SWITCH_LOCATION, &contents, NULL, &error);
@@ -661,6 +779,14 @@ main (gint argc, gchar *argv[])
   /* get calling process */
   uid = getuid ();
   euid = geteuid ();
+
+  /* anyone may batch reads, only the writes need pkexec */
+  if (batch) {
+    retval = backlight_helper_serve (filename, uid == 0 && euid == 0 &&
+                                     g_getenv ("PKEXEC_UID") != NULL);
+    goto out;
+  }
+
   if (uid != 0 || euid != 0) {
     puts ("This program can only be used by the root user");
     retval = EXIT_CODE_ARGUMENTS_INVALID;
@@ -675,6 +801,12 @@ main (gint argc, gchar *argv[])
     goto out;
   }
 
+  /* answer requests until the caller goes away */
+  if (serve) {
+    retval = backlight_helper_serve (filename, TRUE);
+    goto out;
+  }
+
   /* set the brightness level */
   if (set_brightness != -1) {
     filename_file = g_build_filename (filename, "brightness", NULL);
@@ -710,6 +842,7 @@ main (gint argc, gchar *argv[])
   /* success */
   retval = EXIT_CODE_SUCCESS;
 out:
+  g_free (device);
   g_free (filename);
   g_free (filename_file);
   g_free (contents);
@@ -38,7 +38,7 @@
 #include <libexpidus1util/libexpidus1util.h>
 
 #include "espm-backlight.h"
-#include "egg-idletime.h"
+#include "espm-idle-timeline.h"
 #include "espm-notify.h"
 #include "espm-esconf.h"
 #include "espm-power.h"
@@ -62,17 +62,23 @@ static void espm_backlight_set_property (GObject *object,
 
 #define ALARM_DISABLED 9
 
+/* brightness key presses are applied at most once per frame, in ms */
+#define KEY_FRAME_INTERVAL 16
+
 struct EspmBacklightPrivate
 {
   EspmBrightness *brightness;
   EspmPower      *power;
-  EggIdletime    *idle;
+  EspmIdleTimeline *timeline;
   EspmEsconf     *conf;
   EspmButton     *button;
   EspmNotify     *notify;
 
   NotifyNotification *n;
 
+  /* cancels brightness requests still running when we go away */
+  GCancellable   *cancellable;
+
   gboolean      has_hw;
   gboolean      on_battery;
 
@@ -81,6 +87,15 @@ struct EspmBacklightPrivate
 
   guint           brightness_step_count;
   gboolean        brightness_exponential;
+  gboolean        handle_brightness_keys;
+  gboolean        show_brightness_popup;
+
+  /* held brightness keys, only the latest target gets written */
+  gboolean        key_batch;
+  gint32          key_level;
+  gint32          key_applied_level;
+  guint           key_frame_id;
+  gboolean        key_request_running;
 
   gint            brightness_switch;
   gint            brightness_switch_save;
@@ -131,7 +146,7 @@ espm_backlight_dim_brightness (EspmBacklight *backlight)
     if (backlight->priv->last_level > dim_level)
     {
       ESPM_DEBUG ("Current brightness level before dimming : %d, new %d", backlight->priv->last_level, dim_level);
-      backlight->priv->dimmed = espm_brightness_set_level (backlight->priv->brightness, dim_level);
+      backlight->priv->dimmed = espm_brightness_transition_to (backlight->priv->brightness, dim_level);
     }
   }
 }
@@ -190,114 +205,254 @@ espm_backlight_show (EspmBacklight *backlight, gint level)
 
 
 static void
-espm_backlight_alarm_timeout_cb (EggIdletime *idle, guint id, EspmBacklight *backlight)
+espm_backlight_stage_reached_cb (EspmIdleTimeline *timeline, guint stage, EspmBacklight *backlight)
 {
-  backlight->priv->block = FALSE;
+  if ( stage != ESPM_IDLE_STAGE_DIM )
+    return;
 
-  if ( id == TIMEOUT_BRIGHTNESS_ON_AC && !backlight->priv->on_battery)
-    espm_backlight_dim_brightness (backlight);
-  else if ( id == TIMEOUT_BRIGHTNESS_ON_BATTERY && backlight->priv->on_battery)
-    espm_backlight_dim_brightness (backlight);
+  backlight->priv->block = FALSE;
+  espm_backlight_dim_brightness (backlight);
 }
 
 static void
-espm_backlight_reset_cb (EggIdletime *idle, EspmBacklight *backlight)
+espm_backlight_reset_cb (EspmIdleTimeline *timeline, EspmBacklight *backlight)
 {
   if ( backlight->priv->dimmed)
   {
     if ( !backlight->priv->block)
     {
       ESPM_DEBUG ("Alarm reset, setting level to %d", backlight->priv->last_level);
-      espm_brightness_set_level (backlight->priv->brightness, backlight->priv->last_level);
+      espm_brightness_transition_to (backlight->priv->brightness, backlight->priv->last_level);
     }
     backlight->priv->dimmed = FALSE;
   }
 }
 
 static void
-espm_backlight_button_pressed_cb (EspmButton *button, EspmButtonKey type, EspmBacklight *backlight)
+espm_backlight_level_changed_cb (EspmBrightness *brightness, gint level, EspmBacklight *backlight)
 {
-  gint32   level;
-  gboolean ret = TRUE;
-  gboolean handle_brightness_keys, show_popup;
-  guint    brightness_step_count;
-  gboolean brightness_exponential;
-
-  g_object_get (G_OBJECT (backlight->priv->conf),
-                HANDLE_BRIGHTNESS_KEYS, &handle_brightness_keys,
-                SHOW_BRIGHTNESS_POPUP, &show_popup,
-                BRIGHTNESS_STEP_COUNT, &brightness_step_count,
-                BRIGHTNESS_EXPONENTIAL, &brightness_exponential,
-                NULL);
-
-  if ( type != BUTTON_MON_BRIGHTNESS_UP && type != BUTTON_MON_BRIGHTNESS_DOWN )
-    return; /* sanity check, can this ever happen? */
+  /* the user changed the brightness themselves, e.g. with a firmware hotkey,
+   * so don't override their choice when the idle dimming is reset */
+  if ( backlight->priv->dimmed )
+  {
+    ESPM_DEBUG ("Brightness changed to %d while dimmed, not restoring %d", level, backlight->priv->last_level);
+    backlight->priv->dimmed = FALSE;
+  }
+}
 
-  backlight->priv->block = TRUE;
-  if ( !handle_brightness_keys )
-    ret = espm_brightness_get_level (backlight->priv->brightness, &level);
-  else
+static void
+espm_backlight_button_level_ready (EspmBacklight *backlight, gboolean ret, gint32 level, GError *error)
+{
+  if ( !ret )
   {
-    espm_brightness_set_step_count(backlight->priv->brightness,
-                                   brightness_step_count,
-                                   brightness_exponential);
-    if ( type == BUTTON_MON_BRIGHTNESS_UP )
-      ret = espm_brightness_up (backlight->priv->brightness, &level);
-    else
-      ret = espm_brightness_down (backlight->priv->brightness, &level);
+    /* when cancelled the backlight may already be gone, don't touch it */
+    if ( !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) )
+      ESPM_DEBUG ("Brightness key request failed: %s", error->message);
+    g_error_free (error);
+    return;
   }
-  if ( ret && show_popup)
+
+  if ( backlight->priv->show_brightness_popup )
     espm_backlight_show (backlight, level);
 }
 
 static void
-espm_backlight_brightness_on_ac_settings_changed (EspmBacklight *backlight)
+espm_backlight_get_level_cb (GObject *source, GAsyncResult *result, gpointer user_data)
 {
-  guint timeout_on_ac;
+  GError *error = NULL;
+  gint32 level = 0;
+  gboolean ret;
 
-  g_object_get (G_OBJECT (backlight->priv->conf),
-                BRIGHTNESS_ON_AC, &timeout_on_ac,
-                NULL);
+  ret = espm_brightness_get_level_finish (ESPM_BRIGHTNESS (source), result, &level, &error);
+  espm_backlight_button_level_ready (user_data, ret, level, error);
+}
+
+static void
+espm_backlight_up_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  GError *error = NULL;
+  gint32 level = 0;
+  gboolean ret;
+
+  ret = espm_brightness_up_finish (ESPM_BRIGHTNESS (source), result, &level, &error);
+  espm_backlight_button_level_ready (user_data, ret, level, error);
+}
+
+static void
+espm_backlight_down_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  GError *error = NULL;
+  gint32 level = 0;
+  gboolean ret;
 
-  ESPM_DEBUG ("Alarm on ac timeout changed %u", timeout_on_ac);
+  ret = espm_brightness_down_finish (ESPM_BRIGHTNESS (source), result, &level, &error);
+  espm_backlight_button_level_ready (user_data, ret, level, error);
+}
+
+static void espm_backlight_key_schedule (EspmBacklight *backlight);
+
+static void
+espm_backlight_key_batch_done (EspmBacklight *backlight)
+{
+  backlight->priv->key_batch = FALSE;
+
+  /* one popup for the whole batch */
+  if ( backlight->priv->show_brightness_popup )
+    espm_backlight_show (backlight, backlight->priv->key_applied_level);
+}
 
-  if ( timeout_on_ac == ALARM_DISABLED )
+static void
+espm_backlight_key_level_set_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  EspmBacklight *backlight;
+  GError *error = NULL;
+
+  if ( !espm_brightness_set_level_finish (ESPM_BRIGHTNESS (source), result, &error) )
   {
-    egg_idletime_alarm_remove (backlight->priv->idle, TIMEOUT_BRIGHTNESS_ON_AC );
+    /* cancelled in finalize, the backlight is already gone */
+    if ( g_cancellable_is_cancelled (g_task_get_cancellable (G_TASK (result))) )
+    {
+      g_error_free (error);
+      return;
+    }
+
+    ESPM_DEBUG ("Brightness key request failed: %s", error->message);
+    g_error_free (error);
   }
+
+  backlight = ESPM_BACKLIGHT (user_data);
+  backlight->priv->key_request_running = FALSE;
+
+  /* the key was pressed again while the hardware was busy */
+  if ( backlight->priv->key_level != backlight->priv->key_applied_level )
+    espm_backlight_key_schedule (backlight);
   else
+    espm_backlight_key_batch_done (backlight);
+}
+
+static gboolean
+espm_backlight_key_frame_cb (gpointer data)
+{
+  EspmBacklight *backlight = ESPM_BACKLIGHT (data);
+
+  backlight->priv->key_frame_id = 0;
+
+  /* already at the end of the range */
+  if ( backlight->priv->key_level == backlight->priv->key_applied_level )
   {
-    egg_idletime_alarm_set (backlight->priv->idle, TIMEOUT_BRIGHTNESS_ON_AC, timeout_on_ac * 1000);
+    espm_backlight_key_batch_done (backlight);
+    return FALSE;
   }
+
+  ESPM_DEBUG ("Applying brightness key level %d", backlight->priv->key_level);
+
+  backlight->priv->key_applied_level = backlight->priv->key_level;
+  backlight->priv->key_request_running = TRUE;
+  espm_brightness_set_level_async (backlight->priv->brightness, backlight->priv->key_level,
+                                   backlight->priv->cancellable,
+                                   espm_backlight_key_level_set_cb, backlight);
+
+  return FALSE;
 }
 
+/*
+ * Only one write is in flight at a time, presses arriving meanwhile just
+ * move the target and get picked up once it completes.
+ */
 static void
-espm_backlight_brightness_on_battery_settings_changed (EspmBacklight *backlight)
+espm_backlight_key_schedule (EspmBacklight *backlight)
 {
-  guint timeout_on_battery ;
+  if ( backlight->priv->key_frame_id != 0 || backlight->priv->key_request_running )
+    return;
 
-  g_object_get (G_OBJECT (backlight->priv->conf),
-                BRIGHTNESS_ON_BATTERY, &timeout_on_battery,
-                NULL);
+  backlight->priv->key_frame_id = g_timeout_add (KEY_FRAME_INTERVAL,
+                                                 espm_backlight_key_frame_cb,
+                                                 backlight);
+}
 
-  ESPM_DEBUG ("Alarm on battery timeout changed %u", timeout_on_battery);
+static void
+espm_backlight_button_pressed_cb (EspmButton *button, EspmButtonKey type, EspmBacklight *backlight)
+{
+  if ( type != BUTTON_MON_BRIGHTNESS_UP && type != BUTTON_MON_BRIGHTNESS_DOWN )
+    return; /* sanity check, can this ever happen? */
 
-  if ( timeout_on_battery == ALARM_DISABLED )
+  backlight->priv->block = TRUE;
+  if ( !backlight->priv->handle_brightness_keys )
   {
-    egg_idletime_alarm_remove (backlight->priv->idle, TIMEOUT_BRIGHTNESS_ON_BATTERY );
+    espm_brightness_get_level_async (backlight->priv->brightness, backlight->priv->cancellable,
+                                     espm_backlight_get_level_cb, backlight);
+    return;
   }
-  else
+
+  if ( !backlight->priv->key_batch )
   {
-    egg_idletime_alarm_set (backlight->priv->idle, TIMEOUT_BRIGHTNESS_ON_BATTERY, timeout_on_battery * 1000);
+    /* no trusted level to step from, let the hardware do a full step */
+    if ( !espm_brightness_peek_level (backlight->priv->brightness, &backlight->priv->key_level) )
+    {
+      if ( type == BUTTON_MON_BRIGHTNESS_UP )
+        espm_brightness_up_async (backlight->priv->brightness, backlight->priv->cancellable,
+                                  espm_backlight_up_cb, backlight);
+      else
+        espm_brightness_down_async (backlight->priv->brightness, backlight->priv->cancellable,
+                                    espm_backlight_down_cb, backlight);
+      return;
+    }
+
+    backlight->priv->key_batch = TRUE;
+    backlight->priv->key_applied_level = backlight->priv->key_level;
   }
+
+  /* the last press wins, it steps from the target of the previous ones */
+  backlight->priv->key_level = espm_brightness_next_level (backlight->priv->brightness,
+                                                           backlight->priv->key_level,
+                                                           type == BUTTON_MON_BRIGHTNESS_UP);
+  espm_backlight_key_schedule (backlight);
 }
 
+static void
+espm_backlight_key_settings_changed (EspmBacklight *backlight)
+{
+  g_object_get (G_OBJECT (backlight->priv->conf),
+                HANDLE_BRIGHTNESS_KEYS, &backlight->priv->handle_brightness_keys,
+                SHOW_BRIGHTNESS_POPUP, &backlight->priv->show_brightness_popup,
+                NULL);
+}
+
+static void
+espm_backlight_step_settings_changed (EspmBacklight *backlight)
+{
+  g_object_get (G_OBJECT (backlight->priv->conf),
+                BRIGHTNESS_STEP_COUNT, &backlight->priv->brightness_step_count,
+                BRIGHTNESS_EXPONENTIAL, &backlight->priv->brightness_exponential,
+                NULL);
 
+  ESPM_DEBUG ("Brightness step count %u, exponential %d",
+              backlight->priv->brightness_step_count,
+              backlight->priv->brightness_exponential);
+
+  espm_brightness_set_step_count (backlight->priv->brightness,
+                                  backlight->priv->brightness_step_count,
+                                  backlight->priv->brightness_exponential);
+}
+
+/*
+ * The timeline picks the timeout for the current power source
+ */
 static void
 espm_backlight_set_timeouts (EspmBacklight *backlight)
 {
-  espm_backlight_brightness_on_ac_settings_changed (backlight);
-  espm_backlight_brightness_on_battery_settings_changed (backlight);
+  guint timeout_on_ac, timeout_on_battery;
+
+  g_object_get (G_OBJECT (backlight->priv->conf),
+                BRIGHTNESS_ON_AC, &timeout_on_ac,
+                BRIGHTNESS_ON_BATTERY, &timeout_on_battery,
+                NULL);
+
+  ESPM_DEBUG ("Dim timeout on ac %u, on battery %u", timeout_on_ac, timeout_on_battery);
+
+  espm_idle_timeline_set_timeouts (backlight->priv->timeline, ESPM_IDLE_STAGE_DIM,
+                                   timeout_on_ac == ALARM_DISABLED ? 0 : timeout_on_ac * 1000,
+                                   timeout_on_battery == ALARM_DISABLED ? 0 : timeout_on_battery * 1000);
 }
 
 static void
@@ -337,20 +492,36 @@ espm_backlight_class_init (EspmBacklightClass *klass)
 static void
 espm_backlight_init (EspmBacklight *backlight)
 {
+  gchar *device;
+
   backlight->priv = espm_backlight_get_instance_private (backlight);
 
   backlight->priv->brightness = espm_brightness_new ();
+
+  /* hidden setting to pick one of several sysfs backlights, e.g. when docked */
+  device = esconf_channel_get_string (esconf_channel_get (ESPM_CHANNEL),
+                                      ESPM_PROPERTIES_PREFIX BRIGHTNESS_DEVICE, NULL);
+  if ( device != NULL && device[0] != '\0' )
+    espm_brightness_set_device (backlight->priv->brightness, device);
+  g_free (device);
+
   backlight->priv->has_hw     = espm_brightness_setup (backlight->priv->brightness);
 
   backlight->priv->notify = NULL;
-  backlight->priv->idle   = NULL;
+  backlight->priv->timeline = NULL;
   backlight->priv->conf   = NULL;
   backlight->priv->button = NULL;
   backlight->priv->power    = NULL;
+  backlight->priv->cancellable = g_cancellable_new ();
   backlight->priv->dimmed = FALSE;
   backlight->priv->block = FALSE;
   backlight->priv->brightness_step_count = 10;
   backlight->priv->brightness_exponential = FALSE;
+  backlight->priv->handle_brightness_keys = TRUE;
+  backlight->priv->show_brightness_popup = TRUE;
+  backlight->priv->key_batch = FALSE;
+  backlight->priv->key_frame_id = 0;
+  backlight->priv->key_request_running = FALSE;
   backlight->priv->brightness_switch_initialized = FALSE;
 
   if ( !backlight->priv->has_hw )
@@ -362,7 +533,7 @@ espm_backlight_init (EspmBacklight *backlight)
   {
     gboolean ret, handle_keys;
 
-    backlight->priv->idle   = egg_idletime_new ();
+    backlight->priv->timeline = espm_idle_timeline_new ();
     backlight->priv->conf   = espm_esconf_new ();
     backlight->priv->button = espm_button_new ();
     backlight->priv->power    = espm_power_get ();
@@ -421,18 +592,20 @@ espm_backlight_init (EspmBacklight *backlight)
             backlight->priv->brightness_switch,
             NULL);
 
-    g_signal_connect (backlight->priv->idle, "alarm-expired",
-                      G_CALLBACK (espm_backlight_alarm_timeout_cb), backlight);
-    g_signal_connect (backlight->priv->idle, "reset",
+    g_signal_connect (backlight->priv->timeline, "stage-reached",
+                      G_CALLBACK (espm_backlight_stage_reached_cb), backlight);
+    g_signal_connect (backlight->priv->timeline, "reset",
                       G_CALLBACK(espm_backlight_reset_cb), backlight);
     g_signal_connect (backlight->priv->button, "button-pressed",
                       G_CALLBACK (espm_backlight_button_pressed_cb), backlight);
     g_signal_connect_swapped (backlight->priv->conf, "notify::" BRIGHTNESS_ON_AC,
-                              G_CALLBACK (espm_backlight_brightness_on_ac_settings_changed), backlight);
+                              G_CALLBACK (espm_backlight_set_timeouts), backlight);
     g_signal_connect_swapped (backlight->priv->conf, "notify::" BRIGHTNESS_ON_BATTERY,
-                              G_CALLBACK (espm_backlight_brightness_on_battery_settings_changed), backlight);
+                              G_CALLBACK (espm_backlight_set_timeouts), backlight);
     g_signal_connect (backlight->priv->power, "on-battery-changed",
                       G_CALLBACK (espm_backlight_on_battery_changed_cb), backlight);
+    g_signal_connect (backlight->priv->brightness, "level-changed",
+                      G_CALLBACK (espm_backlight_level_changed_cb), backlight);
 
     g_object_get (G_OBJECT (backlight->priv->power),
                   "on-battery", &backlight->priv->on_battery,
@@ -440,15 +613,31 @@ espm_backlight_init (EspmBacklight *backlight)
     espm_brightness_get_level (backlight->priv->brightness, &backlight->priv->last_level);
     espm_backlight_set_timeouts (backlight);
 
-    /* setup step count */
-    backlight->priv->brightness_step_count =
-        esconf_channel_get_int (espm_esconf_get_channel(backlight->priv->conf),
-                                ESPM_PROPERTIES_PREFIX BRIGHTNESS_STEP_COUNT,
-                                10);
-    backlight->priv->brightness_exponential =
+    /* setup step count, the step table is only rebuilt when these change */
+    espm_backlight_step_settings_changed (backlight);
+    g_signal_connect_swapped (backlight->priv->conf, "notify::" BRIGHTNESS_STEP_COUNT,
+                              G_CALLBACK (espm_backlight_step_settings_changed), backlight);
+    g_signal_connect_swapped (backlight->priv->conf, "notify::" BRIGHTNESS_EXPONENTIAL,
+                              G_CALLBACK (espm_backlight_step_settings_changed), backlight);
+
+    /* don't query esconf on every key press */
+    espm_backlight_key_settings_changed (backlight);
+    g_signal_connect_swapped (backlight->priv->conf, "notify::" HANDLE_BRIGHTNESS_KEYS,
+                              G_CALLBACK (espm_backlight_key_settings_changed), backlight);
+    g_signal_connect_swapped (backlight->priv->conf, "notify::" SHOW_BRIGHTNESS_POPUP,
+                              G_CALLBACK (espm_backlight_key_settings_changed), backlight);
+
+    /* hidden setting to read back every brightness step from the hardware */
+    espm_brightness_set_verify_writes (backlight->priv->brightness,
         esconf_channel_get_bool (espm_esconf_get_channel(backlight->priv->conf),
-                                 ESPM_PROPERTIES_PREFIX BRIGHTNESS_EXPONENTIAL,
-                                 FALSE);
+                                 ESPM_PROPERTIES_PREFIX BRIGHTNESS_VERIFY_WRITES,
+                                 FALSE));
+
+    /* hidden setting for the length of the dim and restore fades, in ms */
+    espm_brightness_set_transition_duration (backlight->priv->brightness,
+        esconf_channel_get_uint (espm_esconf_get_channel(backlight->priv->conf),
+                                 ESPM_PROPERTIES_PREFIX BRIGHTNESS_TRANSITION_DURATION,
+                                 250));
   }
 }
 
@@ -515,10 +704,19 @@ espm_backlight_finalize (GObject *object)
 
   backlight = ESPM_BACKLIGHT (object);
 
+  if ( backlight->priv->key_frame_id != 0 )
+    g_source_remove (backlight->priv->key_frame_id);
+
+  g_cancellable_cancel (backlight->priv->cancellable);
+  g_object_unref (backlight->priv->cancellable);
+
   espm_backlight_destroy_popup (backlight);
 
-  if ( backlight->priv->idle )
-    g_object_unref (backlight->priv->idle);
+  if ( backlight->priv->timeline )
+  {
+    g_signal_handlers_disconnect_by_data (backlight->priv->timeline, backlight);
+    g_object_unref (backlight->priv->timeline);
+  }
 
   if ( backlight->priv->conf )
   {
@@ -546,7 +744,10 @@ espm_backlight_finalize (GObject *object)
   }
 
   if ( backlight->priv->brightness )
+  {
+    g_signal_handlers_disconnect_by_data (backlight->priv->brightness, backlight);
     g_object_unref (backlight->priv->brightness);
+  }
 
   if ( backlight->priv->button )
     g_object_unref (backlight->priv->button);
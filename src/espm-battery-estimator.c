@@ -0,0 +1,346 @@
+/*
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "espm-battery-estimator.h"
+
+/* time constant of the averaged rate, in seconds */
+#define ESPM_BATTERY_RATE_TAU          300
+/* samples further apart than this start over */
+#define ESPM_BATTERY_RATE_MAX_GAP      (30 * 60)
+/* a rate this many times off the average is an outlier */
+#define ESPM_BATTERY_RATE_OUTLIER      4.0
+/* this many outliers in a row mean the load really changed */
+#define ESPM_BATTERY_RATE_MAX_REJECT   3
+/* rates needed before our estimate replaces UPower's */
+#define ESPM_BATTERY_RATE_MIN_SAMPLES  2
+
+void
+espm_battery_estimator_reset (EspmBatteryEstimator *est,
+                              gboolean charging,
+                              gint64 now,
+                              gdouble level)
+{
+  est->charging   = charging;
+  est->aligned    = FALSE;
+  est->last_time  = now;
+  est->last_level = level;
+  est->rate       = 0.0;
+  est->samples    = 0;
+  est->rejected   = 0;
+}
+
+/*
+ * Feed a level reading taken at now (in seconds).
+ */
+void
+espm_battery_estimator_sample (EspmBatteryEstimator *est,
+                               gboolean charging,
+                               gint64 now,
+                               gdouble level)
+{
+  gdouble rate;
+  gint64 dt;
+
+  if ( est->last_time == 0 || charging != est->charging ||
+       now - est->last_time > ESPM_BATTERY_RATE_MAX_GAP )
+  {
+    espm_battery_estimator_reset (est, charging, now, level);
+    return;
+  }
+
+  /* the level moves in steps, only measure from one step to the next */
+  if ( level == est->last_level )
+    return;
+
+  dt = now - est->last_time;
+  rate = charging ? level - est->last_level : est->last_level - level;
+  est->last_time = now;
+  est->last_level = level;
+
+  /* the first step came after an unknown part of its interval */
+  if ( !est->aligned )
+  {
+    est->aligned = TRUE;
+    return;
+  }
+
+  /* going the wrong way, e.g. the battery recalibrated */
+  if ( dt <= 0 || rate <= 0.0 )
+    return;
+
+  rate /= dt;
+
+  if ( est->samples > 0 &&
+       ( rate > est->rate * ESPM_BATTERY_RATE_OUTLIER ||
+         rate < est->rate / ESPM_BATTERY_RATE_OUTLIER ) )
+  {
+    if ( ++est->rejected < ESPM_BATTERY_RATE_MAX_REJECT )
+      return;
+
+    est->samples = 0;
+  }
+
+  est->rejected = 0;
+  if ( est->samples == 0 )
+    est->rate = rate;
+  else
+    est->rate += (rate - est->rate) * dt / (gdouble) (ESPM_BATTERY_RATE_TAU + dt);
+  est->samples++;
+}
+
+/*
+ * Seconds from now until level reaches 0 or full, -1 if there is no
+ * estimate yet. The level only moves in steps, so the time since the
+ * last step is taken off at the averaged rate.
+ */
+gint64
+espm_battery_estimator_remaining (EspmBatteryEstimator *est,
+                                  gdouble level,
+                                  gdouble full,
+                                  gint64 now)
+{
+  gdouble left;
+
+  if ( est->samples < ESPM_BATTERY_RATE_MIN_SAMPLES || est->rate <= 0.0 )
+    return -1;
+
+  left = est->charging ? full - level : level;
+  if ( now > est->last_time )
+    left -= est->rate * (now - est->last_time);
+  if ( left < 0.0 )
+    left = 0.0;
+
+  return (gint64) (left / est->rate);
+}
+
+
+/***************************************************************************
+ ***                          MAKE CHECK TESTS                           ***
+ ***************************************************************************/
+#ifdef EGG_TEST
+#include "egg-test.h"
+
+typedef struct
+{
+  gint64   time;
+  gdouble  level;
+  gdouble  full;
+  guint64  raw;     /* what UPower said, in seconds */
+} EspmBatteryTraceSample;
+
+/*
+ * A 50Wh battery at about 8W with a burst of load every 10 minutes.
+ * Made up, so it only shows the smoothing works as intended; how the
+ * estimate does on real hardware needs a trace recorded there.
+ */
+static GArray *
+espm_battery_trace_synthetic (void)
+{
+  GArray *trace;
+  GRand *rand;
+  EspmBatteryTraceSample sample;
+  gdouble energy = 50.0;
+  gdouble power;
+  gint64 t;
+
+  trace = g_array_new (FALSE, FALSE, sizeof (EspmBatteryTraceSample));
+  rand = g_rand_new_with_seed (1);
+
+  for ( t = 1; energy > 0.0; t += 5 )
+  {
+    power = 8.0 + g_rand_double_range (rand, -1.0, 1.0);
+    if ( t % 600 < 60 )
+      power += 17.0;
+    energy -= power * 5 / 3600.0;
+
+    sample.time  = t;
+    sample.level = energy > 0.0 ? (gint) (energy * 10) / 10.0 : 0.0;
+    sample.full  = 50.0;
+    sample.raw   = (guint64) (MAX (energy, 0.0) / power * 3600);
+    g_array_append_val (trace, sample);
+  }
+
+  g_rand_free (rand);
+  return trace;
+}
+
+/*
+ * One "seconds level full raw-time-to-empty" sample per line, ending
+ * empty. No recorded trace ships with the sources, ESPM_BATTERY_TRACE
+ * names one taken from UPower on the machine at hand.
+ */
+static GArray *
+espm_battery_trace_load (const gchar *filename)
+{
+  GArray *trace;
+  EspmBatteryTraceSample sample;
+  gchar *contents = NULL;
+  gchar **lines;
+  guint i;
+
+  if ( !g_file_get_contents (filename, &contents, NULL, NULL) )
+    return NULL;
+
+  trace = g_array_new (FALSE, FALSE, sizeof (EspmBatteryTraceSample));
+  lines = g_strsplit (contents, "\n", -1);
+  for ( i = 0; lines[i] != NULL; i++ )
+  {
+    if ( sscanf (lines[i], "%" G_GINT64_FORMAT " %lf %lf %" G_GUINT64_FORMAT,
+                 &sample.time, &sample.level, &sample.full, &sample.raw) == 4 )
+      g_array_append_val (trace, sample);
+  }
+
+  g_strfreev (lines);
+  g_free (contents);
+  return trace;
+}
+
+/*
+ * Replays a discharge trace, the real time left at each sample is the
+ * time until the end of the trace.  Returns the mean absolute error of
+ * our estimate and of UPower's, and how far each moves between samples.
+ */
+static void
+espm_battery_trace_replay (GArray *trace,
+                           gdouble *error, gdouble *raw_error,
+                           gdouble *jitter, gdouble *raw_jitter)
+{
+  EspmBatteryEstimator est = { 0 };
+  EspmBatteryTraceSample *sample;
+  gint64 end, estimate, last = -1;
+  guint i;
+
+  *error = *raw_error = *jitter = *raw_jitter = 0.0;
+  end = g_array_index (trace, EspmBatteryTraceSample, trace->len - 1).time;
+
+  for ( i = 0; i < trace->len; i++ )
+  {
+    sample = &g_array_index (trace, EspmBatteryTraceSample, i);
+    espm_battery_estimator_sample (&est, FALSE, sample->time, sample->level);
+    estimate = espm_battery_estimator_remaining (&est, sample->level, sample->full, sample->time);
+    if ( estimate < 0 )
+      estimate = sample->raw;
+
+    *error += ABS (estimate - (end - sample->time));
+    *raw_error += ABS ((gint64) sample->raw - (end - sample->time));
+    if ( i > 0 )
+    {
+      *jitter += ABS (estimate - last);
+      *raw_jitter += ABS ((gint64) sample->raw -
+                          (gint64) g_array_index (trace, EspmBatteryTraceSample, i - 1).raw);
+    }
+    last = estimate;
+  }
+
+  *error /= trace->len;
+  *raw_error /= trace->len;
+  *jitter /= trace->len;
+  *raw_jitter /= trace->len;
+}
+
+void
+espm_battery_estimator_test (gpointer data)
+{
+  EspmBatteryEstimator est = { 0 };
+  GArray *trace;
+  const gchar *filename;
+  gdouble error, raw_error, jitter, raw_jitter;
+  EggTest *test = (EggTest *) data;
+
+  if (egg_test_start (test, "EspmBatteryEstimator") == FALSE)
+    return;
+
+  /************************************************************/
+  egg_test_title (test, "check there is no estimate from a single step");
+  espm_battery_estimator_sample (&est, FALSE, 100, 50.0);
+  espm_battery_estimator_sample (&est, FALSE, 150, 49.0);
+  espm_battery_estimator_sample (&est, FALSE, 278, 48.0);
+  if (espm_battery_estimator_remaining (&est, 48.0, 50.0, 278) == -1) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "estimate from %u rates", est.samples);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check a steady discharge is estimated exactly");
+  espm_battery_estimator_sample (&est, FALSE, 406, 47.0);
+  if (espm_battery_estimator_remaining (&est, 47.0, 50.0, 406) == 6016) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "estimate %" G_GINT64_FORMAT " != 6016",
+                     espm_battery_estimator_remaining (&est, 47.0, 50.0, 406));
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check a single outlier is ignored");
+  espm_battery_estimator_sample (&est, FALSE, 416, 46.0);
+  if (espm_battery_estimator_remaining (&est, 46.0, 50.0, 416) == 5888) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "rate changed to %f", est.rate);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check the estimate runs down between steps");
+  if (espm_battery_estimator_remaining (&est, 46.0, 50.0, 544) == 5760) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "estimate %" G_GINT64_FORMAT " != 5760",
+                     espm_battery_estimator_remaining (&est, 46.0, 50.0, 544));
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check charging starts a new estimate");
+  espm_battery_estimator_sample (&est, TRUE, 500, 46.0);
+  if (espm_battery_estimator_remaining (&est, 46.0, 50.0, 500) == -1) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "kept the discharge rate");
+  }
+
+  /************************************************************/
+  filename = g_getenv ("ESPM_BATTERY_TRACE");
+  egg_test_title (test, "replay %s against UPower's estimate",
+                  filename != NULL ? filename : "a synthetic trace");
+  trace = filename != NULL ? espm_battery_trace_load (filename) : espm_battery_trace_synthetic ();
+  if (trace == NULL || trace->len == 0) {
+    egg_test_failed (test, "could not load %s", filename);
+  } else {
+    espm_battery_trace_replay (trace, &error, &raw_error, &jitter, &raw_jitter);
+    if (error <= raw_error) {
+      egg_test_success (test, "error %.0fs (UPower %.0fs), jitter %.1fs (UPower %.1fs)",
+                        error, raw_error, jitter, raw_jitter);
+    } else {
+      egg_test_failed (test, "error %.0fs worse than UPower %.0fs", error, raw_error);
+    }
+  }
+  if (trace != NULL)
+    g_array_free (trace, TRUE);
+
+  egg_test_end (test);
+}
+
+#endif
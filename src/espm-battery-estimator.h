@@ -0,0 +1,59 @@
+/*
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __ESPM_BATTERY_ESTIMATOR_H
+#define __ESPM_BATTERY_ESTIMATOR_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Follows the battery level over time with an exponentially
+ * weighted rate, in level units per second.
+ */
+typedef struct
+{
+  gboolean                charging;
+  gboolean                aligned;
+  gint64                  last_time;
+  gdouble                 last_level;
+  gdouble                 rate;
+  guint                   samples;
+  guint                   rejected;
+} EspmBatteryEstimator;
+
+void    espm_battery_estimator_reset     (EspmBatteryEstimator *est,
+                                          gboolean              charging,
+                                          gint64                now,
+                                          gdouble               level);
+void    espm_battery_estimator_sample    (EspmBatteryEstimator *est,
+                                          gboolean              charging,
+                                          gint64                now,
+                                          gdouble               level);
+gint64  espm_battery_estimator_remaining (EspmBatteryEstimator *est,
+                                          gdouble               level,
+                                          gdouble               full,
+                                          gint64                now);
+#ifdef EGG_TEST
+void    espm_battery_estimator_test      (gpointer              data);
+#endif
+
+G_END_DECLS
+
+#endif /* __ESPM_BATTERY_ESTIMATOR_H */
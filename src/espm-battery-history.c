@@ -0,0 +1,497 @@
+/*
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Charge history of one battery, a fixed ring of samples in a file
+ * under the user's cache directory. The file is mapped as it is, so
+ * the history is back after a restart without any parsing. Samples
+ * are kept in time order so ranges can be found by bisection.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_FILE_H
+#include <sys/file.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "espm-battery-history.h"
+#include "espm-debug.h"
+
+#define HISTORY_MAGIC     0x48505345 /* "ESPH" */
+#define HISTORY_VERSION   1
+/* at one sample a minute this is almost six days */
+#define HISTORY_CAPACITY  8192
+
+/* sharing the file needs a lock, without one the history stays in memory */
+#if defined (HAVE_SYS_MMAN_H) && defined (HAVE_SYS_FILE_H)
+#define HISTORY_USE_MMAP
+#endif
+
+/* four samples to a cache line */
+typedef struct
+{
+  guint32                   timestamp;    /* seconds since the epoch */
+  gfloat                    percentage;
+  gfloat                    energy_rate;  /* W */
+  guint32                   state;        /* UpDeviceState */
+} EspmBatterySample;
+
+typedef struct
+{
+  guint32                   magic;
+  guint32                   version;
+  guint32                   capacity;
+  guint32                   head;         /* where the next sample goes */
+  guint32                   count;
+  guint32                   reserved[11];
+} EspmBatteryHistoryHeader;
+
+typedef struct
+{
+  EspmBatteryHistoryHeader  header;
+  EspmBatterySample         samples[HISTORY_CAPACITY];
+} EspmBatteryHistoryFile;
+
+G_STATIC_ASSERT (sizeof (EspmBatterySample) == 16);
+G_STATIC_ASSERT (sizeof (EspmBatteryHistoryHeader) == 64);
+
+struct EspmBatteryHistory
+{
+  EspmBatteryHistoryFile   *file;
+  gboolean                  mapped;
+  int                       fd;           /* holds the lock while mapped */
+};
+
+/* the i-th oldest sample */
+static EspmBatterySample *
+espm_battery_history_nth (EspmBatteryHistory *history, guint i)
+{
+  EspmBatteryHistoryHeader *header = &history->file->header;
+
+  return &history->file->samples[(header->head + HISTORY_CAPACITY - header->count + i) % HISTORY_CAPACITY];
+}
+
+/* index of the first sample not before time, count if there is none */
+static guint
+espm_battery_history_find (EspmBatteryHistory *history, gint64 time)
+{
+  guint low, high, mid;
+
+  low = 0;
+  high = history->file->header.count;
+  while ( low < high )
+  {
+    mid = low + (high - low) / 2;
+    if ( espm_battery_history_nth (history, mid)->timestamp < time )
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+#ifdef EGG_TEST
+/* the self-tests keep their histories in a temporary directory */
+static gchar *history_location = NULL;
+
+void
+espm_battery_history_set_location (const gchar *location)
+{
+  g_free (history_location);
+  history_location = g_strdup (location);
+}
+#endif
+
+#ifdef HISTORY_USE_MMAP
+static EspmBatteryHistoryFile *
+espm_battery_history_map (const gchar *name, int *fd_out)
+{
+  EspmBatteryHistoryFile *file = NULL;
+  gchar *dir, *basename, *filename;
+  gpointer map;
+  int fd = -1;
+
+#ifdef EGG_TEST
+  if ( history_location != NULL )
+    dir = g_strdup (history_location);
+  else
+#endif
+    dir = g_build_filename (g_get_user_cache_dir (), "expidus1-power-manager", NULL);
+  basename = g_strdup_printf ("history-%s.dat", name);
+  filename = g_build_filename (dir, basename, NULL);
+
+  if ( g_mkdir_with_parents (dir, 0700) != 0 )
+  {
+    g_warning ("Unable to create %s: %s", dir, g_strerror (errno));
+    goto out;
+  }
+
+  fd = g_open (filename, O_RDWR | O_CREAT, 0600);
+  if ( fd < 0 )
+  {
+    g_warning ("Unable to open %s: %s", filename, g_strerror (errno));
+    goto out;
+  }
+
+  /* another instance, e.g. in a second session, owns the file */
+  if ( flock (fd, LOCK_EX | LOCK_NB) != 0 )
+  {
+    if ( errno == EWOULDBLOCK )
+      ESPM_DEBUG ("%s is in use, keeping the history in memory", filename);
+    else
+      g_warning ("Unable to lock %s: %s", filename, g_strerror (errno));
+    goto out;
+  }
+
+  if ( ftruncate (fd, sizeof (EspmBatteryHistoryFile)) != 0 )
+  {
+    g_warning ("Unable to resize %s: %s", filename, g_strerror (errno));
+    goto out;
+  }
+
+  map = mmap (NULL, sizeof (EspmBatteryHistoryFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if ( map == MAP_FAILED )
+  {
+    g_warning ("Unable to map %s: %s", filename, g_strerror (errno));
+    goto out;
+  }
+
+  file = map;
+  *fd_out = fd;
+  fd = -1;
+
+out:
+  /* closing also drops the lock */
+  if ( fd >= 0 )
+    close (fd);
+  g_free (filename);
+  g_free (basename);
+  g_free (dir);
+  return file;
+}
+#endif
+
+/*
+ * Whether the header is ours and the samples are in time order, the
+ * bisection in get_range relies on that.
+ */
+static gboolean
+espm_battery_history_valid (EspmBatteryHistory *history)
+{
+  EspmBatteryHistoryHeader *header = &history->file->header;
+  guint i;
+
+  if ( header->magic != HISTORY_MAGIC ||
+       header->version != HISTORY_VERSION ||
+       header->capacity != HISTORY_CAPACITY ||
+       header->head >= HISTORY_CAPACITY ||
+       header->count > HISTORY_CAPACITY )
+    return FALSE;
+
+  for ( i = 1; i < header->count; i++ )
+  {
+    if ( espm_battery_history_nth (history, i)->timestamp <
+         espm_battery_history_nth (history, i - 1)->timestamp )
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+EspmBatteryHistory *
+espm_battery_history_open (const gchar *name)
+{
+  EspmBatteryHistory *history;
+  EspmBatteryHistoryHeader *header;
+#ifdef HISTORY_USE_MMAP
+  gchar *canon;
+#endif
+
+  history = g_new0 (EspmBatteryHistory, 1);
+  history->fd = -1;
+
+#ifdef HISTORY_USE_MMAP
+  canon = g_strcanon (g_strdup (name), G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "-_", '_');
+  history->file = espm_battery_history_map (canon, &history->fd);
+  history->mapped = history->file != NULL;
+  g_free (canon);
+#endif
+
+  /* keep it for this session only */
+  if ( history->file == NULL )
+    history->file = g_new0 (EspmBatteryHistoryFile, 1);
+
+  header = &history->file->header;
+  if ( !espm_battery_history_valid (history) )
+  {
+    ESPM_DEBUG ("Starting a new battery history for %s", name);
+    memset (history->file, 0, sizeof (EspmBatteryHistoryFile));
+    header->magic    = HISTORY_MAGIC;
+    header->version  = HISTORY_VERSION;
+    header->capacity = HISTORY_CAPACITY;
+  }
+
+  /* the clock was ahead when these were taken */
+  espm_battery_history_drop_after (history, g_get_real_time () / G_USEC_PER_SEC);
+
+  return history;
+}
+
+void
+espm_battery_history_close (EspmBatteryHistory *history)
+{
+  if ( history == NULL )
+    return;
+
+#ifdef HISTORY_USE_MMAP
+  if ( history->mapped )
+  {
+    munmap (history->file, sizeof (EspmBatteryHistoryFile));
+    close (history->fd);
+  }
+  else
+#endif
+    g_free (history->file);
+
+  g_free (history);
+}
+
+void
+espm_battery_history_add (EspmBatteryHistory *history,
+                          gint64 timestamp,
+                          gdouble percentage,
+                          gdouble energy_rate,
+                          guint state)
+{
+  EspmBatteryHistoryHeader *header = &history->file->header;
+  EspmBatterySample *sample;
+  gint64 last;
+
+  /* if the clock went back, keep the samples in order */
+  last = espm_battery_history_get_last (history);
+  if ( timestamp < last )
+    timestamp = last;
+
+  sample = &history->file->samples[header->head];
+  sample->timestamp   = (guint32) CLAMP (timestamp, 0, G_MAXUINT32);
+  sample->percentage  = percentage;
+  sample->energy_rate = energy_rate;
+  sample->state       = state;
+
+  header->head = (header->head + 1) % HISTORY_CAPACITY;
+  if ( header->count < HISTORY_CAPACITY )
+    header->count++;
+}
+
+/*
+ * Time of the newest sample, 0 if there are none.
+ */
+gint64
+espm_battery_history_get_last (EspmBatteryHistory *history)
+{
+  if ( history->file->header.count == 0 )
+    return 0;
+
+  return espm_battery_history_nth (history, history->file->header.count - 1)->timestamp;
+}
+
+/*
+ * Samples from from to to, both included, as a floating a(tddu) of
+ * timestamp, percentage, energy rate and UpDeviceState.
+ */
+GVariant *
+espm_battery_history_get_range (EspmBatteryHistory *history,
+                                gint64 from,
+                                gint64 to)
+{
+  EspmBatterySample *sample;
+  GVariantBuilder builder;
+  guint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(tddu)"));
+
+  for ( i = espm_battery_history_find (history, from); i < history->file->header.count; i++ )
+  {
+    sample = espm_battery_history_nth (history, i);
+    if ( sample->timestamp > to )
+      break;
+
+    g_variant_builder_add (&builder, "(tddu)",
+                           (guint64) sample->timestamp,
+                           (gdouble) sample->percentage,
+                           (gdouble) sample->energy_rate,
+                           sample->state);
+  }
+
+  return g_variant_builder_end (&builder);
+}
+
+/*
+ * Forget the samples newer than time, after the clock stepped back
+ * they would hold back every new one.
+ */
+void
+espm_battery_history_drop_after (EspmBatteryHistory *history, gint64 time)
+{
+  EspmBatteryHistoryHeader *header = &history->file->header;
+  guint keep;
+
+  keep = espm_battery_history_find (history, time + 1);
+  if ( keep == header->count )
+    return;
+
+  ESPM_DEBUG ("Dropping %u battery samples newer than %" G_GINT64_FORMAT, header->count - keep, time);
+  header->head = (header->head + HISTORY_CAPACITY - (header->count - keep)) % HISTORY_CAPACITY;
+  header->count = keep;
+}
+
+#ifdef EGG_TEST
+#include "egg-test.h"
+
+void
+espm_battery_history_test (gpointer data)
+{
+  EspmBatteryHistory *history;
+  GVariant *samples;
+  guint64 first = 0;
+  gchar *dir, *filename;
+  gint64 now;
+  guint i;
+  EggTest *test = (EggTest *) data;
+
+  if (egg_test_start (test, "EspmBatteryHistory") == FALSE)
+    return;
+
+  dir = g_dir_make_tmp ("espm-history-XXXXXX", NULL);
+  filename = g_build_filename (dir, "history-test.dat", NULL);
+  espm_battery_history_set_location (dir);
+
+  history = espm_battery_history_open ("test");
+  for (i = 1; i <= HISTORY_CAPACITY + 10; i++)
+    espm_battery_history_add (history, i, 50.0, 8.0, 2);
+
+  /************************************************************/
+  egg_test_title (test, "check the ring wraps around");
+  if (history->file->header.count == HISTORY_CAPACITY &&
+      espm_battery_history_nth (history, 0)->timestamp == 11 &&
+      espm_battery_history_get_last (history) == HISTORY_CAPACITY + 10) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "count %u, oldest %u, newest %" G_GINT64_FORMAT,
+                     history->file->header.count,
+                     espm_battery_history_nth (history, 0)->timestamp,
+                     espm_battery_history_get_last (history));
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check a range across the end of the file is found");
+  samples = g_variant_ref_sink (espm_battery_history_get_range (history, HISTORY_CAPACITY - 2, HISTORY_CAPACITY + 3));
+  if (g_variant_n_children (samples) > 0)
+    g_variant_get_child (samples, 0, "(tddu)", &first, NULL, NULL, NULL);
+  if (g_variant_n_children (samples) == 6 && first == HISTORY_CAPACITY - 2) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "got %" G_GSIZE_FORMAT " samples from %" G_GUINT64_FORMAT,
+                     g_variant_n_children (samples), first);
+  }
+  g_variant_unref (samples);
+
+  /************************************************************/
+  egg_test_title (test, "check a range reaching past the oldest sample is cut");
+  samples = g_variant_ref_sink (espm_battery_history_get_range (history, 0, 15));
+  if (g_variant_n_children (samples) > 0)
+    g_variant_get_child (samples, 0, "(tddu)", &first, NULL, NULL, NULL);
+  if (g_variant_n_children (samples) == 5 && first == 11) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "got %" G_GSIZE_FORMAT " samples from %" G_GUINT64_FORMAT,
+                     g_variant_n_children (samples), first);
+  }
+  g_variant_unref (samples);
+
+  /************************************************************/
+  egg_test_title (test, "check samples newer than the clock are dropped");
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  espm_battery_history_add (history, now + 3600, 50.0, 8.0, 2);
+  espm_battery_history_drop_after (history, now);
+  /* the oldest sample made room for the dropped one */
+  if (espm_battery_history_get_last (history) == HISTORY_CAPACITY + 10 &&
+      history->file->header.count == HISTORY_CAPACITY - 1) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "newest %" G_GINT64_FORMAT ", count %u",
+                     espm_battery_history_get_last (history), history->file->header.count);
+  }
+
+#ifdef HISTORY_USE_MMAP
+  /************************************************************/
+  egg_test_title (test, "check the history is back after reopening");
+  espm_battery_history_close (history);
+  history = espm_battery_history_open ("test");
+  if (history->mapped &&
+      history->file->header.count == HISTORY_CAPACITY - 1 &&
+      espm_battery_history_get_last (history) == HISTORY_CAPACITY + 10) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "mapped %i, count %u", history->mapped, history->file->header.count);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check a history out of order is started over");
+  espm_battery_history_nth (history, 100)->timestamp = 1;
+  espm_battery_history_close (history);
+  history = espm_battery_history_open ("test");
+  if (history->file->header.count == 0) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "kept %u samples", history->file->header.count);
+  }
+#endif
+
+  espm_battery_history_close (history);
+  espm_battery_history_set_location (NULL);
+  g_unlink (filename);
+  g_rmdir (dir);
+  g_free (filename);
+  g_free (dir);
+
+  egg_test_end (test);
+}
+
+#endif
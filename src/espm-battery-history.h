@@ -0,0 +1,48 @@
+/*
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __ESPM_BATTERY_HISTORY_H
+#define __ESPM_BATTERY_HISTORY_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct EspmBatteryHistory EspmBatteryHistory;
+
+EspmBatteryHistory *espm_battery_history_open      (const gchar        *name);
+void                espm_battery_history_close     (EspmBatteryHistory *history);
+void                espm_battery_history_add       (EspmBatteryHistory *history,
+                                                    gint64              timestamp,
+                                                    gdouble             percentage,
+                                                    gdouble             energy_rate,
+                                                    guint               state);
+gint64              espm_battery_history_get_last  (EspmBatteryHistory *history);
+GVariant           *espm_battery_history_get_range (EspmBatteryHistory *history,
+                                                    gint64              from,
+                                                    gint64              to);
+void                espm_battery_history_drop_after (EspmBatteryHistory *history,
+                                                     gint64              time);
+#ifdef EGG_TEST
+void                espm_battery_history_set_location (const gchar      *location);
+void                espm_battery_history_test      (gpointer            data);
+#endif
+
+G_END_DECLS
+
+#endif /* __ESPM_BATTERY_HISTORY_H */
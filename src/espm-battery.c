@@ -36,6 +36,8 @@
 #include <libexpidus1util/libexpidus1util.h>
 
 #include "espm-battery.h"
+#include "espm-battery-history.h"
+#include "espm-battery-estimator.h"
 #include "espm-dbus.h"
 #include "espm-icons.h"
 #include "espm-esconf.h"
@@ -64,8 +66,16 @@ struct EspmBatteryPrivate
   gboolean                ac_online;
   gboolean                present;
   guint                   percentage;
+  /* what UPower says, used until the estimator has a rate */
   gint64                  time_to_full;
   gint64                  time_to_empty;
+  EspmBatteryEstimator    estimator;
+  gdouble                 estimate_level;
+  gdouble                 estimate_full;
+
+  EspmBatteryHistory     *history;
+  UpDeviceState           history_state;
+  guint                   history_percentage;
 
   const gchar            *battery_name;
 
@@ -95,6 +105,8 @@ static guint signals [LAST_SIGNAL] = { 0 };
 G_DEFINE_TYPE_WITH_PRIVATE (EspmBattery, espm_battery, GTK_TYPE_WIDGET)
 
 
+static gint64 espm_battery_get_time_to (EspmBattery *battery, gboolean charging);
+
 static gchar *
 espm_battery_get_message_from_battery_state (EspmBattery *battery)
 {
@@ -111,13 +123,13 @@ espm_battery_get_message_from_battery_state (EspmBattery *battery)
       case UP_DEVICE_STATE_CHARGING:
         msg = g_strdup_printf (_("Your %s is charging"), battery->priv->battery_name);
 
-        if ( battery->priv->time_to_full != 0 )
+        if ( espm_battery_get_time_to (battery, TRUE) != 0 )
         {
           gchar *tmp, *est_time_str;
           tmp = g_strdup (msg);
           g_free (msg);
 
-          est_time_str = espm_battery_get_time_string (battery->priv->time_to_full);
+          est_time_str = espm_battery_get_time_string (espm_battery_get_time_to (battery, TRUE));
 
           msg = g_strdup_printf (_("%s (%i%%)\n%s until fully charged"), tmp, battery->priv->percentage, est_time_str);
           g_free (est_time_str);
@@ -131,13 +143,13 @@ espm_battery_get_message_from_battery_state (EspmBattery *battery)
         else
             msg =  g_strdup_printf (_("System is running on %s power"), battery->priv->battery_name);
 
-        if ( battery->priv->time_to_empty != 0 )
+        if ( espm_battery_get_time_to (battery, FALSE) != 0 )
         {
             gchar *tmp, *est_time_str;
             tmp = g_strdup (msg);
             g_free (msg);
 
-            est_time_str = espm_battery_get_time_string (battery->priv->time_to_empty);
+            est_time_str = espm_battery_get_time_string (espm_battery_get_time_to (battery, FALSE));
 
             msg = g_strdup_printf (_("%s (%i%%)\nEstimated time left is %s"), tmp, battery->priv->percentage, est_time_str);
             g_free (tmp);
@@ -266,17 +278,115 @@ espm_battery_check_charge (EspmBattery *battery)
   }
 }
 
+/*
+ * Wall clock seconds, unlike the monotonic clock it keeps counting
+ * during suspend so a long sleep shows up as a gap.
+ */
+static gint64
+espm_battery_estimator_now (void)
+{
+  return g_get_real_time () / G_USEC_PER_SEC;
+}
+
+static void
+espm_battery_estimate_time (EspmBattery *battery,
+                            guint state,
+                            gdouble level,
+                            gdouble full,
+                            guint64 to_empty,
+                            guint64 to_full)
+{
+  EspmBatteryEstimator *est = &battery->priv->estimator;
+
+  battery->priv->time_to_empty = to_empty;
+  battery->priv->time_to_full  = to_full;
+
+  if ( state != UP_DEVICE_STATE_CHARGING && state != UP_DEVICE_STATE_DISCHARGING )
+  {
+    est->last_time = 0;
+    return;
+  }
+
+  espm_battery_estimator_sample (est,
+                                 state == UP_DEVICE_STATE_CHARGING,
+                                 espm_battery_estimator_now (),
+                                 level);
+  battery->priv->estimate_level = level;
+  battery->priv->estimate_full = full;
+}
+
+/*
+ * Our estimate as of now, or UPower's while we don't have one
+ */
+static gint64
+espm_battery_get_time_to (EspmBattery *battery, gboolean charging)
+{
+  EspmBatteryEstimator *est = &battery->priv->estimator;
+  gint64 remaining = -1;
+
+  if ( est->last_time != 0 && est->charging == charging )
+    remaining = espm_battery_estimator_remaining (est,
+                                                  battery->priv->estimate_level,
+                                                  battery->priv->estimate_full,
+                                                  espm_battery_estimator_now ());
+  if ( remaining >= 0 )
+    return remaining;
+
+  return charging ? battery->priv->time_to_full : battery->priv->time_to_empty;
+}
+
+/*
+ * A sample when the state changes, otherwise at most one a minute
+ * and only every ten minutes while the percentage stays the same.
+ */
+static void
+espm_battery_record_history (EspmBattery *battery,
+                             guint state,
+                             gdouble percentage,
+                             gdouble energy_rate)
+{
+  gint64 now, last;
+
+  if ( battery->priv->history == NULL )
+    return;
+
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  last = espm_battery_history_get_last (battery->priv->history);
+
+  /* the clock stepped back, carry on from the present */
+  if ( last > now )
+  {
+    espm_battery_history_drop_after (battery->priv->history, now);
+    last = espm_battery_history_get_last (battery->priv->history);
+  }
+
+  if ( state == battery->priv->history_state )
+  {
+    if ( now - last < 60 )
+      return;
+    if ( (guint) percentage == battery->priv->history_percentage && now - last < 600 )
+      return;
+  }
+
+  espm_battery_history_add (battery->priv->history, now, percentage, energy_rate, state);
+  battery->priv->history_state = state;
+  battery->priv->history_percentage = (guint) percentage;
+}
+
 static void
 espm_battery_refresh (EspmBattery *battery, UpDevice *device)
 {
   gboolean present;
   guint state;
-  gdouble percentage;
+  gdouble percentage, energy, energy_full, energy_rate;
   guint64 to_empty, to_full;
 
   g_object_get (device,
                 "is-present", &present,
                 "percentage", &percentage,
+                "energy", &energy,
+                "energy-full", &energy_full,
+                "energy-rate", &energy_rate,
                 "state", &state,
                 "time-to-empty", &to_empty,
                 "time-to-full", &to_full,
@@ -295,8 +405,13 @@ espm_battery_refresh (EspmBattery *battery, UpDevice *device)
   if ( battery->priv->type == UP_DEVICE_KIND_BATTERY ||
        battery->priv->type == UP_DEVICE_KIND_UPS )
   {
-    battery->priv->time_to_empty = to_empty;
-    battery->priv->time_to_full  = to_empty;
+    /* some devices only report a percentage */
+    if ( energy_full > 0.0 )
+      espm_battery_estimate_time (battery, state, energy, energy_full, to_empty, to_full);
+    else
+      espm_battery_estimate_time (battery, state, percentage, 100.0, to_empty, to_full);
+
+    espm_battery_record_history (battery, state, percentage, energy_rate);
   }
 }
 
@@ -416,6 +531,8 @@ espm_battery_init (EspmBattery *battery)
   battery->priv->time_to_empty = 0;
   battery->priv->button        = espm_button_new ();
   battery->priv->ac_online     = TRUE;
+  battery->priv->history       = NULL;
+  battery->priv->history_state = UP_DEVICE_STATE_UNKNOWN;
 }
 
 static void
@@ -442,6 +559,8 @@ espm_battery_finalize (GObject *object)
   g_object_unref (battery->priv->notify);
   g_object_unref (battery->priv->button);
 
+  espm_battery_history_close (battery->priv->history);
+
   G_OBJECT_CLASS (espm_battery_parent_class)->finalize (object);
 }
 
@@ -461,10 +580,19 @@ espm_battery_monitor_device (EspmBattery *battery,
                              UpDeviceKind device_type)
 {
   UpDevice *device;
+  gchar *name;
   battery->priv->type = device_type;
   battery->priv->client = up_client_new();
   battery->priv->battery_name = espm_power_translate_device_type (device_type);
 
+  if ( device_type == UP_DEVICE_KIND_BATTERY || device_type == UP_DEVICE_KIND_UPS )
+  {
+    /* e.g. battery_BAT0 */
+    name = g_path_get_basename (object_path);
+    battery->priv->history = espm_battery_history_open (name);
+    g_free (name);
+  }
+
   device = up_device_new();
   up_device_set_object_path_sync (device, object_path, NULL, NULL);
   battery->priv->device = device;
@@ -506,7 +634,37 @@ espm_battery_get_time_left (EspmBattery *battery)
 {
   g_return_val_if_fail (ESPM_IS_BATTERY (battery), NULL);
 
-  return espm_battery_get_time_string (battery->priv->time_to_empty);
+  return espm_battery_get_time_string (espm_battery_get_time_to (battery, FALSE));
+}
+
+/*
+ * Our estimate of the time to empty and to full in seconds, 0 when
+ * neither we nor UPower have one.
+ */
+void
+espm_battery_get_time_estimate (EspmBattery *battery,
+                                guint64 *time_to_empty,
+                                guint64 *time_to_full)
+{
+  g_return_if_fail (ESPM_IS_BATTERY (battery));
+
+  *time_to_empty = (guint64) MAX (espm_battery_get_time_to (battery, FALSE), 0);
+  *time_to_full = (guint64) MAX (espm_battery_get_time_to (battery, TRUE), 0);
+}
+
+/*
+ * Recorded samples between from and to, as a floating a(tddu), or
+ * NULL for devices without a history.
+ */
+GVariant *
+espm_battery_get_history (EspmBattery *battery, gint64 from, gint64 to)
+{
+  g_return_val_if_fail (ESPM_IS_BATTERY (battery), NULL);
+
+  if ( battery->priv->history == NULL )
+    return NULL;
+
+  return espm_battery_history_get_range (battery->priv->history, from, to);
 }
 
 const gchar*
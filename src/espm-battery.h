@@ -56,6 +56,12 @@ UpDeviceKind        espm_battery_get_device_type  (EspmBattery *battery);
 EspmBatteryCharge   espm_battery_get_charge       (EspmBattery *battery);
 const gchar        *espm_battery_get_battery_name (EspmBattery *battery);
 gchar              *espm_battery_get_time_left    (EspmBattery *battery);
+void                espm_battery_get_time_estimate (EspmBattery *battery,
+                                                   guint64 *time_to_empty,
+                                                   guint64 *time_to_full);
+GVariant           *espm_battery_get_history      (EspmBattery *battery,
+                                                   gint64 from,
+                                                   gint64 to);
 const gchar        *espm_battery_get_icon_name    (EspmBattery *battery);
 
 G_END_DECLS
@@ -32,6 +32,7 @@
 #endif
 
 #include <gdk/gdk.h>
+#include <X11/extensions/Xrandr.h>
 
 #include <libexpidus1util/libexpidus1util.h>
 
@@ -41,6 +42,7 @@
 #include "espm-esconf.h"
 #include "espm-config.h"
 #include "espm-debug.h"
+#include "espm-idle-timeline.h"
 
 
 static void espm_dpms_finalize   (GObject *object);
@@ -48,11 +50,31 @@ static void espm_dpms_finalize   (GObject *object);
 struct EspmDpmsPrivate
 {
   EspmEsconf      *conf;
+  EspmIdleTimeline *timeline;
 
   gboolean         dpms_capable;
   gboolean         inhibited;
 
   gboolean         on_battery;
+  gboolean         standby_mode;
+
+  /* what the X server has, as far as we know */
+  gboolean         x_enabled;
+  CARD16           x_level;
+  CARD16           x_standby;
+  CARD16           x_suspend;
+  CARD16           x_off;
+
+  guint            apply_id;
+
+  /* the internal panel's crtc while switched off, to restore it */
+  RRCrtc           panel_crtc;
+  RRMode           panel_mode;
+  int              panel_x;
+  int              panel_y;
+  Rotation         panel_rotation;
+  RROutput        *panel_outputs;
+  int              panel_noutputs;
 
   gulong           switch_off_timeout_id;
   gulong           switch_on_timeout_id;
@@ -60,133 +82,170 @@ struct EspmDpmsPrivate
 
 G_DEFINE_TYPE_WITH_PRIVATE (EspmDpms, espm_dpms, G_TYPE_OBJECT)
 
+/*
+ * Other clients may enable, disable or force DPMS at any time, so the
+ * level is read again before it is forced.
+ */
 static void
-espm_dpms_set_timeouts (EspmDpms *dpms, guint16 standby, guint16 suspend, guint off)
+espm_dpms_read_level (EspmDpms *dpms)
 {
-  CARD16 x_standby = 0 , x_suspend = 0, x_off = 0;
+  BOOL state = FALSE;
 
-  DPMSGetTimeouts (gdk_x11_get_default_xdisplay(), &x_standby, &x_suspend, &x_off);
-
-  if ( standby != x_standby || suspend != x_suspend || off != x_off )
-  {
-    ESPM_DEBUG ("Settings dpms: standby=%d suspend=%d off=%d\n", standby, suspend, off);
-    DPMSSetTimeouts (gdk_x11_get_default_xdisplay(), standby,
-                     suspend,
-                     off );
-  }
+  dpms->priv->x_level = DPMSModeOn;
+  if ( !DPMSInfo (gdk_x11_get_default_xdisplay (), &dpms->priv->x_level, &state) )
+    g_warning ("Cannot get DPMSInfo");
+  dpms->priv->x_enabled = state;
 }
 
 /*
- * Disable DPMS
+ * Read the server state once, the settings are applied through the
+ * shadow copy after that and only differences are sent.
  */
 static void
-espm_dpms_disable (EspmDpms *dpms)
+espm_dpms_read_state (EspmDpms *dpms)
 {
-  BOOL state;
-  CARD16 power_level;
+  espm_dpms_read_level (dpms);
+  DPMSGetTimeouts (gdk_x11_get_default_xdisplay (),
+                   &dpms->priv->x_standby, &dpms->priv->x_suspend, &dpms->priv->x_off);
+}
 
-  if (!DPMSInfo (gdk_x11_get_default_xdisplay(), &power_level, &state) )
-    g_warning ("Cannot get DPMSInfo");
+static gboolean
+espm_dpms_set_enabled (EspmDpms *dpms, gboolean enabled)
+{
+  if ( dpms->priv->x_enabled == enabled )
+    return FALSE;
+
+  ESPM_DEBUG ("%s DPMS", enabled ? "Enabling" : "Disabling");
+
+  if ( enabled )
+    DPMSEnable (gdk_x11_get_default_xdisplay ());
+  else
+    DPMSDisable (gdk_x11_get_default_xdisplay ());
 
-  if ( state )
-    DPMSDisable (gdk_x11_get_default_xdisplay());
+  dpms->priv->x_enabled = enabled;
+
+  /* the server turns the display on when DPMS gets disabled */
+  if ( !enabled )
+    dpms->priv->x_level = DPMSModeOn;
+
+  return TRUE;
 }
 
-/*
- * Enable DPMS
- */
-static void
-espm_dpms_enable (EspmDpms *dpms)
+static gboolean
+espm_dpms_set_timeouts (EspmDpms *dpms, guint16 standby, guint16 suspend, guint off)
 {
-  BOOL state;
-  CARD16 power_level;
+  if ( standby == dpms->priv->x_standby && suspend == dpms->priv->x_suspend && off == dpms->priv->x_off )
+    return FALSE;
 
-  if (!DPMSInfo (gdk_x11_get_default_xdisplay(), &power_level, &state) )
-    g_warning ("Cannot get DPMSInfo");
+  ESPM_DEBUG ("Settings dpms: standby=%d suspend=%d off=%d\n", standby, suspend, off);
+  DPMSSetTimeouts (gdk_x11_get_default_xdisplay(), standby,
+                   suspend,
+                   off );
 
-  if ( !state )
-    DPMSEnable (gdk_x11_get_default_xdisplay());
+  dpms->priv->x_standby = standby;
+  dpms->priv->x_suspend = suspend;
+  dpms->priv->x_off = off;
+
+  return TRUE;
 }
 
+/*
+ * The X server switches the display itself, so clients holding it on
+ * with DPMSDisable or "xset -dpms" keep working. Sleep and off only
+ * follow along as stages on the idle timeline, for ordering and
+ * statistics.
+ */
 static void
-espm_dpms_get_enabled (EspmDpms *dpms, gboolean *dpms_enabled)
+espm_dpms_set_stage_timeouts (EspmDpms *dpms, gboolean enabled)
 {
-  g_object_get (G_OBJECT (dpms->priv->conf),
-                DPMS_ENABLED_CFG, dpms_enabled,
-                NULL);
+  guint ac_sleep = 0, ac_off = 0, batt_sleep = 0, batt_off = 0;
+
+  if ( enabled )
+    g_object_get (G_OBJECT (dpms->priv->conf),
+                  ON_AC_DPMS_SLEEP, &ac_sleep,
+                  ON_AC_DPMS_OFF, &ac_off,
+                  ON_BATT_DPMS_SLEEP, &batt_sleep,
+                  ON_BATT_DPMS_OFF, &batt_off,
+                  NULL);
+
+  espm_idle_timeline_set_timeouts (dpms->priv->timeline, ESPM_IDLE_STAGE_DPMS_SLEEP,
+                                   ac_sleep * 60 * 1000, batt_sleep * 60 * 1000);
+  espm_idle_timeline_set_timeouts (dpms->priv->timeline, ESPM_IDLE_STAGE_DPMS_OFF,
+                                   ac_off * 60 * 1000, batt_off * 60 * 1000);
 }
 
 static void
-espm_dpms_get_sleep_mode (EspmDpms *dpms, gboolean *ret_standby_mode)
+espm_dpms_apply (EspmDpms *dpms)
 {
+  gboolean enabled = FALSE;
+  gboolean changed = FALSE;
+  guint sleep_time = 0, off_time = 0;
   gchar *sleep_mode;
 
+  if ( !dpms->priv->inhibited )
+    g_object_get (G_OBJECT (dpms->priv->conf),
+                  DPMS_ENABLED_CFG, &enabled,
+                  NULL);
+
   g_object_get (G_OBJECT (dpms->priv->conf),
                 DPMS_SLEEP_MODE, &sleep_mode,
+                dpms->priv->on_battery ? ON_BATT_DPMS_SLEEP : ON_AC_DPMS_SLEEP, &sleep_time,
+                dpms->priv->on_battery ? ON_BATT_DPMS_OFF : ON_AC_DPMS_OFF, &off_time,
                 NULL);
+  dpms->priv->standby_mode = !g_strcmp0 (sleep_mode, "Standby");
+  g_free (sleep_mode);
 
-  if ( !g_strcmp0 (sleep_mode, "Standby"))
-    *ret_standby_mode = TRUE;
-  else
-    *ret_standby_mode = FALSE;
+  changed |= espm_dpms_set_enabled (dpms, enabled);
+  if ( enabled && dpms->priv->standby_mode )
+    changed |= espm_dpms_set_timeouts (dpms, sleep_time * 60, 0, off_time * 60);
+  else if ( enabled )
+    changed |= espm_dpms_set_timeouts (dpms, 0, sleep_time * 60, off_time * 60);
 
-  g_free (sleep_mode);
+  if ( changed )
+    XFlush (gdk_x11_get_default_xdisplay ());
+
+  espm_dpms_set_stage_timeouts (dpms, enabled);
 }
 
-static void
-espm_dpms_get_configuration_timeouts (EspmDpms *dpms, guint16 *ret_sleep, guint16 *ret_off )
+static gboolean
+espm_dpms_apply_idle (gpointer data)
 {
-  guint sleep_time, off_time;
+  EspmDpms *dpms = ESPM_DPMS (data);
 
-  g_object_get (G_OBJECT (dpms->priv->conf),
-                dpms->priv->on_battery ? ON_BATT_DPMS_SLEEP : ON_AC_DPMS_SLEEP, &sleep_time,
-                dpms->priv->on_battery ? ON_BATT_DPMS_OFF : ON_AC_DPMS_OFF, &off_time,
-                NULL);
+  dpms->priv->apply_id = 0;
+  espm_dpms_apply (dpms);
 
-  *ret_sleep = sleep_time * 60;
-  *ret_off =  off_time * 60;
+  return FALSE;
 }
 
+/*
+ * Apply the settings once the current burst of changes is over
+ */
 void
 espm_dpms_refresh (EspmDpms *dpms)
 {
-  gboolean enabled;
-  guint16 off_timeout;
-  guint16 sleep_timeout;
-  gboolean sleep_mode;
-
-  if ( dpms->priv->inhibited)
-  {
-    espm_dpms_disable (dpms);
+  if ( !dpms->priv->dpms_capable || dpms->priv->apply_id != 0 )
     return;
-  }
 
-  espm_dpms_get_enabled (dpms, &enabled);
-
-  if ( !enabled )
-  {
-    espm_dpms_disable (dpms);
-    return;
-  }
+  dpms->priv->apply_id = g_idle_add (espm_dpms_apply_idle, dpms);
+}
 
-  espm_dpms_enable (dpms);
-  espm_dpms_get_configuration_timeouts (dpms, &sleep_timeout, &off_timeout);
-  espm_dpms_get_sleep_mode (dpms, &sleep_mode);
+static void
+espm_dpms_stage_reached_cb (EspmIdleTimeline *timeline, guint stage, EspmDpms *dpms)
+{
+  /* the server switched the display at about the same time, unless a
+   * client disabled DPMS; either way On is no longer certain */
+  if ( stage == ESPM_IDLE_STAGE_DPMS_SLEEP )
+    dpms->priv->x_level = dpms->priv->standby_mode ? DPMSModeStandby : DPMSModeSuspend;
+  else if ( stage == ESPM_IDLE_STAGE_DPMS_OFF )
+    dpms->priv->x_level = DPMSModeOff;
+}
 
-  if (sleep_mode == TRUE )
-  {
-    espm_dpms_set_timeouts     (dpms,
-                                sleep_timeout,
-                                0,
-                                off_timeout);
-  }
-  else
-  {
-    espm_dpms_set_timeouts     (dpms,
-                                0,
-                                sleep_timeout,
-                                off_timeout );
-  }
+static void
+espm_dpms_reset_cb (EspmIdleTimeline *timeline, EspmDpms *dpms)
+{
+  /* input wakes the display up in the server */
+  dpms->priv->x_level = DPMSModeOn;
 }
 
 static void
@@ -218,15 +277,24 @@ espm_dpms_init(EspmDpms *dpms)
   dpms->priv->dpms_capable = DPMSCapable (gdk_x11_get_default_xdisplay());
   dpms->priv->switch_off_timeout_id = 0;
   dpms->priv->switch_on_timeout_id = 0;
+  dpms->priv->apply_id = 0;
+  dpms->priv->panel_crtc = None;
+  dpms->priv->panel_outputs = NULL;
 
   if ( dpms->priv->dpms_capable )
   {
     dpms->priv->conf    = espm_esconf_new  ();
+    dpms->priv->timeline = espm_idle_timeline_new ();
 
     g_signal_connect (dpms->priv->conf, "notify",
                       G_CALLBACK (espm_dpms_settings_changed_cb), dpms);
+    g_signal_connect (dpms->priv->timeline, "stage-reached",
+                      G_CALLBACK (espm_dpms_stage_reached_cb), dpms);
+    g_signal_connect (dpms->priv->timeline, "reset",
+                      G_CALLBACK (espm_dpms_reset_cb), dpms);
 
-    espm_dpms_refresh (dpms);
+    espm_dpms_read_state (dpms);
+    espm_dpms_apply (dpms);
   }
   else
   {
@@ -241,7 +309,19 @@ espm_dpms_finalize(GObject *object)
 
   dpms = ESPM_DPMS (object);
 
-  g_object_unref (dpms->priv->conf);
+  if ( dpms->priv->apply_id != 0 )
+    g_source_remove (dpms->priv->apply_id);
+
+  if ( dpms->priv->timeline )
+  {
+    g_signal_handlers_disconnect_by_data (dpms->priv->timeline, dpms);
+    g_object_unref (dpms->priv->timeline);
+  }
+
+  if ( dpms->priv->conf )
+    g_object_unref (dpms->priv->conf);
+
+  g_free (dpms->priv->panel_outputs);
 
   G_OBJECT_CLASS(espm_dpms_parent_class)->finalize(object);
 }
@@ -275,46 +355,46 @@ espm_dpms_capable (EspmDpms *dpms)
 void
 espm_dpms_force_level (EspmDpms *dpms, CARD16 level)
 {
-  CARD16 current_level;
-  BOOL current_state;
+  Display *display = gdk_x11_get_default_xdisplay ();
 
   ESPM_DEBUG ("start");
 
   if ( !dpms->priv->dpms_capable )
     goto out;
 
-  if ( G_UNLIKELY (!DPMSInfo (gdk_x11_get_default_xdisplay (), &current_level, &current_state)) )
+  /* only called on lid events, rare enough to ask the server */
+  espm_dpms_read_level (dpms);
+
+  if ( !dpms->priv->x_enabled )
   {
-    g_warning ("Cannot get DPMSInfo");
+    ESPM_DEBUG ("DPMS is disabled");
     goto out;
   }
 
-  if ( !current_state )
+  if ( level == dpms->priv->x_level )
   {
-    ESPM_DEBUG ("DPMS is disabled");
+    ESPM_DEBUG ("No need to change DPMS mode, current_level=%d requested_level=%d", dpms->priv->x_level, level);
     goto out;
   }
 
-  if ( current_level != level )
-  {
-    ESPM_DEBUG ("Forcing DPMS mode %d", level);
+  ESPM_DEBUG ("Forcing DPMS mode %d", level);
 
-    if ( !DPMSForceLevel (gdk_x11_get_default_xdisplay (), level ) )
-    {
-      g_warning ("Cannot set Force DPMS level %d", level);
-      goto out;
-    }
+  /* the request is async, a client disabling DPMS in between makes the
+   * server answer BadMatch, which would take the daemon down untrapped */
+  gdk_x11_display_error_trap_push (gdk_display_get_default ());
 
-    if ( level == DPMSModeOn )
-      XResetScreenSaver (gdk_x11_get_default_xdisplay ());
+  DPMSForceLevel (display, level);
+  if ( level == DPMSModeOn )
+    XResetScreenSaver (display);
 
-    XSync (gdk_x11_get_default_xdisplay (), FALSE);
-  }
-  else
+  if ( gdk_x11_display_error_trap_pop (gdk_display_get_default ()) != 0 )
   {
-    ESPM_DEBUG ("No need to change DPMS mode, current_level=%d requested_level=%d", current_level, level);
+    g_warning ("Cannot set Force DPMS level %d", level);
+    goto out;
   }
 
+  dpms->priv->x_level = level;
+
   out:
     ;
 }
@@ -343,6 +423,178 @@ espm_dpms_set_on_battery (EspmDpms *dpms, gboolean on_battery)
     return;
 
   dpms->priv->on_battery = on_battery;
-  espm_dpms_refresh (dpms);
   ESPM_DEBUG ("dpms on battery %s", on_battery ? "TRUE" : "FALSE");
+  espm_dpms_refresh (dpms);
+}
+
+/*
+ * Laptop panels, by the names the kernel drivers give them
+ */
+static gboolean
+espm_dpms_is_panel_output (const gchar *name)
+{
+  return g_str_has_prefix (name, "eDP") ||
+         g_str_has_prefix (name, "LVDS") ||
+         g_str_has_prefix (name, "DSI");
+}
+
+/*
+ * Turn off just the internal panel through RandR, leaving the other
+ * outputs on. A crtc of its own is switched off, a crtc shared with a
+ * mirrored output keeps driving that output without the panel. Fails
+ * when there is no active panel or nothing else is active, in which
+ * case whole screen DPMS is the way.
+ */
+gboolean
+espm_dpms_panel_off (EspmDpms *dpms)
+{
+  Display *display = gdk_x11_get_default_xdisplay ();
+  XRRScreenResources *resource = NULL;
+  XRROutputInfo *info;
+  XRRCrtcInfo *crtc_info = NULL;
+  RRCrtc *crtcs = NULL;
+  RROutput *outputs = NULL;
+  RROutput panel = None;
+  RRCrtc crtc = None;
+  guint active = 0;
+  guint shared = 0;
+  gint noutputs = 0;
+  gboolean ret = FALSE;
+  int event_base, error_base;
+  int i;
+
+  g_return_val_if_fail (ESPM_IS_DPMS (dpms), FALSE);
+
+  if ( dpms->priv->panel_crtc != None )
+    return TRUE;
+
+  if ( !XRRQueryExtension (display, &event_base, &error_base) )
+    return FALSE;
+
+  gdk_x11_display_error_trap_push (gdk_display_get_default ());
+
+  resource = XRRGetScreenResourcesCurrent (display, DefaultRootWindow (display));
+  if ( resource == NULL )
+    goto out;
+
+  /* the crtc of every connected output, None when it is off */
+  crtcs = g_new0 (RRCrtc, resource->noutput);
+  for ( i = 0; i < resource->noutput; i++ )
+  {
+    info = XRRGetOutputInfo (display, resource, resource->outputs[i]);
+    if ( info == NULL )
+      continue;
+
+    if ( info->connection == RR_Connected && info->crtc != None )
+    {
+      crtcs[i] = info->crtc;
+      if ( panel == None && espm_dpms_is_panel_output (info->name) )
+      {
+        panel = resource->outputs[i];
+        crtc = info->crtc;
+      }
+    }
+
+    XRRFreeOutputInfo (info);
+  }
+
+  /* a mirrored output on the panel's crtc must stay lit */
+  for ( i = 0; i < resource->noutput; i++ )
+  {
+    if ( crtcs[i] == None || resource->outputs[i] == panel )
+      continue;
+    if ( crtcs[i] == crtc )
+      shared++;
+    else
+      active++;
+  }
+
+  if ( crtc == None || active + shared == 0 )
+  {
+    ESPM_DEBUG ("No panel to switch off on its own, %u other active outputs", active);
+    goto out;
+  }
+
+  crtc_info = XRRGetCrtcInfo (display, resource, crtc);
+  if ( crtc_info == NULL )
+    goto out;
+
+  if ( shared > 0 )
+  {
+    outputs = g_new (RROutput, crtc_info->noutput);
+    for ( i = 0; i < crtc_info->noutput; i++ )
+      if ( crtc_info->outputs[i] != panel )
+        outputs[noutputs++] = crtc_info->outputs[i];
+  }
+
+  if ( XRRSetCrtcConfig (display, resource, crtc, CurrentTime,
+                         shared > 0 ? crtc_info->x : 0,
+                         shared > 0 ? crtc_info->y : 0,
+                         shared > 0 ? crtc_info->mode : None,
+                         shared > 0 ? crtc_info->rotation : RR_Rotate_0,
+                         outputs, noutputs) != RRSetConfigSuccess )
+  {
+    g_warning ("Cannot switch off the panel crtc");
+    goto out;
+  }
+
+  ESPM_DEBUG ("Switched off the panel on crtc %lu, %u mirrored outputs left on it",
+              (gulong) crtc, shared);
+
+  dpms->priv->panel_crtc = crtc;
+  dpms->priv->panel_mode = crtc_info->mode;
+  dpms->priv->panel_x = crtc_info->x;
+  dpms->priv->panel_y = crtc_info->y;
+  dpms->priv->panel_rotation = crtc_info->rotation;
+  dpms->priv->panel_noutputs = crtc_info->noutput;
+  g_free (dpms->priv->panel_outputs);
+  dpms->priv->panel_outputs = g_memdup (crtc_info->outputs, crtc_info->noutput * sizeof (RROutput));
+  ret = TRUE;
+
+out:
+  g_free (outputs);
+  g_free (crtcs);
+  if ( crtc_info )
+    XRRFreeCrtcInfo (crtc_info);
+  if ( resource )
+    XRRFreeScreenResources (resource);
+
+  gdk_x11_display_error_trap_pop_ignored (gdk_display_get_default ());
+
+  return ret;
+}
+
+/*
+ * Restore the panel crtc switched off by espm_dpms_panel_off, if any
+ */
+void
+espm_dpms_panel_on (EspmDpms *dpms)
+{
+  Display *display = gdk_x11_get_default_xdisplay ();
+  XRRScreenResources *resource;
+
+  g_return_if_fail (ESPM_IS_DPMS (dpms));
+
+  if ( dpms->priv->panel_crtc == None )
+    return;
+
+  gdk_x11_display_error_trap_push (gdk_display_get_default ());
+
+  resource = XRRGetScreenResourcesCurrent (display, DefaultRootWindow (display));
+  if ( resource == NULL ||
+       XRRSetCrtcConfig (display, resource, dpms->priv->panel_crtc, CurrentTime,
+                         dpms->priv->panel_x, dpms->priv->panel_y,
+                         dpms->priv->panel_mode, dpms->priv->panel_rotation,
+                         dpms->priv->panel_outputs, dpms->priv->panel_noutputs) != RRSetConfigSuccess )
+    g_warning ("Cannot restore the panel crtc");
+  else
+    ESPM_DEBUG ("Restored the panel crtc %lu", (gulong) dpms->priv->panel_crtc);
+
+  if ( resource )
+    XRRFreeScreenResources (resource);
+
+  gdk_x11_display_error_trap_pop_ignored (gdk_display_get_default ());
+
+  dpms->priv->panel_crtc = None;
+  g_clear_pointer (&dpms->priv->panel_outputs, g_free);
 }
@@ -60,6 +60,8 @@ void            espm_dpms_refresh         (EspmDpms *dpms);
 void            espm_dpms_inhibit         (EspmDpms *dpms, gboolean inhibit);
 gboolean        espm_dpms_is_inhibited    (EspmDpms *dpms);
 void            espm_dpms_set_on_battery  (EspmDpms *dpms, gboolean on_battery);
+gboolean        espm_dpms_panel_off       (EspmDpms *dpms);
+void            espm_dpms_panel_on        (EspmDpms *dpms);
 
 G_END_DECLS
 
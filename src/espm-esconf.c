@@ -92,6 +92,7 @@ enum
   PROP_LOGIND_HANDLE_SUSPEND_KEY,
   PROP_LOGIND_HANDLE_HIBERNATE_KEY,
   PROP_LOGIND_HANDLE_LID_SWITCH,
+  PROP_LID_CLOSE_PANEL_ONLY,
   PROP_HEARTBEAT_COMMAND,
   N_PROPERTIES
 };
@@ -633,6 +634,19 @@ espm_esconf_class_init (EspmEsconfClass *klass)
                                                          FALSE,
                                                          G_PARAM_READWRITE));
 
+  /**
+   * EspmEsconf::lid-close-panel-only
+   *
+   * With other outputs connected, switch off only the internal
+   * panel through RandR when the lid closes.
+   **/
+  g_object_class_install_property (object_class,
+                                   PROP_LID_CLOSE_PANEL_ONLY,
+                                   g_param_spec_boolean (LID_CLOSE_PANEL_ONLY,
+                                                         NULL, NULL,
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
+
   /**
    * EspmEsconf::heartbeat-command
    **/
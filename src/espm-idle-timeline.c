@@ -0,0 +1,560 @@
+/*
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * All idle actions on one timeline: dim, blank, DPMS sleep and off,
+ * then sleep. Only the next stage that is still ahead is armed, as a
+ * single EggIdletime alarm, and the following one is armed when it
+ * goes off. Input resets the timeline to its first stage.
+ *
+ * Blank and the DPMS stages are carried out by the X server from its
+ * own timeouts, which clients can suspend; here they are only followed
+ * so they take part in the ordering and the statistics.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "espm-idle-timeline.h"
+#include "egg-idletime.h"
+#include "espm-debug.h"
+
+static void espm_idle_timeline_finalize   (GObject *object);
+
+/* input this soon after a stage counts as undoing it */
+#define UNDO_WINDOW 5000
+
+struct EspmIdleTimelinePrivate
+{
+  EggIdletime     *idle;
+
+  /* in ms of idle time, 0 for never; indexed by on_battery */
+  guint            timeouts[ESPM_IDLE_N_STAGES][2];
+  gboolean         reached[ESPM_IDLE_N_STAGES];
+  gint64           latency[ESPM_IDLE_N_STAGES];
+
+  /* statistics since startup */
+  gint64           fired_at[ESPM_IDLE_N_STAGES];
+  guint            n_reached[ESPM_IDLE_N_STAGES];
+  guint            n_undone[ESPM_IDLE_N_STAGES];
+
+  gboolean         on_battery;
+  gboolean         inhibited;
+
+  /* the stage the alarm is armed for, -1 when none is */
+  gint             armed;
+};
+
+enum
+{
+  STAGE_REACHED,
+  RESET,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+static const gchar *stage_names[ESPM_IDLE_N_STAGES] =
+{
+  "dim", "blank", "dpms-sleep", "dpms-off", "sleep"
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (EspmIdleTimeline, espm_idle_timeline, G_TYPE_OBJECT)
+
+static guint
+espm_idle_timeline_get_timeout (EspmIdleTimeline *timeline, guint stage)
+{
+  return timeline->priv->timeouts[stage][timeline->priv->on_battery ? 1 : 0];
+}
+
+/*
+ * The first stage not reached yet whose timeout is after idle_time,
+ * or -1 when there is none
+ */
+static gint
+espm_idle_timeline_find_next (EspmIdleTimeline *timeline, gint64 idle_time)
+{
+  guint timeout, next_timeout = 0;
+  gint next = -1;
+  guint i;
+
+  for ( i = 0; i < ESPM_IDLE_N_STAGES; i++ )
+  {
+    timeout = espm_idle_timeline_get_timeout (timeline, i);
+
+    if ( timeout == 0 || timeline->priv->reached[i] || timeout <= idle_time )
+      continue;
+
+    if ( next == -1 || timeout < next_timeout )
+    {
+      next = i;
+      next_timeout = timeout;
+    }
+  }
+
+  return next;
+}
+
+static void
+espm_idle_timeline_arm (EspmIdleTimeline *timeline, gint64 idle_time)
+{
+  gint next = -1;
+
+  if ( !timeline->priv->inhibited )
+    next = espm_idle_timeline_find_next (timeline, idle_time);
+
+  if ( next == timeline->priv->armed )
+    return;
+
+  timeline->priv->armed = next;
+
+  if ( next == -1 )
+  {
+    ESPM_DEBUG ("No idle stage left to arm");
+    egg_idletime_alarm_remove (timeline->priv->idle, TIMEOUT_IDLE_TIMELINE);
+    return;
+  }
+
+  ESPM_DEBUG ("Arming idle stage %s at %u ms", stage_names[next],
+              espm_idle_timeline_get_timeout (timeline, next));
+  egg_idletime_alarm_set (timeline->priv->idle, TIMEOUT_IDLE_TIMELINE,
+                          espm_idle_timeline_get_timeout (timeline, next));
+}
+
+/*
+ * Plan again after the timeouts, the power source or the inhibit state
+ * changed. Stages already behind the current idle time are skipped
+ * instead of all firing at once, only the next one ahead gets armed.
+ */
+static void
+espm_idle_timeline_replan (EspmIdleTimeline *timeline)
+{
+  gint64 idle_time;
+  guint timeout;
+  gboolean skipped = FALSE;
+  guint i;
+
+  idle_time = egg_idletime_get_time (timeline->priv->idle);
+
+  for ( i = 0; i < ESPM_IDLE_N_STAGES; i++ )
+  {
+    timeout = espm_idle_timeline_get_timeout (timeline, i);
+    if ( timeout != 0 && timeout <= idle_time && !timeline->priv->reached[i] )
+    {
+      timeline->priv->reached[i] = TRUE;
+      skipped = TRUE;
+    }
+  }
+
+  /* no alarm may have gone off yet to catch the next input */
+  if ( skipped )
+    egg_idletime_alarm_set_reset (timeline->priv->idle);
+
+  /* the armed stage may have moved, always send the new timeout */
+  timeline->priv->armed = -1;
+  espm_idle_timeline_arm (timeline, idle_time);
+}
+
+static void
+espm_idle_timeline_alarm_expired_cb (EggIdletime *idle, guint id, EspmIdleTimeline *timeline)
+{
+  gint64 idle_time;
+  gint stage;
+
+  if ( id != TIMEOUT_IDLE_TIMELINE )
+    return;
+
+  idle_time = egg_idletime_get_time (idle);
+  timeline->priv->armed = -1;
+
+  /* everything due by now, including stages sharing a timeout */
+  while ( !timeline->priv->inhibited &&
+          (stage = espm_idle_timeline_find_next (timeline, -1)) != -1 &&
+          espm_idle_timeline_get_timeout (timeline, stage) <= idle_time )
+  {
+    timeline->priv->reached[stage] = TRUE;
+    timeline->priv->latency[stage] = idle_time - espm_idle_timeline_get_timeout (timeline, stage);
+    timeline->priv->fired_at[stage] = idle_time;
+    timeline->priv->n_reached[stage]++;
+
+    ESPM_DEBUG ("Idle stage %s reached, %" G_GINT64_FORMAT " ms late",
+                stage_names[stage], timeline->priv->latency[stage]);
+
+    g_signal_emit (timeline, signals[STAGE_REACHED], 0, (guint) stage);
+  }
+
+  espm_idle_timeline_arm (timeline, idle_time);
+}
+
+static void
+espm_idle_timeline_reset_cb (EggIdletime *idle, EspmIdleTimeline *timeline)
+{
+  gint64 period;
+  guint i;
+
+  period = egg_idletime_get_last_period (idle);
+
+  for ( i = 0; i < ESPM_IDLE_N_STAGES; i++ )
+  {
+    /* fired, and the user came back right away */
+    if ( timeline->priv->latency[i] >= 0 && period - timeline->priv->fired_at[i] <= UNDO_WINDOW )
+    {
+      ESPM_DEBUG ("Idle stage %s undone after %" G_GINT64_FORMAT " ms",
+                  stage_names[i], period - timeline->priv->fired_at[i]);
+      timeline->priv->n_undone[i]++;
+    }
+
+    timeline->priv->reached[i] = FALSE;
+    timeline->priv->latency[i] = -1;
+  }
+
+  g_signal_emit (timeline, signals[RESET], 0);
+
+  espm_idle_timeline_arm (timeline, 0);
+}
+
+static void
+espm_idle_timeline_class_init (EspmIdleTimelineClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = espm_idle_timeline_finalize;
+
+  signals[STAGE_REACHED] =
+    g_signal_new ("stage-reached",
+                  ESPM_TYPE_IDLE_TIMELINE,
+                  G_SIGNAL_RUN_LAST,
+                  G_STRUCT_OFFSET (EspmIdleTimelineClass, stage_reached),
+                  NULL, NULL,
+                  g_cclosure_marshal_VOID__UINT,
+                  G_TYPE_NONE, 1, G_TYPE_UINT);
+
+  signals[RESET] =
+    g_signal_new ("reset",
+                  ESPM_TYPE_IDLE_TIMELINE,
+                  G_SIGNAL_RUN_LAST,
+                  G_STRUCT_OFFSET (EspmIdleTimelineClass, reset),
+                  NULL, NULL,
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
+}
+
+static void
+espm_idle_timeline_init (EspmIdleTimeline *timeline)
+{
+  guint i;
+
+  timeline->priv = espm_idle_timeline_get_instance_private (timeline);
+
+  for ( i = 0; i < ESPM_IDLE_N_STAGES; i++ )
+  {
+    timeline->priv->timeouts[i][0] = 0;
+    timeline->priv->timeouts[i][1] = 0;
+    timeline->priv->reached[i] = FALSE;
+    timeline->priv->latency[i] = -1;
+    timeline->priv->fired_at[i] = 0;
+    timeline->priv->n_reached[i] = 0;
+    timeline->priv->n_undone[i] = 0;
+  }
+
+  timeline->priv->on_battery = FALSE;
+  timeline->priv->inhibited = FALSE;
+  timeline->priv->armed = -1;
+
+  timeline->priv->idle = egg_idletime_new ();
+
+  g_signal_connect (timeline->priv->idle, "alarm-expired",
+                    G_CALLBACK (espm_idle_timeline_alarm_expired_cb), timeline);
+  g_signal_connect (timeline->priv->idle, "reset",
+                    G_CALLBACK (espm_idle_timeline_reset_cb), timeline);
+}
+
+static void
+espm_idle_timeline_finalize (GObject *object)
+{
+  EspmIdleTimeline *timeline;
+
+  timeline = ESPM_IDLE_TIMELINE (object);
+
+  g_signal_handlers_disconnect_by_data (timeline->priv->idle, timeline);
+  egg_idletime_alarm_remove (timeline->priv->idle, TIMEOUT_IDLE_TIMELINE);
+  g_object_unref (timeline->priv->idle);
+
+  G_OBJECT_CLASS (espm_idle_timeline_parent_class)->finalize (object);
+}
+
+EspmIdleTimeline *
+espm_idle_timeline_new (void)
+{
+  static gpointer espm_idle_timeline_object = NULL;
+
+  if ( G_LIKELY (espm_idle_timeline_object != NULL ) )
+  {
+    g_object_ref (espm_idle_timeline_object);
+  }
+  else
+  {
+    espm_idle_timeline_object = g_object_new (ESPM_TYPE_IDLE_TIMELINE, NULL);
+    g_object_add_weak_pointer (espm_idle_timeline_object, &espm_idle_timeline_object);
+  }
+
+  return ESPM_IDLE_TIMELINE (espm_idle_timeline_object);
+}
+
+/*
+ * Timeouts are in ms of idle time, 0 disables the stage
+ */
+void
+espm_idle_timeline_set_timeouts (EspmIdleTimeline *timeline,
+                                 EspmIdleStage     stage,
+                                 guint             on_ac,
+                                 guint             on_battery)
+{
+  g_return_if_fail (ESPM_IS_IDLE_TIMELINE (timeline));
+  g_return_if_fail (stage < ESPM_IDLE_N_STAGES);
+
+  if ( timeline->priv->timeouts[stage][0] == on_ac &&
+       timeline->priv->timeouts[stage][1] == on_battery )
+    return;
+
+  ESPM_DEBUG ("Idle stage %s: on ac %u ms, on battery %u ms", stage_names[stage], on_ac, on_battery);
+
+  timeline->priv->timeouts[stage][0] = on_ac;
+  timeline->priv->timeouts[stage][1] = on_battery;
+
+  /* a new timeout ahead of us gets another chance */
+  if ( espm_idle_timeline_get_timeout (timeline, stage) > egg_idletime_get_time (timeline->priv->idle) )
+    timeline->priv->reached[stage] = FALSE;
+
+  espm_idle_timeline_replan (timeline);
+}
+
+void
+espm_idle_timeline_set_on_battery (EspmIdleTimeline *timeline, gboolean on_battery)
+{
+  g_return_if_fail (ESPM_IS_IDLE_TIMELINE (timeline));
+
+  if ( timeline->priv->on_battery == on_battery )
+    return;
+
+  timeline->priv->on_battery = on_battery;
+  espm_idle_timeline_replan (timeline);
+}
+
+/*
+ * While inhibited no stage is armed at all
+ */
+void
+espm_idle_timeline_set_inhibited (EspmIdleTimeline *timeline, gboolean inhibited)
+{
+  g_return_if_fail (ESPM_IS_IDLE_TIMELINE (timeline));
+
+  if ( timeline->priv->inhibited == inhibited )
+    return;
+
+  ESPM_DEBUG ("Idle timeline %s", inhibited ? "inhibited" : "no longer inhibited");
+
+  timeline->priv->inhibited = inhibited;
+  espm_idle_timeline_replan (timeline);
+}
+
+/*
+ * How late the stage fired after its timeout, in ms, or -1 when it
+ * didn't fire since the last input. For debugging.
+ */
+gint64
+espm_idle_timeline_get_latency (EspmIdleTimeline *timeline, EspmIdleStage stage)
+{
+  g_return_val_if_fail (ESPM_IS_IDLE_TIMELINE (timeline), -1);
+  g_return_val_if_fail (stage < ESPM_IDLE_N_STAGES, -1);
+
+  return timeline->priv->latency[stage];
+}
+
+const gchar *
+espm_idle_timeline_get_stage_name (EspmIdleStage stage)
+{
+  g_return_val_if_fail (stage < ESPM_IDLE_N_STAGES, NULL);
+
+  return stage_names[stage];
+}
+
+/*
+ * How often the stage was reached since startup, and how often input
+ * followed within a few seconds, i.e. the timeout was likely too short
+ */
+void
+espm_idle_timeline_get_stats (EspmIdleTimeline *timeline,
+                              EspmIdleStage     stage,
+                              guint            *reached,
+                              guint            *undone)
+{
+  g_return_if_fail (ESPM_IS_IDLE_TIMELINE (timeline));
+  g_return_if_fail (stage < ESPM_IDLE_N_STAGES);
+
+  if ( reached )
+    *reached = timeline->priv->n_reached[stage];
+  if ( undone )
+    *undone = timeline->priv->n_undone[stage];
+}
+
+/***************************************************************************
+ ***                          MAKE CHECK TESTS                           ***
+ ***************************************************************************/
+#ifdef EGG_TEST
+#include "egg-test.h"
+
+static void
+espm_idle_timeline_test_stage_cb (EspmIdleTimeline *timeline, guint stage, GString *events)
+{
+  if ( events->len > 0 )
+    g_string_append_c (events, ' ');
+  g_string_append (events, stage_names[stage]);
+}
+
+static void
+espm_idle_timeline_test_reset_cb (EspmIdleTimeline *timeline, guint *resets)
+{
+  (*resets)++;
+}
+
+void
+espm_idle_timeline_test (gpointer data)
+{
+  EggIdletime *idle;
+  EspmIdleTimeline *timeline;
+  GString *events;
+  guint resets = 0;
+  guint reached, undone;
+  EggTest *test = (EggTest *) data;
+
+  if (egg_test_start (test, "EspmIdleTimeline") == FALSE)
+    return;
+
+  /* the timeline picks up the shared EggIdletime, on a virtual clock */
+  idle = egg_idletime_new_virtual ();
+  timeline = espm_idle_timeline_new ();
+  events = g_string_new (NULL);
+
+  g_signal_connect (timeline, "stage-reached",
+                    G_CALLBACK (espm_idle_timeline_test_stage_cb), events);
+  g_signal_connect (timeline, "reset",
+                    G_CALLBACK (espm_idle_timeline_test_reset_cb), &resets);
+
+  espm_idle_timeline_set_timeouts (timeline, ESPM_IDLE_STAGE_DIM, 10000, 5000);
+  espm_idle_timeline_set_timeouts (timeline, ESPM_IDLE_STAGE_DPMS_OFF, 30000, 20000);
+  espm_idle_timeline_set_timeouts (timeline, ESPM_IDLE_STAGE_SLEEP, 60000, 40000);
+
+  /************************************************************/
+  egg_test_title (test, "check the stages are reached in order");
+  egg_idletime_virtual_advance (idle, 70000);
+  if (g_strcmp0 (events->str, "dim dpms-off sleep") == 0 &&
+      espm_idle_timeline_get_latency (timeline, ESPM_IDLE_STAGE_SLEEP) == 0) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "got '%s', sleep %" G_GINT64_FORMAT " ms late", events->str,
+                     espm_idle_timeline_get_latency (timeline, ESPM_IDLE_STAGE_SLEEP));
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check input starts over from the first stage");
+  g_string_truncate (events, 0);
+  egg_idletime_virtual_activity (idle);
+  egg_idletime_virtual_advance (idle, 10000);
+  if (resets == 1 && g_strcmp0 (events->str, "dim") == 0 &&
+      espm_idle_timeline_get_latency (timeline, ESPM_IDLE_STAGE_SLEEP) == -1) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "%u resets, got '%s'", resets, events->str);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check going on battery skips the stages already behind");
+  g_string_truncate (events, 0);
+  egg_idletime_virtual_advance (idle, 15000);
+  espm_idle_timeline_set_on_battery (timeline, TRUE);
+  egg_idletime_virtual_advance (idle, 15000);
+  if (g_strcmp0 (events->str, "sleep") == 0 &&
+      espm_idle_timeline_get_latency (timeline, ESPM_IDLE_STAGE_DPMS_OFF) == -1) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "got '%s'", events->str);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check input right after a stage counts as undoing it");
+  egg_idletime_virtual_activity (idle);
+  espm_idle_timeline_get_stats (timeline, ESPM_IDLE_STAGE_SLEEP, &reached, &undone);
+  if (reached == 2 && undone == 1) {
+    espm_idle_timeline_get_stats (timeline, ESPM_IDLE_STAGE_DIM, &reached, &undone);
+    if (reached == 2 && undone == 0)
+      egg_test_success (test, NULL);
+    else
+      egg_test_failed (test, "dim reached %u undone %u", reached, undone);
+  } else {
+    egg_test_failed (test, "sleep reached %u undone %u", reached, undone);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check nothing is reached while inhibited");
+  g_string_truncate (events, 0);
+  espm_idle_timeline_set_on_battery (timeline, FALSE);
+  espm_idle_timeline_set_inhibited (timeline, TRUE);
+  egg_idletime_virtual_advance (idle, 70000);
+  espm_idle_timeline_set_inhibited (timeline, FALSE);
+  egg_idletime_virtual_advance (idle, 10000);
+  if (events->len == 0) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "got '%s'", events->str);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check the timeline runs again after the next input");
+  egg_idletime_virtual_activity (idle);
+  egg_idletime_virtual_advance (idle, 10000);
+  if (g_strcmp0 (events->str, "dim") == 0) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "got '%s'", events->str);
+  }
+
+  /************************************************************/
+  egg_test_title (test, "check a timeout moved ahead is reached again");
+  g_string_truncate (events, 0);
+  espm_idle_timeline_set_timeouts (timeline, ESPM_IDLE_STAGE_DIM, 15000, 5000);
+  egg_idletime_virtual_advance (idle, 5000);
+  if (g_strcmp0 (events->str, "dim") == 0) {
+    egg_test_success (test, NULL);
+  } else {
+    egg_test_failed (test, "got '%s'", events->str);
+  }
+
+  g_signal_handlers_disconnect_by_data (timeline, events);
+  g_signal_handlers_disconnect_by_data (timeline, &resets);
+  g_string_free (events, TRUE);
+  g_object_unref (timeline);
+  g_object_unref (idle);
+
+  egg_test_end (test);
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __ESPM_IDLE_TIMELINE_H
+#define __ESPM_IDLE_TIMELINE_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define ESPM_TYPE_IDLE_TIMELINE        (espm_idle_timeline_get_type () )
+#define ESPM_IDLE_TIMELINE(o)          (G_TYPE_CHECK_INSTANCE_CAST((o), ESPM_TYPE_IDLE_TIMELINE, EspmIdleTimeline))
+#define ESPM_IS_IDLE_TIMELINE(o)       (G_TYPE_CHECK_INSTANCE_TYPE((o), ESPM_TYPE_IDLE_TIMELINE))
+
+/* in the order they normally happen, equal timeouts fire in this order */
+typedef enum
+{
+  ESPM_IDLE_STAGE_DIM,
+  ESPM_IDLE_STAGE_BLANK,
+  ESPM_IDLE_STAGE_DPMS_SLEEP,
+  ESPM_IDLE_STAGE_DPMS_OFF,
+  ESPM_IDLE_STAGE_SLEEP,
+  ESPM_IDLE_N_STAGES
+} EspmIdleStage;
+
+typedef struct EspmIdleTimelinePrivate EspmIdleTimelinePrivate;
+
+typedef struct
+{
+  GObject                    parent;
+  EspmIdleTimelinePrivate   *priv;
+} EspmIdleTimeline;
+
+typedef struct
+{
+  GObjectClass       parent_class;
+
+  /* signals */
+  void              (*stage_reached)     (EspmIdleTimeline *timeline,
+                                          guint             stage);
+  void              (*reset)             (EspmIdleTimeline *timeline);
+} EspmIdleTimelineClass;
+
+GType              espm_idle_timeline_get_type       (void) G_GNUC_CONST;
+EspmIdleTimeline  *espm_idle_timeline_new            (void);
+void               espm_idle_timeline_set_timeouts   (EspmIdleTimeline *timeline,
+                                                      EspmIdleStage     stage,
+                                                      guint             on_ac,
+                                                      guint             on_battery);
+void               espm_idle_timeline_set_on_battery (EspmIdleTimeline *timeline,
+                                                      gboolean          on_battery);
+void               espm_idle_timeline_set_inhibited  (EspmIdleTimeline *timeline,
+                                                      gboolean          inhibited);
+gint64             espm_idle_timeline_get_latency    (EspmIdleTimeline *timeline,
+                                                      EspmIdleStage     stage);
+const gchar       *espm_idle_timeline_get_stage_name (EspmIdleStage     stage);
+void               espm_idle_timeline_get_stats      (EspmIdleTimeline *timeline,
+                                                      EspmIdleStage     stage,
+                                                      guint            *reached,
+                                                      guint            *undone);
+#ifdef EGG_TEST
+void               espm_idle_timeline_test           (gpointer          data);
+#endif
+
+G_END_DECLS
+
+#endif /* __ESPM_IDLE_TIMELINE_H */
@@ -47,6 +47,7 @@
 
 #include "expidus-power-manager-dbus.h"
 #include "espm-manager.h"
+#include "egg-idletime.h"
 
 static void G_GNUC_NORETURN
 show_version (void)
@@ -157,12 +158,48 @@ espm_dump (GHashTable *hash)
             espm_bool_to_local_string (has_lid));
 }
 
+/*
+ * stats is the "(aua{s(uu)})" from espm_manager_get_idle_stats()
+ */
+static void
+espm_dump_idle_stats (GVariant *stats)
+{
+  GVariantIter *histogram, *stages;
+  const gchar *name;
+  guint count, reached, undone;
+  gsize i = 0, n_buckets;
+
+  g_variant_get (stats, "(aua{s(uu)})", &histogram, &stages);
+  n_buckets = g_variant_iter_n_children (histogram);
+
+  g_print ("---------------------------------------------------\n");
+  g_print ("%s\n", _("Idle periods"));
+  while (g_variant_iter_next (histogram, "u", &count))
+  {
+    if ( i + 1 == n_buckets )
+      g_print ("  >= %6us: %u\n", 1u << i, count);
+    else
+      g_print ("  %6us - %6us: %u\n", 1u << i, 1u << (i + 1), count);
+    i++;
+  }
+
+  g_print ("%s\n", _("Idle stages reached / undone within 5s"));
+  while (g_variant_iter_next (stages, "{&s(uu)}", &name, &reached, &undone))
+    g_print ("  %s: %u / %u\n", name, reached, undone);
+
+  g_variant_iter_free (histogram);
+  g_variant_iter_free (stages);
+}
+
 static void
 espm_dump_remote (GDBusConnection *bus)
 {
   EspmPowerManager *proxy;
   GError *error = NULL;
+  GError *stats_error = NULL;
   GVariant *config;
+  GVariant *histogram = NULL, *stages = NULL;
+  GVariant *stats;
   GVariantIter *iter;
   GHashTable *hash;
   gchar *key, *value;
@@ -180,14 +217,22 @@ espm_dump_remote (GDBusConnection *bus)
                                            NULL,
                                            &error);
 
-  g_object_unref (proxy);
-
   if ( error )
   {
+    g_object_unref (proxy);
     g_error ("%s", error->message);
     exit (EXIT_FAILURE);
   }
 
+  /* an older instance has no statistics, its config is still worth seeing */
+  espm_power_manager_call_get_idle_stats_sync (proxy,
+                                               &histogram,
+                                               &stages,
+                                               NULL,
+                                               &stats_error);
+
+  g_object_unref (proxy);
+
   hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   g_variant_get (config, "a{ss}", &iter);
   while (g_variant_iter_next (iter, "{ss}", &key, &value))
@@ -199,6 +244,19 @@ espm_dump_remote (GDBusConnection *bus)
 
   espm_dump (hash);
   g_hash_table_destroy (hash);
+
+  if ( stats_error )
+  {
+    g_warning ("Unable to get the idle statistics: %s", stats_error->message);
+    g_error_free (stats_error);
+    return;
+  }
+
+  stats = g_variant_ref_sink (g_variant_new ("(@au@a{s(uu)})", histogram, stages));
+  espm_dump_idle_stats (stats);
+  g_variant_unref (stats);
+  g_variant_unref (histogram);
+  g_variant_unref (stages);
 }
 
 static void G_GNUC_NORETURN
@@ -239,9 +297,15 @@ espm_start (GDBusConnection *bus, const gchar *client_id, gboolean dump)
   if ( dump )
   {
     GHashTable *hash;
+    GVariant *stats;
+
     hash = espm_manager_get_config (manager);
     espm_dump (hash);
     g_hash_table_destroy (hash);
+
+    stats = g_variant_ref_sink (espm_manager_get_idle_stats (manager));
+    espm_dump_idle_stats (stats);
+    g_variant_unref (stats);
   }
 
 
@@ -268,6 +332,7 @@ int main (int argc, char **argv)
   gboolean debug      = FALSE;
   gboolean dump       = FALSE;
   gchar   *client_id  = NULL;
+  gchar   *idle_source = NULL;
 
   GOptionEntry option_entries[] =
   {
@@ -279,6 +344,7 @@ int main (int argc, char **argv)
     { "customize", 'c', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE, &config, N_("Show the configuration dialog"), NULL },
     { "quit", 'q', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE, &quit, N_("Quit any running expidus power manager"), NULL },
     { "version", 'V', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE, &version, N_("Version information"), NULL },
+    { "idle-source", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING, &idle_source, N_("Where to read the idle time from"), "xsync|logind" },
     { "sm-client-id", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_STRING, &client_id, NULL, NULL },
     { NULL, },
   };
@@ -340,6 +406,17 @@ int main (int argc, char **argv)
 
   espm_debug_init (debug);
 
+  if ( idle_source )
+  {
+    if ( !g_strcmp0 (idle_source, "logind") )
+      egg_idletime_set_source (EGG_IDLETIME_SOURCE_LOGIND, NULL);
+    else if ( !g_strcmp0 (idle_source, "xsync") )
+      egg_idletime_set_source (EGG_IDLETIME_SOURCE_XSYNC, NULL);
+    else
+      g_warning ("Unknown idle source %s", idle_source);
+    g_free (idle_source);
+  }
+
   bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
 
   if ( error )
@@ -51,6 +51,7 @@
 #include "espm-backlight.h"
 #include "espm-kbd-backlight.h"
 #include "espm-inhibit.h"
+#include "espm-idle-timeline.h"
 #include "egg-idletime.h"
 #include "espm-config.h"
 #include "espm-debug.h"
@@ -102,7 +103,7 @@ struct EspmManagerPrivate
   EspmDBusMonitor    *monitor;
   EspmInhibit        *inhibit;
   ExpidusScreenSaver    *screensaver;
-  EggIdletime        *idle;
+  EspmIdleTimeline   *timeline;
   GtkStatusIcon      *adapter_icon;
   GtkWidget          *power_button;
   gint                show_tray_icon;
@@ -182,7 +183,7 @@ espm_manager_finalize (GObject *object)
     g_object_unref (manager->priv->console);
   g_object_unref (manager->priv->monitor);
   g_object_unref (manager->priv->inhibit);
-  g_object_unref (manager->priv->idle);
+  g_object_unref (manager->priv->timeline);
 
   g_timer_destroy (manager->priv->timer);
 
@@ -417,7 +418,7 @@ static void
 espm_manager_lid_changed_cb (EspmPower *power, gboolean lid_is_closed, EspmManager *manager)
 {
   EspmLidTriggerAction action;
-  gboolean on_battery, logind_handle_lid_switch;
+  gboolean on_battery, logind_handle_lid_switch, panel_only;
 
   if ( LOGIND_RUNNING() )
   {
@@ -435,6 +436,7 @@ espm_manager_lid_changed_cb (EspmPower *power, gboolean lid_is_closed, EspmManag
 
   g_object_get (G_OBJECT (manager->priv->conf),
                 on_battery ? LID_SWITCH_ON_BATTERY_CFG : LID_SWITCH_ON_AC_CFG, &action,
+                LID_CLOSE_PANEL_ONLY, &panel_only,
                 NULL);
 
   if ( lid_is_closed )
@@ -445,10 +447,18 @@ espm_manager_lid_changed_cb (EspmPower *power, gboolean lid_is_closed, EspmManag
     {
       if ( !espm_is_multihead_connected () )
         espm_dpms_force_level (manager->priv->dpms, DPMSModeOff);
+      else if ( panel_only )
+        espm_dpms_panel_off (manager->priv->dpms);
     }
     else if ( action == LID_TRIGGER_LOCK_SCREEN )
     {
-      if ( !espm_is_multihead_connected () )
+      /* docked, keep the external outputs running */
+      if ( espm_is_multihead_connected () )
+      {
+        if ( panel_only )
+          espm_dpms_panel_off (manager->priv->dpms);
+      }
+      else
       {
         if (!expidus_screensaver_lock (manager->priv->screensaver))
         {
@@ -473,6 +483,7 @@ espm_manager_lid_changed_cb (EspmPower *power, gboolean lid_is_closed, EspmManag
   {
     ESPM_DEBUG_ENUM (action, ESPM_TYPE_LID_TRIGGER_ACTION, "LID opened");
 
+    espm_dpms_panel_on (manager->priv->dpms);
     espm_dpms_force_level (manager->priv->dpms, DPMSModeOn);
   }
 }
@@ -484,51 +495,44 @@ espm_manager_inhibit_changed_cb (EspmInhibit *inhibit, gboolean inhibited, EspmM
 }
 
 static void
-espm_manager_alarm_timeout_cb (EggIdletime *idle, guint id, EspmManager *manager)
+espm_manager_stage_reached_cb (EspmIdleTimeline *timeline, guint stage, EspmManager *manager)
 {
+  EspmShutdownRequest sleep_mode = ESPM_DO_NOTHING;
+  gboolean on_battery;
+
+  if ( stage != ESPM_IDLE_STAGE_SLEEP )
+    return;
+
   if (espm_power_is_in_presentation_mode (manager->priv->power) == TRUE)
     return;
 
-  ESPM_DEBUG ("Alarm inactivity timeout id %d", id);
+  ESPM_DEBUG ("Inactivity timeout");
 
-  if ( id == TIMEOUT_INACTIVITY_ON_AC || id == TIMEOUT_INACTIVITY_ON_BATTERY )
+  if ( manager->priv->inhibited )
   {
-    EspmShutdownRequest sleep_mode = ESPM_DO_NOTHING;
-    gboolean on_battery;
-
-    if ( manager->priv->inhibited )
-    {
-      ESPM_DEBUG ("Idle sleep alarm timeout, but power manager is currently inhibited, action ignored");
-      return;
-    }
+    ESPM_DEBUG ("Idle sleep alarm timeout, but power manager is currently inhibited, action ignored");
+    return;
+  }
 
-    if ( id == TIMEOUT_INACTIVITY_ON_AC)
-      g_object_get (G_OBJECT (manager->priv->conf),
-                    INACTIVITY_SLEEP_MODE_ON_AC, &sleep_mode,
-                    NULL);
-    else
-      g_object_get (G_OBJECT (manager->priv->conf),
-                    INACTIVITY_SLEEP_MODE_ON_BATTERY, &sleep_mode,
-                    NULL);
+  g_object_get (G_OBJECT (manager->priv->power),
+                "on-battery", &on_battery,
+                NULL);
 
-    g_object_get (G_OBJECT (manager->priv->power),
-                  "on-battery", &on_battery,
-                  NULL);
+  g_object_get (G_OBJECT (manager->priv->conf),
+                on_battery ? INACTIVITY_SLEEP_MODE_ON_BATTERY : INACTIVITY_SLEEP_MODE_ON_AC, &sleep_mode,
+                NULL);
 
-    if ( id == TIMEOUT_INACTIVITY_ON_AC && on_battery == FALSE )
-      espm_manager_sleep_request (manager, sleep_mode, FALSE);
-    else if ( id ==  TIMEOUT_INACTIVITY_ON_BATTERY && on_battery )
-      espm_manager_sleep_request (manager, sleep_mode, FALSE);
-  }
+  espm_manager_sleep_request (manager, sleep_mode, FALSE);
 }
 
 static void
-espm_manager_set_idle_alarm_on_ac (EspmManager *manager)
+espm_manager_set_idle_alarm (EspmManager *manager)
 {
-  guint on_ac;
+  guint on_ac, on_battery;
 
   g_object_get (G_OBJECT (manager->priv->conf),
                 ON_AC_INACTIVITY_TIMEOUT, &on_ac,
+                ON_BATTERY_INACTIVITY_TIMEOUT, &on_battery,
                 NULL);
 
 #ifdef DEBUG
@@ -536,55 +540,16 @@ espm_manager_set_idle_alarm_on_ac (EspmManager *manager)
     TRACE ("setting inactivity sleep timeout on ac to never");
   else
     TRACE ("setting inactivity sleep timeout on ac to %d", on_ac);
-#endif
-
-  if ( on_ac == 14 )
-  {
-    egg_idletime_alarm_remove (manager->priv->idle, TIMEOUT_INACTIVITY_ON_AC );
-  }
-  else
-  {
-    egg_idletime_alarm_set (manager->priv->idle, TIMEOUT_INACTIVITY_ON_AC, on_ac * 1000 * 60);
-  }
-}
-
-static void
-espm_manager_set_idle_alarm_on_battery (EspmManager *manager)
-{
-  guint on_battery;
-
-  g_object_get (G_OBJECT (manager->priv->conf),
-                ON_BATTERY_INACTIVITY_TIMEOUT, &on_battery,
-                NULL);
-
-#ifdef DEBUG
   if ( on_battery == 14 )
     TRACE ("setting inactivity sleep timeout on battery to never");
   else
     TRACE ("setting inactivity sleep timeout on battery to %d", on_battery);
 #endif
 
-  if ( on_battery == 14 )
-  {
-    egg_idletime_alarm_remove (manager->priv->idle, TIMEOUT_INACTIVITY_ON_BATTERY );
-  }
-  else
-  {
-    egg_idletime_alarm_set (manager->priv->idle, TIMEOUT_INACTIVITY_ON_BATTERY, on_battery * 1000 * 60);
-  }
-}
-
-static void
-espm_manager_on_battery_changed_cb (EspmPower *power, gboolean on_battery, EspmManager *manager)
-{
-  egg_idletime_alarm_reset_all (manager->priv->idle);
-}
-
-static void
-espm_manager_set_idle_alarm (EspmManager *manager)
-{
-  espm_manager_set_idle_alarm_on_ac (manager);
-  espm_manager_set_idle_alarm_on_battery (manager);
+  /* 14 is never */
+  espm_idle_timeline_set_timeouts (manager->priv->timeline, ESPM_IDLE_STAGE_SLEEP,
+                                   on_ac == 14 ? 0 : on_ac * 1000 * 60,
+                                   on_battery == 14 ? 0 : on_battery * 1000 * 60);
 }
 
 static gchar*
@@ -861,7 +826,7 @@ void espm_manager_start (EspmManager *manager)
 
   manager->priv->monitor = espm_dbus_monitor_new ();
   manager->priv->inhibit = espm_inhibit_new ();
-  manager->priv->idle = egg_idletime_new ();
+  manager->priv->timeline = espm_idle_timeline_new ();
 
     /* Don't allow systemd to handle power/suspend/hibernate buttons
      * and lid-switch */
@@ -874,12 +839,12 @@ void espm_manager_start (EspmManager *manager)
     g_clear_error (&error);
   }
 
-  g_signal_connect (manager->priv->idle, "alarm-expired",
-                    G_CALLBACK (espm_manager_alarm_timeout_cb), manager);
+  g_signal_connect (manager->priv->timeline, "stage-reached",
+                    G_CALLBACK (espm_manager_stage_reached_cb), manager);
   g_signal_connect_swapped (manager->priv->conf, "notify::" ON_AC_INACTIVITY_TIMEOUT,
-                            G_CALLBACK (espm_manager_set_idle_alarm_on_ac), manager);
+                            G_CALLBACK (espm_manager_set_idle_alarm), manager);
   g_signal_connect_swapped (manager->priv->conf, "notify::" ON_BATTERY_INACTIVITY_TIMEOUT,
-                            G_CALLBACK (espm_manager_set_idle_alarm_on_battery), manager);
+                            G_CALLBACK (espm_manager_set_idle_alarm), manager);
   g_signal_connect_swapped (manager->priv->conf, "notify::" LOGIND_HANDLE_POWER_KEY,
                             G_CALLBACK (espm_manager_systemd_events_changed), manager);
   g_signal_connect_swapped (manager->priv->conf, "notify::" LOGIND_HANDLE_SUSPEND_KEY,
@@ -908,9 +873,6 @@ void espm_manager_start (EspmManager *manager)
   g_signal_connect (manager->priv->power, "lid-changed",
                     G_CALLBACK (espm_manager_lid_changed_cb), manager);
 
-  g_signal_connect (manager->priv->power, "on-battery-changed",
-                    G_CALLBACK (espm_manager_on_battery_changed_cb), manager);
-
   g_signal_connect_swapped (manager->priv->power, "waking-up",
                             G_CALLBACK (espm_manager_reset_sleep_timer), manager);
 
@@ -1012,6 +974,38 @@ GHashTable *espm_manager_get_config (EspmManager *manager)
   return hash;
 }
 
+/*
+ * The idle histogram and per stage counters, as "(aua{s(uu)})"
+ */
+GVariant *
+espm_manager_get_idle_stats (EspmManager *manager)
+{
+  GVariantBuilder histogram, stages;
+  EggIdletime *idle;
+  const guint *buckets;
+  guint reached, undone;
+  guint i;
+
+  idle = egg_idletime_new ();
+  buckets = egg_idletime_get_histogram (idle);
+
+  g_variant_builder_init (&histogram, G_VARIANT_TYPE ("au"));
+  for ( i = 0; i < EGG_IDLETIME_HISTOGRAM_BUCKETS; i++ )
+    g_variant_builder_add (&histogram, "u", buckets[i]);
+
+  g_object_unref (idle);
+
+  g_variant_builder_init (&stages, G_VARIANT_TYPE ("a{s(uu)}"));
+  for ( i = 0; i < ESPM_IDLE_N_STAGES; i++ )
+  {
+    espm_idle_timeline_get_stats (manager->priv->timeline, i, &reached, &undone);
+    g_variant_builder_add (&stages, "{s(uu)}",
+                           espm_idle_timeline_get_stage_name (i), reached, undone);
+  }
+
+  return g_variant_new ("(aua{s(uu)})", &histogram, &stages);
+}
+
 /*
  *
  * DBus server implementation
@@ -1033,6 +1027,22 @@ static gboolean espm_manager_dbus_get_info   (EspmManager *manager,
                                               GDBusMethodInvocation *invocation,
                                               gpointer user_data);
 
+static gboolean espm_manager_dbus_get_idle_stats (EspmManager *manager,
+                                                  GDBusMethodInvocation *invocation,
+                                                  gpointer user_data);
+
+static gboolean espm_manager_dbus_get_history (EspmManager *manager,
+                                               GDBusMethodInvocation *invocation,
+                                               const gchar *device,
+                                               guint64 from,
+                                               guint64 to,
+                                               gpointer user_data);
+
+static gboolean espm_manager_dbus_get_time_estimate (EspmManager *manager,
+                                                     GDBusMethodInvocation *invocation,
+                                                     const gchar *device,
+                                                     gpointer user_data);
+
 #include "expidus-power-manager-dbus.h"
 
 static void
@@ -1066,6 +1076,18 @@ espm_manager_dbus_init (EspmManager *manager)
                             "handle-get-info",
                             G_CALLBACK (espm_manager_dbus_get_info),
                             manager);
+  g_signal_connect_swapped (manager_dbus,
+                            "handle-get-idle-stats",
+                            G_CALLBACK (espm_manager_dbus_get_idle_stats),
+                            manager);
+  g_signal_connect_swapped (manager_dbus,
+                            "handle-get-history",
+                            G_CALLBACK (espm_manager_dbus_get_history),
+                            manager);
+  g_signal_connect_swapped (manager_dbus,
+                            "handle-get-time-estimate",
+                            G_CALLBACK (espm_manager_dbus_get_time_estimate),
+                            manager);
 }
 
 static gboolean
@@ -1143,3 +1165,85 @@ espm_manager_dbus_get_info (EspmManager *manager,
 
   return TRUE;
 }
+
+static gboolean
+espm_manager_dbus_get_idle_stats (EspmManager *manager,
+                                  GDBusMethodInvocation *invocation,
+                                  gpointer user_data)
+{
+  GVariant *stats, *histogram, *stages;
+
+  stats = g_variant_ref_sink (espm_manager_get_idle_stats (manager));
+  g_variant_get (stats, "(@au@a{s(uu)})", &histogram, &stages);
+
+  espm_power_manager_complete_get_idle_stats (user_data,
+                                              invocation,
+                                              histogram,
+                                              stages);
+
+  g_variant_unref (histogram);
+  g_variant_unref (stages);
+  g_variant_unref (stats);
+
+  return TRUE;
+}
+
+static gboolean
+espm_manager_dbus_get_history (EspmManager *manager,
+                               GDBusMethodInvocation *invocation,
+                               const gchar *device,
+                               guint64 from,
+                               guint64 to,
+                               gpointer user_data)
+{
+  GVariant *samples;
+
+  samples = espm_power_get_history (manager->priv->power,
+                                    device,
+                                    MIN (from, G_MAXINT64),
+                                    MIN (to, G_MAXINT64));
+  if ( samples == NULL )
+  {
+    g_dbus_method_invocation_return_error (invocation,
+                                           ESPM_ERROR,
+                                           ESPM_ERROR_INVALID_ARGUMENTS,
+                                           _("No history for %s"),
+                                           device);
+    return TRUE;
+  }
+
+  espm_power_manager_complete_get_history (user_data,
+                                           invocation,
+                                           samples);
+
+  return TRUE;
+}
+
+static gboolean
+espm_manager_dbus_get_time_estimate (EspmManager *manager,
+                                     GDBusMethodInvocation *invocation,
+                                     const gchar *device,
+                                     gpointer user_data)
+{
+  guint64 time_to_empty, time_to_full;
+
+  if ( !espm_power_get_time_estimate (manager->priv->power,
+                                      device,
+                                      &time_to_empty,
+                                      &time_to_full) )
+  {
+    g_dbus_method_invocation_return_error (invocation,
+                                           ESPM_ERROR,
+                                           ESPM_ERROR_INVALID_ARGUMENTS,
+                                           _("No estimate for %s"),
+                                           device);
+    return TRUE;
+  }
+
+  espm_power_manager_complete_get_time_estimate (user_data,
+                                                 invocation,
+                                                 time_to_empty,
+                                                 time_to_full);
+
+  return TRUE;
+}
@@ -50,6 +50,8 @@ void               espm_manager_start           (EspmManager *manager);
 void               espm_manager_stop            (EspmManager *manager);
 GHashTable        *espm_manager_get_config      (EspmManager *manager);
 
+GVariant          *espm_manager_get_idle_stats  (EspmManager *manager);
+
 G_END_DECLS
 
 #endif /* __ESPM_MANAGER_H */
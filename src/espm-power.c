@@ -57,7 +57,7 @@
 #include "espm-config.h"
 #include "espm-debug.h"
 #include "espm-enum-types.h"
-#include "egg-idletime.h"
+#include "espm-idle-timeline.h"
 #include "espm-systemd.h"
 #include "espm-suspend.h"
 #include "espm-brightness.h"
@@ -100,11 +100,14 @@ struct EspmPowerPrivate
   EspmBatteryCharge overall_state;
   gboolean          critical_action_done;
 
+  /* number of devices counted in each charge state */
+  guint             charge_counts[ESPM_BATTERY_CHARGE_OK + 1];
+
   EspmDpms         *dpms;
   gboolean          presentation_mode;
   gint              on_ac_blank;
   gint              on_battery_blank;
-  EggIdletime      *idletime;
+  EspmIdleTimeline *timeline;
 
   gboolean          inhibited;
   gboolean          screensaver_inhibited;
@@ -163,6 +166,17 @@ enum
 
 static guint signals [LAST_SIGNAL] = { 0 };
 
+/* what a device last added to the charge counts */
+typedef struct
+{
+  EspmBatteryCharge charge;
+  gboolean          is_battery;   /* batteries and UPSes always count */
+  gboolean          ac_online;    /* other devices only while on ac */
+  gboolean          counted;
+} EspmPowerCharge;
+
+static GQuark espm_power_charge_quark = 0;
+
 
 G_DEFINE_TYPE_WITH_PRIVATE (EspmPower, espm_power, G_TYPE_OBJECT)
 
@@ -238,28 +252,67 @@ espm_power_check_polkit_auth (EspmPower *power)
 }
 #endif
 
+/*
+ * Move the device's count to its current charge state
+ */
+static void
+espm_power_charge_update (EspmPower *power, EspmBattery *battery, gboolean ac_online)
+{
+  EspmPowerCharge *charge;
+
+  charge = g_object_get_qdata (G_OBJECT (battery), espm_power_charge_quark);
+  if ( charge == NULL )
+    return;
+
+  if ( charge->counted )
+    power->priv->charge_counts[charge->charge]--;
+
+  charge->charge = espm_battery_get_charge (battery);
+  charge->ac_online = ac_online;
+  charge->counted = charge->is_battery || charge->ac_online;
+
+  if ( charge->counted )
+    power->priv->charge_counts[charge->charge]++;
+}
+
+static void
+espm_power_charge_remove (EspmPower *power, EspmBattery *battery)
+{
+  EspmPowerCharge *charge;
+
+  charge = g_object_get_qdata (G_OBJECT (battery), espm_power_charge_quark);
+  if ( charge == NULL )
+    return;
+
+  if ( charge->counted )
+    power->priv->charge_counts[charge->charge]--;
+
+  g_object_set_qdata (G_OBJECT (battery), espm_power_charge_quark, NULL);
+}
+
 static void
 espm_power_check_power (EspmPower *power, gboolean on_battery)
 {
   if (on_battery != power->priv->on_battery )
   {
-    GList *list;
-    guint len, i;
+    GHashTableIter iter;
+    EspmBattery *battery;
     g_signal_emit (G_OBJECT (power), signals [ON_BATTERY_CHANGED], 0, on_battery);
 
     espm_dpms_set_on_battery (power->priv->dpms, on_battery);
+    espm_idle_timeline_set_on_battery (power->priv->timeline, on_battery);
 
       /* Dismiss critical notifications on battery state changes */
     espm_notify_close_critical (power->priv->notify);
 
     power->priv->on_battery = on_battery;
-    list = g_hash_table_get_values (power->priv->hash);
-    len = g_list_length (list);
-    for ( i = 0; i < len; i++)
+    g_hash_table_iter_init (&iter, power->priv->hash);
+    while ( g_hash_table_iter_next (&iter, NULL, (gpointer *) &battery) )
     {
-      g_object_set (G_OBJECT (g_list_nth_data (list, i)),
+      g_object_set (G_OBJECT (battery),
                     "ac-online", !on_battery,
                     NULL);
+      espm_power_charge_update (power, battery, !on_battery);
       espm_update_blank_time (power);
     }
   }
@@ -439,8 +492,11 @@ espm_power_sleep (EspmPower *power, const gchar *sleep_time, gboolean force)
       gtk_widget_destroy (dialog);
 
       if ( !ret || ret == GTK_RESPONSE_NO)
+      {
+        g_object_unref (brightness);
         return;
       }
+      }
     }
 
     /* This is fun, here's the order of operations:
@@ -496,7 +552,12 @@ espm_power_sleep (EspmPower *power, const gchar *sleep_time, gboolean force)
     /* Check/update any changes while we slept */
   espm_power_get_properties (power);
     /* Restore the brightness level from before we suspended */
-  espm_brightness_set_level (brightness, brightness_level);
+  espm_brightness_set_transition_duration (brightness,
+      esconf_channel_get_uint (espm_esconf_get_channel (power->priv->conf),
+                               ESPM_PROPERTIES_PREFIX BRIGHTNESS_TRANSITION_DURATION,
+                               250));
+  espm_brightness_transition_to (brightness, brightness_level);
+  g_object_unref (brightness);
 
 #ifdef WITH_NETWORK_MANAGER
   if ( network_manager_sleep )
@@ -533,33 +594,13 @@ espm_power_shutdown_clicked (EspmPower *power)
 static EspmBatteryCharge
 espm_power_get_current_charge_state (EspmPower *power)
 {
-  GList *list;
-  guint len, i;
-  gboolean power_supply;
-  EspmBatteryCharge max_charge_status = ESPM_BATTERY_CHARGE_UNKNOWN;
-
-  list = g_hash_table_get_values (power->priv->hash);
-  len = g_list_length (list);
+  EspmBatteryCharge charge;
 
-  for ( i = 0; i < len; i++ )
-  {
-    EspmBatteryCharge battery_charge;
-    UpDeviceKind type;
+  for ( charge = ESPM_BATTERY_CHARGE_OK; charge > ESPM_BATTERY_CHARGE_UNKNOWN; charge-- )
+    if ( power->priv->charge_counts[charge] > 0 )
+      return charge;
 
-    g_object_get (G_OBJECT (g_list_nth_data (list, i)),
-                    "charge-status", &battery_charge,
-                    "device-type", &type,
-                    "ac-online", &power_supply,
-                    NULL);
-    if ( type != UP_DEVICE_KIND_BATTERY &&
-         type != UP_DEVICE_KIND_UPS &&
-         power_supply != TRUE)
-      continue;
-
-    max_charge_status = MAX (max_charge_status, battery_charge);
-  }
-
-  return max_charge_status;
+  return ESPM_BATTERY_CHARGE_UNKNOWN;
 }
 
 static void
@@ -795,9 +836,14 @@ static void
 espm_power_battery_charge_changed_cb (EspmBattery *battery, EspmPower *power)
 {
   gboolean notify;
+  EspmPowerCharge *charge;
   EspmBatteryCharge battery_charge;
   EspmBatteryCharge current_charge;
 
+  charge = g_object_get_qdata (G_OBJECT (battery), espm_power_charge_quark);
+  if ( charge != NULL )
+    espm_power_charge_update (power, battery, charge->ac_online);
+
   battery_charge = espm_battery_get_charge (battery);
   current_charge = espm_power_get_current_charge_state (power);
 
@@ -895,6 +941,7 @@ espm_power_add_device (UpDevice *device, EspmPower *power)
        device_type == UP_DEVICE_KIND_PHONE)
   {
     GtkWidget *battery;
+    EspmPowerCharge *charge;
     ESPM_DEBUG( "Battery device type '%s' detected at: %s",
                 up_device_kind_to_string(device_type), object_path);
     battery = espm_battery_new ();
@@ -904,6 +951,12 @@ espm_power_add_device (UpDevice *device, EspmPower *power)
                                  device_type);
     g_hash_table_insert (power->priv->hash, g_strdup (object_path), battery);
 
+    /* new batteries start out with ac-online set */
+    charge = g_new0 (EspmPowerCharge, 1);
+    charge->is_battery = device_type == UP_DEVICE_KIND_BATTERY || device_type == UP_DEVICE_KIND_UPS;
+    g_object_set_qdata_full (G_OBJECT (battery), espm_power_charge_quark, charge, g_free);
+    espm_power_charge_update (power, ESPM_BATTERY (battery), TRUE);
+
     g_signal_connect (battery, "battery-charge-changed",
                       G_CALLBACK (espm_power_battery_charge_changed_cb), power);
   }
@@ -937,6 +990,12 @@ espm_power_get_power_devices (EspmPower *power)
 static void
 espm_power_remove_device (EspmPower *power, const gchar *object_path)
 {
+  EspmBattery *battery;
+
+  battery = g_hash_table_lookup (power->priv->hash, object_path);
+  if ( battery != NULL )
+    espm_power_charge_remove (power, battery);
+
   g_hash_table_remove (power->priv->hash, object_path);
 }
 
@@ -1014,6 +1073,8 @@ espm_power_class_init (EspmPowerClass *klass)
 
   object_class->finalize = espm_power_finalize;
 
+  espm_power_charge_quark = g_quark_from_static_string ("espm-power-charge");
+
   object_class->get_property = espm_power_get_property;
   object_class->set_property = espm_power_set_property;
 
@@ -1186,6 +1247,7 @@ espm_power_init (EspmPower *power)
   power->priv->critical_action_done = FALSE;
 
   power->priv->dpms                 = espm_dpms_new ();
+  power->priv->timeline             = espm_idle_timeline_new ();
 
   power->priv->presentation_mode    = FALSE;
   power->priv->on_ac_blank          = 15;
@@ -1302,14 +1364,12 @@ espm_power_set_property (GObject *object,
     case PROP_ON_AC_BLANK:
       on_ac_blank = g_value_get_int (value);
       power->priv->on_ac_blank = on_ac_blank;
-      if (!power->priv->on_battery)
-        espm_update_blank_time (power);
+      espm_update_blank_time (power);
       break;
     case PROP_ON_BATTERY_BLANK:
       on_battery_blank = g_value_get_int (value);
       power->priv->on_battery_blank = on_battery_blank;
-      if (power->priv->on_battery)
-        espm_update_blank_time (power);
+      espm_update_blank_time (power);
       break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -1346,6 +1406,8 @@ espm_power_finalize (GObject *object)
 
   g_object_unref(power->priv->dpms);
 
+  g_object_unref (power->priv->timeline);
+
   G_OBJECT_CLASS (espm_power_parent_class)->finalize (object);
 }
 
@@ -1424,6 +1486,11 @@ gboolean espm_power_has_battery (EspmPower *power)
   return ret;
 }
 
+/*
+ * The X server blanks the screen itself, so clients holding it off with
+ * XScreenSaverSuspend or "xset s off" keep working. The blank stage on
+ * the idle timeline only follows along, for ordering and statistics.
+ */
 static void
 espm_update_blank_time (EspmPower *power)
 {
@@ -1431,10 +1498,14 @@ espm_update_blank_time (EspmPower *power)
   Display* display = gdk_x11_display_get_xdisplay(gdk_display_get_default ());
   guint screensaver_timeout;
 
+  espm_idle_timeline_set_timeouts (power->priv->timeline, ESPM_IDLE_STAGE_BLANK,
+                                   MAX (power->priv->on_ac_blank, 0) * 60 * 1000,
+                                   MAX (power->priv->on_battery_blank, 0) * 60 * 1000);
+
   if (power->priv->on_battery)
-    screensaver_timeout = power->priv->on_battery_blank;
+    screensaver_timeout = MAX (power->priv->on_battery_blank, 0);
   else
-    screensaver_timeout = power->priv->on_ac_blank;
+    screensaver_timeout = MAX (power->priv->on_ac_blank, 0);
 
     /* Presentation mode disables blanking */
   if (power->priv->presentation_mode)
@@ -1443,9 +1514,12 @@ espm_update_blank_time (EspmPower *power)
   screensaver_timeout = screensaver_timeout * 60;
 
   XGetScreenSaver(display, &prev_timeout, &prev_interval, &prev_prefer_blanking, &prev_allow_exposures);
-  ESPM_DEBUG ("Prev Timeout: %d / New Timeout: %d", prev_timeout, screensaver_timeout);
-  XSetScreenSaver(display, screensaver_timeout, prev_interval, prev_prefer_blanking, prev_allow_exposures);
-  XSync (display, FALSE);
+  if ( prev_timeout != (int) screensaver_timeout )
+  {
+    ESPM_DEBUG ("Prev Timeout: %d / New Timeout: %d", prev_timeout, screensaver_timeout);
+    XSetScreenSaver(display, screensaver_timeout, prev_interval, prev_prefer_blanking, prev_allow_exposures);
+    XSync (display, FALSE);
+  }
 }
 
 static void
@@ -1476,22 +1550,18 @@ espm_power_change_presentation_mode (EspmPower *power, gboolean presentation_mod
   }
   else
   {
-    EggIdletime *idletime;
-
     /* make sure we remove the screensaver inhibit */
     if (power->priv->screensaver_inhibited && !power->priv->inhibited)
     {
       expidus_screensaver_inhibit (power->priv->screensaver, FALSE);
       power->priv->screensaver_inhibited = FALSE;
     }
-
-    /* reset the timers */
-    idletime = egg_idletime_new ();
-    egg_idletime_alarm_reset_all (idletime);
-
-    g_object_unref (idletime);
   }
 
+  /* no idle stage is armed during a presentation, they are planned
+   * again from the current idle time when it ends */
+  espm_idle_timeline_set_inhibited (power->priv->timeline, presentation_mode);
+
   ESPM_DEBUG ("is_inhibit %s, screensaver_inhibited %s, presentation_mode %s",
   power->priv->inhibited ? "TRUE" : "FALSE",
   power->priv->screensaver_inhibited ? "TRUE" : "FALSE",
@@ -1508,6 +1578,49 @@ espm_power_is_in_presentation_mode (EspmPower *power)
   return power->priv->presentation_mode || power->priv->inhibited;
 }
 
+/*
+ * Charge history of the UPower device at object_path, NULL if we
+ * don't keep one for it.
+ */
+GVariant *
+espm_power_get_history (EspmPower *power,
+                        const gchar *object_path,
+                        gint64 from,
+                        gint64 to)
+{
+  EspmBattery *battery;
+
+  g_return_val_if_fail (ESPM_IS_POWER (power), NULL);
+
+  battery = g_hash_table_lookup (power->priv->hash, object_path);
+  if ( battery == NULL )
+    return NULL;
+
+  return espm_battery_get_history (battery, from, to);
+}
+
+/*
+ * Smoothed time to empty and to full of the UPower device at
+ * object_path, FALSE if we don't watch it.
+ */
+gboolean
+espm_power_get_time_estimate (EspmPower *power,
+                              const gchar *object_path,
+                              guint64 *time_to_empty,
+                              guint64 *time_to_full)
+{
+  EspmBattery *battery;
+
+  g_return_val_if_fail (ESPM_IS_POWER (power), FALSE);
+
+  battery = g_hash_table_lookup (power->priv->hash, object_path);
+  if ( battery == NULL )
+    return FALSE;
+
+  espm_battery_get_time_estimate (battery, time_to_empty, time_to_full);
+  return TRUE;
+}
+
 
 /*
  *
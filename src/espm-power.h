@@ -62,6 +62,14 @@ void        espm_power_hibernate                (EspmPower *power,
                                                  gboolean force);
 gboolean    espm_power_has_battery              (EspmPower *power);
 gboolean    espm_power_is_in_presentation_mode  (EspmPower *power);
+GVariant   *espm_power_get_history              (EspmPower *power,
+                                                 const gchar *object_path,
+                                                 gint64 from,
+                                                 gint64 to);
+gboolean    espm_power_get_time_estimate        (EspmPower *power,
+                                                 const gchar *object_path,
+                                                 guint64 *time_to_empty,
+                                                 guint64 *time_to_full);
 
 G_END_DECLS
 
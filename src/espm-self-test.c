@@ -0,0 +1,54 @@
+/*
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Runs the EGG_TEST blocks that need neither a display nor a human,
+ * see "make check".
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "egg-test.h"
+#include "egg-idletime.h"
+#include "espm-idle-timeline.h"
+#include "espm-brightness.h"
+#include "espm-battery-estimator.h"
+#include "espm-battery-history.h"
+
+int
+main (int argc, char **argv)
+{
+  EggTest *test;
+
+  test = egg_test_init ();
+
+  egg_idletime_virtual_test (test);
+  espm_idle_timeline_test (test);
+  egg_idletime_logind_test (test);
+#if !defined(BACKEND_TYPE_FREEBSD)
+  espm_brightness_test (test);
+#endif
+  espm_battery_estimator_test (test);
+  espm_battery_history_test (test);
+
+  return egg_test_finish (test);
+}